@@ -2,6 +2,7 @@
 #define BFTPS_H
 
 #include <limits.h>
+#include <stdint.h>
 #define MAX_PATH PATH_MAX 
 
 #ifdef __cplusplus
@@ -14,19 +15,39 @@ extern "C" {
     
     typedef struct _bftps_file_transfer_t {
         bftps_file_transfer_mode_t mode;
-        unsigned int fileSize; // This is only valid for sending files
-        unsigned int filePosition;
+        uint64_t fileSize; // This is only valid for sending files
+        uint64_t filePosition;
         struct _bftps_file_transfer_t* next;
         char name[MAX_PATH];
     } bftps_file_transfer_t;
-    
-    extern int bftps_start(); 
+
+    typedef enum {
+        BFTPS_CACHE_METADATA, /* stat results used by SIZE/MDTM/MLST/RETR */
+        BFTPS_CACHE_FD, /* read-only descriptors shared by downloads */
+        BFTPS_CACHE_FILE, /* contents of small files */
+        BFTPS_CACHE_DEFLATE, /* MODE Z variants of files, on disk */
+    } bftps_cache_t;
+
+    typedef struct {
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions; /* entries dropped to make room */
+        unsigned long invalidations; /* entries dropped because they changed or expired */
+        unsigned long entries;
+        unsigned long capacity; /* max entries, 0 if only limited by budget */
+        unsigned long long bytes; /* memory used by the entries contents */
+        unsigned long long budget; /* max memory for the entries contents */
+    } bftps_cache_stats_t;
+
+    extern int bftps_start();
     extern int bftps_stop();
     extern const char* bftps_name();
 
     extern const bftps_file_transfer_t* bftps_file_transfer_retrieve();
     extern void bftps_file_transfer_cleanup(const bftps_file_transfer_t* file_transfer);
 
+    extern int bftps_cache_stats(bftps_cache_t cache, bftps_cache_stats_t* stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,6 +11,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
 #include <arpa/inet.h>
 
 #ifdef _3DS
@@ -22,7 +25,19 @@
 #include "event.h"
 #include "time.h"
 #include "bftps_session.h"
+#include "bftps_session_registry.h"
 #include "bftps_socket.h"
+#include "bftps_cache_meta.h"
+#include "bftps_cache_fd.h"
+#include "bftps_cache_file.h"
+#include "bftps_cache_deflate.h"
+#include "bftps_transfer_direct.h"
+#include "bftps_transfer_sync.h"
+#include "bftps_transfer_copy.h"
+#include "bftps_transfer_tree.h"
+#include "bftps_transfer_pool.h"
+#include "bftps_transfer_pasv.h"
+#include "bftps_transfer_demux.h"
 #include "atomic.h"
 
 #include "macros.h"
@@ -37,6 +52,25 @@ static u32* SOCU_buffer = NULL;
 
 #define BFTPS_MAX_CONNECTIONS 4
 #define BFTPS_PORT_LISTEN 5000
+// all can be overridden at build time
+#ifndef BFTPS_LISTEN_BACKLOG /* connections the kernel queues before we accept them */
+#ifdef __linux__
+#define BFTPS_LISTEN_BACKLOG SOMAXCONN
+#else
+#define BFTPS_LISTEN_BACKLOG BFTPS_MAX_CONNECTIONS
+#endif
+#endif
+#ifndef BFTPS_LISTEN_BATCH /* connections accepted per wakeup before servicing the sessions */
+#define BFTPS_LISTEN_BATCH 64
+#endif
+#ifndef BFTPS_LISTEN_DEFER_ACCEPT /* seconds for TCP_DEFER_ACCEPT, 0 disables it */
+// clients wait for our greeting before sending anything, so with this the
+// connection is only accepted once the kernel gives up waiting for them
+#define BFTPS_LISTEN_DEFER_ACCEPT 0
+#endif
+#ifndef BFTPS_LISTEN_FASTOPEN /* TCP_FASTOPEN queue length, 0 disables it */
+#define BFTPS_LISTEN_FASTOPEN 0
+#endif
 
 typedef enum {
     BFTPS_MODE_INVALID,
@@ -48,11 +82,11 @@ typedef enum {
 
 typedef struct _bftps_file_transfer_ext_t {
     bftps_file_transfer_mode_t mode;
-    unsigned int fileSize; // This is only valid for sending files
-    unsigned int filePosition;
+    uint64_t fileSize; // This is only valid for sending files
+    uint64_t filePosition;
     struct _bftps_file_transfer_ext_t* next;
     char name[MAX_PATH];
-    const bftps_session_context_t* id; // we will use the file transfer session as ID only
+    bftps_session_handle_t id; // the handle of the file transfer session, pointers get reused
     bool ended;
     bool remove;
 } bftps_file_transfer_ext_t;
@@ -67,6 +101,7 @@ typedef struct {
     bool socInit;
 #endif
     bftps_session_context_t *sessions;
+    bftps_session_context_t **sessionsLastElement;
     bftps_file_transfer_ext_t *filesTransferInfo;
     bftps_file_transfer_ext_t **filesTransferInfoLastElement;
     spinlock_t filesTransferLock;
@@ -98,15 +133,18 @@ BFTPS_WORKER_THREAD_RESTARTING:
         context->socInit = true;
 #endif
 
-    // allocate socket to listen for clients
-    // I will not create the socket as SOCK_NONBLOCK for now I will use the 
-    // flag on the send command
+    // allocate socket to listen for clients, non-blocking so we can take
+    // every pending connection on each wakeup
     fdListen = socket(AF_INET, SOCK_STREAM, 0);
     if (0 > fdListen) {
         nErrorCode = errno;
         CONSOLE_LOG("Failed to create socket to listen: %d", nErrorCode);
         goto BFTPS_WORKER_THREAD_ERROR_CLEANUP;
     }
+    if (FAILED(nErrorCode = bftps_session_set_socket_nonblocking(fdListen))) {
+        CONSOLE_LOG("Failed to set listen socket as non-blocking: %d", nErrorCode);
+        goto BFTPS_WORKER_THREAD_ERROR_CLEANUP;
+    }
     // reuse the same address
     int enable = 1;
     if (0 > setsockopt(fdListen, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (int))) {
@@ -114,6 +152,19 @@ BFTPS_WORKER_THREAD_RESTARTING:
         CONSOLE_LOG("Failed to set reuse address option on listen socket: %d", nErrorCode);
         goto BFTPS_WORKER_THREAD_ERROR_CLEANUP;
     }
+#ifdef __linux__
+    // these only save some connection setup time, so we can live without them
+    int deferAccept = BFTPS_LISTEN_DEFER_ACCEPT;
+    if (0 < deferAccept && 0 > setsockopt(fdListen, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+            &deferAccept, sizeof (int))) {
+        CONSOLE_LOG("Failed to set defer accept option on listen socket: %d %s", errno, strerror(errno));
+    }
+    int fastOpen = BFTPS_LISTEN_FASTOPEN;
+    if (0 < fastOpen && 0 > setsockopt(fdListen, IPPROTO_TCP, TCP_FASTOPEN,
+            &fastOpen, sizeof (int))) {
+        CONSOLE_LOG("Failed to set fast open option on listen socket: %d %s", errno, strerror(errno));
+    }
+#endif
     // server listen address
     static struct sockaddr_in bftpsAddress;
     socklen_t addrlen = sizeof(bftpsAddress);
@@ -132,7 +183,7 @@ BFTPS_WORKER_THREAD_RESTARTING:
         goto BFTPS_WORKER_THREAD_ERROR_CLEANUP;
     }
     // listen on socket
-    if (0 > listen(fdListen, BFTPS_MAX_CONNECTIONS)) {
+    if (0 > listen(fdListen, BFTPS_LISTEN_BACKLOG)) {
         nErrorCode = errno;
         CONSOLE_LOG("Failed to listen: %d", nErrorCode);
         goto BFTPS_WORKER_THREAD_ERROR_CLEANUP;
@@ -150,6 +201,52 @@ BFTPS_WORKER_THREAD_RESTARTING:
                 hostname, ntohs(bftpsAddress.sin_port));
     }
 #endif
+    // it's okay if this fails, we will just stat everything
+    if (FAILED(nErrorCode = bftps_cache_meta_init())) {
+        CONSOLE_LOG("Failed to create the metadata cache: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // same for the descriptors cache, every download will open its own file
+    if (FAILED(nErrorCode = bftps_cache_fd_init())) {
+        CONSOLE_LOG("Failed to create the descriptors cache: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the contents cache, small files will be read from disk every time
+    if (FAILED(nErrorCode = bftps_cache_file_init())) {
+        CONSOLE_LOG("Failed to create the contents cache: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the compressed files cache, MODE Z will compress every download
+    if (FAILED(nErrorCode = bftps_cache_deflate_init())) {
+        CONSOLE_LOG("Failed to create the compressed files cache: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the sync thread, each upload will sync on its own
+    if (FAILED(nErrorCode = bftps_transfer_sync_init())) {
+        CONSOLE_LOG("Failed to create the sync thread: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the copy thread, SITE CPTO won't be available
+    if (FAILED(nErrorCode = bftps_transfer_copy_init())) {
+        CONSOLE_LOG("Failed to create the copy thread: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the tree threads, SITE RMTREE and DU won't be available
+    if (FAILED(nErrorCode = bftps_transfer_tree_init())) {
+        CONSOLE_LOG("Failed to create the tree threads: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the shared data port, PASV and EPSV will use their own ports
+    if (FAILED(nErrorCode = bftps_transfer_demux_init())) {
+        CONSOLE_LOG("Failed to create the shared data port: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+    // and for the passive ports, each PASV will create its own socket
+    if (FAILED(nErrorCode = bftps_transfer_pasv_init())) {
+        CONSOLE_LOG("Failed to create the passive ports: %d", nErrorCode);
+        nErrorCode = 0;
+    }
+
     // change the mode to listening and set the event to sync with caller thread
     context->mode = BFTPS_MODE_LISTENING;
     event_set(context->event);
@@ -159,12 +256,32 @@ BFTPS_WORKER_THREAD_RESTARTING:
     int pollTime = 150;
     while (context->mode == BFTPS_MODE_LISTENING) {
         // we will poll for new client connections
-        struct pollfd fds[1];
+        struct pollfd fds[6];
         fds[0].fd = fdListen;
         fds[0].events = POLLIN;
         fds[0].revents = 0;
+        // and for files changed behind our back
+        fds[1].fd = bftps_cache_meta_fd();
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        // and for uploads that are now on disk
+        fds[2].fd = bftps_transfer_sync_fd();
+        fds[2].events = POLLIN;
+        fds[2].revents = 0;
+        // and for data connections to the shared port
+        fds[3].fd = bftps_transfer_demux_fd();
+        fds[3].events = POLLIN;
+        fds[3].revents = 0;
+        // and for copies that are done
+        fds[4].fd = bftps_transfer_copy_fd();
+        fds[4].events = POLLIN;
+        fds[4].revents = 0;
+        // and for trees that were walked
+        fds[5].fd = bftps_transfer_tree_fd();
+        fds[5].events = POLLIN;
+        fds[5].revents = 0;
         // poll for a new connection
-        int result = poll(fds, 1, pollTime);
+        int result = poll(fds, 6, pollTime);
         if (0 > result) {
             nErrorCode = errno;
             if (nErrorCode == ENETDOWN) { // wifi got disabled, so let's restart
@@ -174,14 +291,34 @@ BFTPS_WORKER_THREAD_RESTARTING:
             }
             goto BFTPS_WORKER_THREAD_ERROR_CLEANUP;
         } else if (0 < result) {
-            // we have a new client, so let's find the place to create the new session        
-            bftps_session_context_t ** pNewSession = &context->sessions;
-            while (NULL != *pNewSession)
-                pNewSession = &(*pNewSession)->next;
-            // and now create it
-            bftps_session_init(pNewSession, fdListen);
+            if (fds[1].revents & POLLIN)
+                bftps_cache_meta_poll();
+            if (fds[2].revents & POLLIN)
+                bftps_transfer_sync_poll();
+            if (fds[3].revents & POLLIN)
+                bftps_transfer_demux_poll();
+            if (fds[4].revents & POLLIN)
+                bftps_transfer_copy_poll();
+            if (fds[5].revents & POLLIN)
+                bftps_transfer_tree_poll();
+
+            if (fds[0].revents & POLLIN) {
+                // we have new clients, so let's create their sessions at the end,
+                // all of them now and not one per loop, but leave some time
+                // for the sessions we already have
+                int accepted;
+                for (accepted = 0; accepted < BFTPS_LISTEN_BATCH; ++accepted) {
+                    if (SUCCEEDED(result = bftps_session_init(context->sessionsLastElement, fdListen)))
+                        context->sessionsLastElement = &(*context->sessionsLastElement)->next;
+                    else if (result == EAGAIN || result == EWOULDBLOCK || result == ENOMEM)
+                        break; // no one else is waiting, or we can't take them
+                }
+            }
         }
 
+        // close the descriptors nobody is downloading anymore
+        bftps_cache_fd_expire();
+
         // let's do some work on the connected sockets
         pollTime = 150; // restore the poll time to the original value
         bftps_session_context_t* sessionToWork = context->sessions;
@@ -197,6 +334,10 @@ BFTPS_WORKER_THREAD_RESTARTING:
                     previousSession->next = next;
                 else
                     context->sessions = next;
+                // check if it was the last element
+                if (NULL == next)
+                    context->sessionsLastElement = previousSession ?
+                        &previousSession->next : &context->sessions;
                 // update the variable to point to next session
                 sessionToWork = next;
             } else {
@@ -241,8 +382,22 @@ BFTPS_WORKER_THREAD_ERROR_CLEANUP:
             // update the variable to mode to next session
             session = next;
         }
+        context->sessions = NULL;
+        context->sessionsLastElement = &context->sessions;
         bftps_socket_destroy(&fdListen, false);
     }
+    bftps_transfer_demux_destroy();
+    bftps_transfer_pasv_destroy();
+    bftps_transfer_sync_destroy();
+    bftps_transfer_copy_destroy();
+    bftps_transfer_tree_destroy();
+    bftps_transfer_direct_destroy();
+    bftps_transfer_pool_destroy();
+    bftps_session_registry_destroy();
+    bftps_cache_deflate_destroy();
+    bftps_cache_file_destroy();
+    bftps_cache_fd_destroy();
+    bftps_cache_meta_destroy();
     // we restart the server if needed
     if (context->mode == BFTPS_MODE_RESTARTING) {
         CONSOLE_LOG("Restarting server");
@@ -274,6 +429,7 @@ int bftps_start() {
     gp_bftpsContext->startTime = 0;
     gp_bftpsContext->name[0] = '\0';
     gp_bftpsContext->sessions = NULL;
+    gp_bftpsContext->sessionsLastElement = &gp_bftpsContext->sessions;
     gp_bftpsContext->filesTransferInfo = NULL;
     gp_bftpsContext->filesTransferInfoLastElement = &gp_bftpsContext->filesTransferInfo;
     gp_bftpsContext->filesTransferLock = 0;
@@ -364,7 +520,7 @@ void bftps_file_transfer_store(bftps_session_context_t* session) {
         bftps_file_transfer_ext_t* fileTransfer = gp_bftpsContext->filesTransferInfo;
         while (fileTransfer) {
             // we found it
-            if (fileTransfer->id == session)
+            if (fileTransfer->id == session->handle)
                 break;
             // continue looking
             fileTransfer = fileTransfer->next;
@@ -376,11 +532,11 @@ void bftps_file_transfer_store(bftps_session_context_t* session) {
             // check if the address is valid or not, don't give any error this will be called again
             if (fileTransfer) {
                 // if it was just allocated we will initialize the next object to NULL and set its id
-                fileTransfer->id = session;
+                fileTransfer->id = session->handle;
                 fileTransfer->next = NULL;
                 // we also need to set all values on the first time
                 // the file name will always be on this buffer
-                strncpy(fileTransfer->name, session->filename, sizeof (fileTransfer->name));
+                snprintf(fileTransfer->name, sizeof (fileTransfer->name), "%s", session->filename);
                 fileTransfer->mode = session->flags & BFTPS_SESSION_FLAG_SEND ? FILE_SENDING : FILE_RECEIVING;
                 fileTransfer->fileSize = session->filesize;
                 fileTransfer->filePosition = session->filepos;
@@ -400,7 +556,7 @@ void bftps_file_transfer_store(bftps_session_context_t* session) {
             //or the filename and everything else
             if(atomic_compare_swap(&session->filenameRefresh, true, false))
             {
-                strncpy(fileTransfer->name, session->filename, sizeof (fileTransfer->name));
+                snprintf(fileTransfer->name, sizeof (fileTransfer->name), "%s", session->filename);
                 fileTransfer->mode = session->flags & BFTPS_SESSION_FLAG_SEND ? FILE_SENDING : FILE_RECEIVING;
                 fileTransfer->fileSize = session->filesize;
             }
@@ -413,7 +569,7 @@ void bftps_file_transfer_end(bftps_session_context_t* session) {
         bftps_file_transfer_ext_t* fileTransfer = gp_bftpsContext->filesTransferInfo;
         while (fileTransfer) {
             // we found it
-            if (fileTransfer->id == session) {
+            if (fileTransfer->id == session->handle) {
                 fileTransfer->ended = true;
                 break;
             }
@@ -483,4 +639,28 @@ void bftps_file_transfer_cleanup(const bftps_file_transfer_t* file_transfer) {
         free(fileTransferDelete);
         fileTransferDelete = next;
     }
+}
+
+int bftps_cache_stats(bftps_cache_t cache, bftps_cache_stats_t* stats) {
+    if (NULL == stats)
+        return EINVAL;
+
+    switch (cache) {
+        case BFTPS_CACHE_METADATA:
+            bftps_cache_meta_stats(stats);
+            break;
+        case BFTPS_CACHE_FD:
+            bftps_cache_fd_stats(stats);
+            break;
+        case BFTPS_CACHE_FILE:
+            bftps_cache_file_stats(stats);
+            break;
+        case BFTPS_CACHE_DEFLATE:
+            bftps_cache_deflate_stats(stats);
+            break;
+        default:
+            return EINVAL;
+    }
+
+    return 0;
 }
\ No newline at end of file
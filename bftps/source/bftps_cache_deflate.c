@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bftps_cache_deflate.h"
+#include "macros.h"
+#include "bool.h"
+
+#ifdef __linux__
+
+#define BFTPS_CACHE_DEFLATE_BUCKETS 1024
+// dev-ino-size-mtime.nsec-level of the original file, in hex but the last two
+#define BFTPS_CACHE_DEFLATE_NAME "%llx-%llx-%llx-%llx.%09ld-%d"
+#define BFTPS_CACHE_DEFLATE_SCAN "%llx-%llx-%llx-%llx.%ld-%d%n"
+#define BFTPS_CACHE_DEFLATE_PART ".part"
+
+struct _bftps_cache_deflate_entry_t {
+    struct _bftps_cache_deflate_entry_t* hashNext; /* next entry in the same bucket */
+    struct _bftps_cache_deflate_entry_t* lruPrev; /* more recently used entry */
+    struct _bftps_cache_deflate_entry_t* lruNext; /* less recently used entry */
+    dev_t dev; /* of the original file, dev/ino/level are the key */
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    int level; /* the variant was compressed with */
+    off_t bytes; /* of the variant, written so far while it is being filled */
+    int fillFd; /* the part file being written, -1 once committed */
+    bool ready; /* committed, in the LRU list and counted in the stats */
+};
+
+typedef struct {
+    bftps_cache_deflate_entry_t* buckets[BFTPS_CACHE_DEFLATE_BUCKETS];
+    bftps_cache_deflate_entry_t* lruHead;
+    bftps_cache_deflate_entry_t* lruTail;
+    bftps_cache_stats_t stats;
+} bftps_cache_deflate_t;
+
+// only the worker thread uses it, so no lock is needed
+static bftps_cache_deflate_t* gp_cacheDeflate = NULL;
+
+static bftps_cache_deflate_entry_t** bftps_cache_deflate_bucket(dev_t dev, ino_t ino,
+        int level) {
+    return &gp_cacheDeflate->buckets[((unsigned long) ino ^ (unsigned long) dev ^
+            (unsigned long) level) % BFTPS_CACHE_DEFLATE_BUCKETS];
+}
+
+static void bftps_cache_deflate_path(const bftps_cache_deflate_entry_t* entry,
+        bool part, char* path, size_t size) {
+    snprintf(path, size, "%s/" BFTPS_CACHE_DEFLATE_NAME "%s", BFTPS_CACHE_DEFLATE_DIR,
+            (unsigned long long) entry->dev, (unsigned long long) entry->ino,
+            (unsigned long long) entry->size, (unsigned long long) entry->mtime,
+            entry->mtimeNsec, entry->level, part ? BFTPS_CACHE_DEFLATE_PART : "");
+}
+
+// check the variant was made from the file as it is now
+
+static bool bftps_cache_deflate_valid(const bftps_cache_deflate_entry_t* entry,
+        const struct stat *st) {
+    return entry->size == st->st_size &&
+            entry->mtime == st->st_mtime &&
+            entry->mtimeNsec == st->st_mtim.tv_nsec;
+}
+
+static void bftps_cache_deflate_lru_unlink(bftps_cache_deflate_entry_t* entry) {
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        gp_cacheDeflate->lruHead = entry->lruNext;
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        gp_cacheDeflate->lruTail = entry->lruPrev;
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+static void bftps_cache_deflate_lru_push(bftps_cache_deflate_entry_t* entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = gp_cacheDeflate->lruHead;
+    if (gp_cacheDeflate->lruHead)
+        gp_cacheDeflate->lruHead->lruPrev = entry;
+    else
+        gp_cacheDeflate->lruTail = entry;
+    gp_cacheDeflate->lruHead = entry;
+}
+
+static void bftps_cache_deflate_insert(bftps_cache_deflate_entry_t* entry) {
+    bftps_cache_deflate_entry_t** bucket = bftps_cache_deflate_bucket(entry->dev,
+            entry->ino, entry->level);
+    entry->hashNext = *bucket;
+    *bucket = entry;
+}
+
+// take the entry out of the cache and free it, deleting its file if asked,
+// downloads already sending the variant keep their descriptor
+
+static void bftps_cache_deflate_remove(bftps_cache_deflate_entry_t* entry, bool erase) {
+    bftps_cache_deflate_entry_t** p = bftps_cache_deflate_bucket(entry->dev,
+            entry->ino, entry->level);
+    while (*p != entry)
+        p = &(*p)->hashNext;
+    *p = entry->hashNext;
+
+    if (entry->ready) {
+        bftps_cache_deflate_lru_unlink(entry);
+        --gp_cacheDeflate->stats.entries;
+        gp_cacheDeflate->stats.bytes -= entry->bytes;
+    }
+    if (0 <= entry->fillFd)
+        close(entry->fillFd);
+
+    if (erase) {
+        char path[MAX_PATH];
+        bftps_cache_deflate_path(entry, !entry->ready, path, sizeof (path));
+        if (0 != unlink(path) && errno != ENOENT)
+            CONSOLE_LOG("unlink '%s': %d %s", path, errno, strerror(errno));
+    }
+    free(entry);
+}
+
+// make room for bytes more, the least recently used variants go first
+
+static void bftps_cache_deflate_evict(off_t bytes) {
+    while (gp_cacheDeflate->lruTail &&
+            gp_cacheDeflate->stats.bytes + bytes > gp_cacheDeflate->stats.budget) {
+        bftps_cache_deflate_remove(gp_cacheDeflate->lruTail, true);
+        ++gp_cacheDeflate->stats.evictions;
+    }
+}
+
+typedef struct {
+    bftps_cache_deflate_entry_t* entry;
+    time_t used; /* last time the variant was sent, from its mtime */
+} bftps_cache_deflate_found_t;
+
+static int bftps_cache_deflate_found_compare(const void* a, const void* b) {
+    time_t usedA = ((const bftps_cache_deflate_found_t*) a)->used;
+    time_t usedB = ((const bftps_cache_deflate_found_t*) b)->used;
+    return usedA < usedB ? -1 : usedA > usedB;
+}
+
+// index the variants in the directory, parts of a previous run are dropped
+
+static int bftps_cache_deflate_scan() {
+    DIR* dir = opendir(BFTPS_CACHE_DEFLATE_DIR);
+    if (NULL == dir)
+        return errno;
+
+    bftps_cache_deflate_found_t* found = NULL;
+    size_t foundCount = 0, foundSize = 0;
+    int nErrorCode = 0;
+    struct dirent* directoryEntry;
+    while (NULL != (directoryEntry = readdir(dir))) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof (path), "%s/%s", BFTPS_CACHE_DEFLATE_DIR, directoryEntry->d_name);
+
+        unsigned long long dev, ino, size, mtime;
+        long mtimeNsec;
+        int level, length = 0;
+        struct stat st;
+        if (6 != sscanf(directoryEntry->d_name, BFTPS_CACHE_DEFLATE_SCAN, &dev, &ino,
+                &size, &mtime, &mtimeNsec, &level, &length) ||
+                '\0' != directoryEntry->d_name[length]) {
+            // only ours can be in there, the rest are unfinished ones
+            if (0 != strcmp(directoryEntry->d_name, ".") &&
+                    0 != strcmp(directoryEntry->d_name, ".."))
+                unlink(path);
+            continue;
+        }
+        if (0 != lstat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        if (foundCount == foundSize) {
+            size_t newSize = foundSize ? 2 * foundSize : 64;
+            bftps_cache_deflate_found_t* newFound = realloc(found,
+                    newSize * sizeof (bftps_cache_deflate_found_t));
+            if (NULL == newFound) {
+                nErrorCode = ENOMEM;
+                break;
+            }
+            found = newFound;
+            foundSize = newSize;
+        }
+
+        bftps_cache_deflate_entry_t* entry = malloc(sizeof (bftps_cache_deflate_entry_t));
+        if (NULL == entry) {
+            nErrorCode = ENOMEM;
+            break;
+        }
+        memset(entry, 0, sizeof (bftps_cache_deflate_entry_t));
+        entry->dev = dev;
+        entry->ino = ino;
+        entry->size = size;
+        entry->mtime = mtime;
+        entry->mtimeNsec = mtimeNsec;
+        entry->level = level;
+        entry->bytes = st.st_size;
+        entry->fillFd = -1;
+        found[foundCount].entry = entry;
+        found[foundCount].used = st.st_mtime;
+        ++foundCount;
+    }
+    closedir(dir);
+
+    // the most recently used ones end up at the head
+    if (0 < foundCount)
+        qsort(found, foundCount, sizeof (bftps_cache_deflate_found_t),
+            bftps_cache_deflate_found_compare);
+    size_t i;
+    for (i = 0; i < foundCount; ++i) {
+        bftps_cache_deflate_entry_t* entry = found[i].entry;
+        bftps_cache_deflate_insert(entry);
+        bftps_cache_deflate_lru_push(entry);
+        entry->ready = true;
+        ++gp_cacheDeflate->stats.entries;
+        gp_cacheDeflate->stats.bytes += entry->bytes;
+    }
+    free(found);
+
+    // the budget may be smaller than on the last run
+    bftps_cache_deflate_evict(0);
+    return nErrorCode;
+}
+
+int bftps_cache_deflate_init() {
+    if (NULL != gp_cacheDeflate)
+        return EALREADY;
+    if (0 == BFTPS_CACHE_DEFLATE_BUDGET)
+        return 0;
+
+    // it's in a shared place, so make sure nobody else prepared it for us
+    struct stat st;
+    if (0 != mkdir(BFTPS_CACHE_DEFLATE_DIR, 0700) && errno != EEXIST)
+        return errno;
+    if (0 != lstat(BFTPS_CACHE_DEFLATE_DIR, &st))
+        return errno;
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid())
+        return EPERM;
+
+    gp_cacheDeflate = malloc(sizeof (bftps_cache_deflate_t));
+    if (NULL == gp_cacheDeflate)
+        return ENOMEM;
+
+    memset(gp_cacheDeflate, 0, sizeof (bftps_cache_deflate_t));
+    gp_cacheDeflate->stats.budget = BFTPS_CACHE_DEFLATE_BUDGET;
+
+    return bftps_cache_deflate_scan();
+}
+
+void bftps_cache_deflate_destroy() {
+    if (NULL == gp_cacheDeflate)
+        return;
+
+    // sessions were already closed so nothing is being filled, the
+    // variants stay on disk for the next run
+    int i;
+    for (i = 0; i < BFTPS_CACHE_DEFLATE_BUCKETS; ++i) {
+        while (gp_cacheDeflate->buckets[i])
+            bftps_cache_deflate_remove(gp_cacheDeflate->buckets[i],
+                !gp_cacheDeflate->buckets[i]->ready);
+    }
+    free(gp_cacheDeflate);
+    gp_cacheDeflate = NULL;
+}
+
+int bftps_cache_deflate_acquire(const struct stat *st, int level,
+        int *fd, off_t *size, bftps_cache_deflate_entry_t **fill) {
+    if (!st || !fd || !size || !fill)
+        return EINVAL;
+
+    *fd = -1;
+    *size = 0;
+    *fill = NULL;
+    if (NULL == gp_cacheDeflate || !S_ISREG(st->st_mode) ||
+            st->st_size < BFTPS_CACHE_DEFLATE_MIN_SIZE)
+        return 0;
+
+    bftps_cache_deflate_entry_t* cached = *bftps_cache_deflate_bucket(st->st_dev,
+            st->st_ino, level);
+    while (cached && (cached->dev != st->st_dev || cached->ino != st->st_ino ||
+            cached->level != level))
+        cached = cached->hashNext;
+
+    if (cached) {
+        // another download is writing it, we compress on our own meanwhile
+        if (!cached->ready)
+            return 0;
+
+        if (bftps_cache_deflate_valid(cached, st)) {
+            char path[MAX_PATH];
+            bftps_cache_deflate_path(cached, false, path, sizeof (path));
+            *fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (0 <= *fd) {
+                ++gp_cacheDeflate->stats.hits;
+                // so the next run knows what was used last
+                futimens(*fd, NULL);
+                bftps_cache_deflate_lru_unlink(cached);
+                bftps_cache_deflate_lru_push(cached);
+                *size = cached->bytes;
+                return 0;
+            }
+            CONSOLE_LOG("open '%s': %d %s", path, errno, strerror(errno));
+        }
+        // the file was changed since we compressed it, or the variant is gone
+        bftps_cache_deflate_remove(cached, true);
+        ++gp_cacheDeflate->stats.invalidations;
+    }
+    ++gp_cacheDeflate->stats.misses;
+
+    // the variant can't be bigger than the budget, and is seldom bigger
+    // than the file
+    if (st->st_size > gp_cacheDeflate->stats.budget)
+        return 0;
+
+    bftps_cache_deflate_entry_t* entry = malloc(sizeof (bftps_cache_deflate_entry_t));
+    if (NULL == entry)
+        return ENOMEM;
+    memset(entry, 0, sizeof (bftps_cache_deflate_entry_t));
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->mtimeNsec = st->st_mtim.tv_nsec;
+    entry->level = level;
+
+    char path[MAX_PATH];
+    bftps_cache_deflate_path(entry, true, path, sizeof (path));
+    entry->fillFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (0 > entry->fillFd) {
+        int nErrorCode = errno;
+        free(entry);
+        return nErrorCode;
+    }
+
+    bftps_cache_deflate_insert(entry);
+    *fill = entry;
+    return 0;
+}
+
+int bftps_cache_deflate_write(bftps_cache_deflate_entry_t *fill,
+        const void *data, size_t size) {
+    if (fill->bytes + size > gp_cacheDeflate->stats.budget)
+        return EFBIG;
+
+    while (0 < size) {
+        ssize_t rc = write(fill->fillFd, data, size);
+        if (0 > rc) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        data = (const char*) data + rc;
+        size -= rc;
+        fill->bytes += rc;
+    }
+    return 0;
+}
+
+void bftps_cache_deflate_commit(bftps_cache_deflate_entry_t *fill) {
+    if (NULL == fill)
+        return;
+
+    int nErrorCode = 0;
+    if (0 != close(fill->fillFd))
+        nErrorCode = errno;
+    fill->fillFd = -1;
+
+    // room is only made now that we know how big it is
+    if (SUCCEEDED(nErrorCode)) {
+        bftps_cache_deflate_evict(fill->bytes);
+        if (gp_cacheDeflate->stats.bytes + fill->bytes > gp_cacheDeflate->stats.budget)
+            nErrorCode = EFBIG;
+    }
+    if (SUCCEEDED(nErrorCode)) {
+        char part[MAX_PATH], path[MAX_PATH];
+        bftps_cache_deflate_path(fill, true, part, sizeof (part));
+        bftps_cache_deflate_path(fill, false, path, sizeof (path));
+        if (0 != rename(part, path))
+            nErrorCode = errno;
+    }
+    if (FAILED(nErrorCode)) {
+        CONSOLE_LOG("Failed to keep the compressed file: %d %s", nErrorCode, strerror(nErrorCode));
+        bftps_cache_deflate_remove(fill, true);
+        return;
+    }
+
+    fill->ready = true;
+    bftps_cache_deflate_lru_push(fill);
+    ++gp_cacheDeflate->stats.entries;
+    gp_cacheDeflate->stats.bytes += fill->bytes;
+}
+
+void bftps_cache_deflate_abort(bftps_cache_deflate_entry_t *fill) {
+    if (NULL != fill)
+        bftps_cache_deflate_remove(fill, true);
+}
+
+void bftps_cache_deflate_stats(bftps_cache_stats_t *stats) {
+    if (NULL == gp_cacheDeflate)
+        memset(stats, 0, sizeof (bftps_cache_stats_t));
+    else
+        memcpy(stats, &gp_cacheDeflate->stats, sizeof (bftps_cache_stats_t));
+}
+
+#else
+
+int bftps_cache_deflate_init() {
+    return 0;
+}
+
+void bftps_cache_deflate_destroy() {
+}
+
+int bftps_cache_deflate_acquire(const struct stat *st, int level,
+        int *fd, off_t *size, bftps_cache_deflate_entry_t **fill) {
+    if (!st || !fd || !size || !fill)
+        return EINVAL;
+
+    *fd = -1;
+    *size = 0;
+    *fill = NULL;
+    return 0;
+}
+
+int bftps_cache_deflate_write(bftps_cache_deflate_entry_t *fill,
+        const void *data, size_t size) {
+    return ENOTSUP;
+}
+
+void bftps_cache_deflate_commit(bftps_cache_deflate_entry_t *fill) {
+}
+
+void bftps_cache_deflate_abort(bftps_cache_deflate_entry_t *fill) {
+}
+
+void bftps_cache_deflate_stats(bftps_cache_stats_t *stats) {
+    memset(stats, 0, sizeof (bftps_cache_stats_t));
+}
+
+#endif
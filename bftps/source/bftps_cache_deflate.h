@@ -0,0 +1,53 @@
+#ifndef BFTPS_CACHE_DEFLATE_H
+#define BFTPS_CACHE_DEFLATE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bftps.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_CACHE_DEFLATE_DIR /* where the MODE Z variants of the files are kept */
+#define BFTPS_CACHE_DEFLATE_DIR "/tmp/bftps-deflate"
+#endif
+#ifndef BFTPS_CACHE_DEFLATE_MIN_SIZE /* smaller files are compressed on every download */
+#define BFTPS_CACHE_DEFLATE_MIN_SIZE (64 * 1024)
+#endif
+#ifndef BFTPS_CACHE_DEFLATE_BUDGET /* disk used by all compressed variants */
+#ifdef _3DS
+#define BFTPS_CACHE_DEFLATE_BUDGET 0
+#else
+#define BFTPS_CACHE_DEFLATE_BUDGET (256 * 1024 * 1024)
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _bftps_cache_deflate_entry_t bftps_cache_deflate_entry_t;
+
+    // index the variants a previous run left in the directory
+    extern int bftps_cache_deflate_init();
+    extern void bftps_cache_deflate_destroy();
+    // get the variant of the file st is the current status of, compressed
+    // with level, fd is set to it and size to its length, otherwise fd is
+    // -1 and fill is set to the entry the download should write the
+    // variant to, or NULL if it isn't worth keeping or is being written
+    extern int bftps_cache_deflate_acquire(const struct stat *st, int level,
+            int *fd, off_t *size, bftps_cache_deflate_entry_t **fill);
+    // add compressed bytes to the variant being written
+    extern int bftps_cache_deflate_write(bftps_cache_deflate_entry_t *fill,
+            const void *data, size_t size);
+    // the stream is complete, later downloads can use it
+    extern void bftps_cache_deflate_commit(bftps_cache_deflate_entry_t *fill);
+    // the download didn't write the whole stream, drop it
+    extern void bftps_cache_deflate_abort(bftps_cache_deflate_entry_t *fill);
+    extern void bftps_cache_deflate_stats(bftps_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_CACHE_DEFLATE_H */
+
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bftps_cache_fd.h"
+#include "macros.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+typedef struct {
+    int fd; /* -1 if the slot is free */
+    dev_t dev;
+    ino_t ino;
+    unsigned int references; /* transfers using the descriptor */
+    time_t lastUsed; /* when the last reference was released */
+} bftps_cache_fd_entry_t;
+
+typedef struct {
+    bftps_cache_fd_entry_t entries[BFTPS_CACHE_FD_CAPACITY];
+    time_t lastExpire;
+    bftps_cache_stats_t stats;
+} bftps_cache_fd_t;
+
+static bftps_cache_fd_t* gp_cacheFd = NULL;
+
+static void bftps_cache_fd_close(bftps_cache_fd_entry_t* entry) {
+    if (0 != close(entry->fd)) {
+        CONSOLE_LOG("close: %d %s", errno, strerror(errno));
+    }
+    entry->fd = -1;
+    --gp_cacheFd->stats.entries;
+}
+
+int bftps_cache_fd_init() {
+    if (NULL != gp_cacheFd)
+        return EALREADY;
+
+    gp_cacheFd = malloc(sizeof (bftps_cache_fd_t));
+    if (NULL == gp_cacheFd)
+        return ENOMEM;
+
+    memset(gp_cacheFd, 0, sizeof (bftps_cache_fd_t));
+    for (int i = 0; i < BFTPS_CACHE_FD_CAPACITY; ++i)
+        gp_cacheFd->entries[i].fd = -1;
+    gp_cacheFd->stats.capacity = BFTPS_CACHE_FD_CAPACITY;
+
+    return 0;
+}
+
+void bftps_cache_fd_destroy() {
+    if (NULL == gp_cacheFd)
+        return;
+
+    // sessions were already closed so nobody holds a reference
+    for (int i = 0; i < BFTPS_CACHE_FD_CAPACITY; ++i) {
+        if (0 <= gp_cacheFd->entries[i].fd)
+            bftps_cache_fd_close(&gp_cacheFd->entries[i]);
+    }
+    free(gp_cacheFd);
+    gp_cacheFd = NULL;
+}
+
+int bftps_cache_fd_open(const char *path, struct stat *st, int *fd) {
+    if (!path || !st || !fd)
+        return EINVAL;
+
+    bftps_cache_fd_entry_t* freeEntry = NULL;
+    bftps_cache_fd_entry_t* idleEntry = NULL;
+    if (NULL != gp_cacheFd) {
+        for (int i = 0; i < BFTPS_CACHE_FD_CAPACITY; ++i) {
+            bftps_cache_fd_entry_t* entry = &gp_cacheFd->entries[i];
+            if (0 > entry->fd) {
+                if (NULL == freeEntry)
+                    freeEntry = entry;
+            } else if (entry->dev == st->st_dev && entry->ino == st->st_ino) {
+                // the path still leads to the file we have open
+                ++entry->references;
+                ++gp_cacheFd->stats.hits;
+                *fd = entry->fd;
+                return 0;
+            } else if (0 == entry->references &&
+                    (NULL == idleEntry || entry->lastUsed < idleEntry->lastUsed)) {
+                idleEntry = entry;
+            }
+        }
+        ++gp_cacheFd->stats.misses;
+    }
+
+    int newFd = open(path, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (0 > newFd)
+        return errno;
+
+    // the path may have changed since st was taken, so trust only the descriptor
+    if (0 != fstat(newFd, st)) {
+        int nErrorCode = errno;
+        close(newFd);
+        return nErrorCode;
+    }
+    *fd = newFd;
+
+    if (NULL == gp_cacheFd)
+        return 0;
+
+    // make room by closing the least recently used idle descriptor, if all
+    // are in use this one won't be cached and is closed on release
+    if (NULL == freeEntry && NULL != idleEntry) {
+        bftps_cache_fd_close(idleEntry);
+        ++gp_cacheFd->stats.evictions;
+        freeEntry = idleEntry;
+    }
+
+    if (NULL != freeEntry) {
+        freeEntry->fd = newFd;
+        freeEntry->dev = st->st_dev;
+        freeEntry->ino = st->st_ino;
+        freeEntry->references = 1;
+        freeEntry->lastUsed = time(NULL);
+        ++gp_cacheFd->stats.entries;
+    }
+
+    return 0;
+}
+
+void bftps_cache_fd_release(int fd) {
+    if (0 > fd)
+        return;
+
+    if (NULL != gp_cacheFd) {
+        for (int i = 0; i < BFTPS_CACHE_FD_CAPACITY; ++i) {
+            bftps_cache_fd_entry_t* entry = &gp_cacheFd->entries[i];
+            if (entry->fd == fd) {
+                // keep it open for the next transfer of this file
+                if (0 < entry->references)
+                    --entry->references;
+                entry->lastUsed = time(NULL);
+                return;
+            }
+        }
+    }
+
+    // this one was not cached
+    if (0 != close(fd)) {
+        CONSOLE_LOG("close: %d %s", errno, strerror(errno));
+    }
+}
+
+unsigned int bftps_cache_fd_references(int fd) {
+    if (0 > fd || NULL == gp_cacheFd)
+        return 0;
+
+    for (int i = 0; i < BFTPS_CACHE_FD_CAPACITY; ++i) {
+        if (gp_cacheFd->entries[i].fd == fd)
+            return gp_cacheFd->entries[i].references;
+    }
+    return 0;
+}
+
+void bftps_cache_fd_expire() {
+    if (NULL == gp_cacheFd)
+        return;
+
+    // there is no need to check more than once a second
+    time_t now = time(NULL);
+    if (now == gp_cacheFd->lastExpire)
+        return;
+    gp_cacheFd->lastExpire = now;
+
+    for (int i = 0; i < BFTPS_CACHE_FD_CAPACITY; ++i) {
+        bftps_cache_fd_entry_t* entry = &gp_cacheFd->entries[i];
+        if (0 <= entry->fd && 0 == entry->references &&
+                (now - entry->lastUsed > BFTPS_CACHE_FD_IDLE_TIMEOUT || now < entry->lastUsed)) {
+            bftps_cache_fd_close(entry);
+            ++gp_cacheFd->stats.invalidations;
+        }
+    }
+}
+
+void bftps_cache_fd_stats(bftps_cache_stats_t *stats) {
+    if (NULL == gp_cacheFd)
+        memset(stats, 0, sizeof (bftps_cache_stats_t));
+    else
+        memcpy(stats, &gp_cacheFd->stats, sizeof (bftps_cache_stats_t));
+}
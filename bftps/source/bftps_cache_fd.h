@@ -0,0 +1,33 @@
+#ifndef BFTPS_CACHE_FD_H
+#define BFTPS_CACHE_FD_H
+
+#include <sys/stat.h>
+
+#include "bftps.h"
+
+#define BFTPS_CACHE_FD_CAPACITY 64 /* max cached read-only descriptors */
+#define BFTPS_CACHE_FD_IDLE_TIMEOUT 10 /* seconds before closing an unused descriptor */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern int bftps_cache_fd_init();
+    extern void bftps_cache_fd_destroy();
+    // get a read-only descriptor for path, st must be the current status of
+    // path and is refreshed when the file has to be opened, the descriptor
+    // may be shared so it must only be used with positional reads
+    extern int bftps_cache_fd_open(const char *path, struct stat *st, int *fd);
+    extern void bftps_cache_fd_release(int fd);
+    // transfers using the descriptor, 0 if it isn't cached
+    extern unsigned int bftps_cache_fd_references(int fd);
+    // close descriptors that have been idle for too long
+    extern void bftps_cache_fd_expire();
+    extern void bftps_cache_fd_stats(bftps_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_CACHE_FD_H */
+
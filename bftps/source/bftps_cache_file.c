@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bftps_cache_file.h"
+#include "macros.h"
+#include "bool.h"
+
+#define BFTPS_CACHE_FILE_BUCKETS 1024
+
+struct _bftps_cache_file_entry_t {
+    struct _bftps_cache_file_entry_t* hashNext; /* next entry in the same bucket */
+    struct _bftps_cache_file_entry_t* lruPrev; /* more recently used entry */
+    struct _bftps_cache_file_entry_t* lruNext; /* less recently used entry */
+    struct stat st; /* status of the file when it was read, dev/ino are the key */
+    unsigned int references; /* transfers sending from this entry */
+    bool detached; /* no longer in the cache, freed with the last reference */
+    char data[];
+};
+
+typedef struct {
+    bftps_cache_file_entry_t* buckets[BFTPS_CACHE_FILE_BUCKETS];
+    bftps_cache_file_entry_t* lruHead;
+    bftps_cache_file_entry_t* lruTail;
+    bftps_cache_stats_t stats;
+} bftps_cache_file_t;
+
+static bftps_cache_file_t* gp_cacheFile = NULL;
+
+static bftps_cache_file_entry_t** bftps_cache_file_bucket(dev_t dev, ino_t ino) {
+    return &gp_cacheFile->buckets[((unsigned long) ino ^ (unsigned long) dev) %
+            BFTPS_CACHE_FILE_BUCKETS];
+}
+
+// check the cached contents are still the ones of the file
+
+static bool bftps_cache_file_valid(const bftps_cache_file_entry_t* entry,
+        const struct stat *st) {
+    return entry->st.st_size == st->st_size &&
+            entry->st.st_mtime == st->st_mtime &&
+#ifdef __linux__
+            entry->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+#endif
+            entry->st.st_ino == st->st_ino &&
+            entry->st.st_dev == st->st_dev;
+}
+
+static void bftps_cache_file_lru_unlink(bftps_cache_file_entry_t* entry) {
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        gp_cacheFile->lruHead = entry->lruNext;
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        gp_cacheFile->lruTail = entry->lruPrev;
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+static void bftps_cache_file_lru_push(bftps_cache_file_entry_t* entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = gp_cacheFile->lruHead;
+    if (gp_cacheFile->lruHead)
+        gp_cacheFile->lruHead->lruPrev = entry;
+    else
+        gp_cacheFile->lruTail = entry;
+    gp_cacheFile->lruHead = entry;
+}
+
+// take the entry out of the cache, it is freed now or with its last reference
+
+static void bftps_cache_file_remove(bftps_cache_file_entry_t* entry) {
+    bftps_cache_file_entry_t** p = bftps_cache_file_bucket(entry->st.st_dev, entry->st.st_ino);
+    while (*p != entry)
+        p = &(*p)->hashNext;
+    *p = entry->hashNext;
+
+    bftps_cache_file_lru_unlink(entry);
+    --gp_cacheFile->stats.entries;
+    gp_cacheFile->stats.bytes -= entry->st.st_size;
+
+    if (0 == entry->references)
+        free(entry);
+    else
+        entry->detached = true;
+}
+
+// read the whole file into a new entry
+
+static int bftps_cache_file_read(const char *path, const struct stat *st,
+        bftps_cache_file_entry_t **entry) {
+    bftps_cache_file_entry_t* newEntry = malloc(sizeof (bftps_cache_file_entry_t) + st->st_size);
+    if (NULL == newEntry)
+        return ENOMEM;
+
+    int nErrorCode = 0;
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (0 > fd) {
+        nErrorCode = errno;
+        free(newEntry);
+        return nErrorCode;
+    }
+
+    // make sure we are reading the file we were asked for
+    if (0 != fstat(fd, &newEntry->st)) {
+        nErrorCode = errno;
+    } else if (!bftps_cache_file_valid(newEntry, st)) {
+        nErrorCode = EAGAIN;
+    } else {
+        off_t position = 0;
+        while (position < st->st_size) {
+            ssize_t rc = read(fd, newEntry->data + position, st->st_size - position);
+            if (0 > rc) {
+                if (errno == EINTR)
+                    continue;
+                nErrorCode = errno;
+                break;
+            } else if (0 == rc) {
+                // the file shrank while we were reading it
+                nErrorCode = EAGAIN;
+                break;
+            }
+            position += rc;
+        }
+    }
+    close(fd);
+
+    if (FAILED(nErrorCode)) {
+        free(newEntry);
+        return nErrorCode;
+    }
+
+    newEntry->references = 0;
+    newEntry->detached = false;
+    *entry = newEntry;
+
+    return 0;
+}
+
+int bftps_cache_file_init() {
+    if (NULL != gp_cacheFile)
+        return EALREADY;
+
+    gp_cacheFile = malloc(sizeof (bftps_cache_file_t));
+    if (NULL == gp_cacheFile)
+        return ENOMEM;
+
+    memset(gp_cacheFile, 0, sizeof (bftps_cache_file_t));
+    gp_cacheFile->stats.budget = BFTPS_CACHE_FILE_BUDGET;
+
+    return 0;
+}
+
+void bftps_cache_file_destroy() {
+    if (NULL == gp_cacheFile)
+        return;
+
+    // sessions were already closed so nobody holds a reference
+    while (gp_cacheFile->lruHead)
+        bftps_cache_file_remove(gp_cacheFile->lruHead);
+    free(gp_cacheFile);
+    gp_cacheFile = NULL;
+}
+
+int bftps_cache_file_acquire(const char *path, const struct stat *st,
+        bftps_cache_file_entry_t **entry) {
+    if (!path || !st || !entry)
+        return EINVAL;
+
+    *entry = NULL;
+    if (NULL == gp_cacheFile || !S_ISREG(st->st_mode) ||
+            st->st_size > BFTPS_CACHE_FILE_MAX_SIZE)
+        return 0;
+
+    bftps_cache_file_entry_t* cached = *bftps_cache_file_bucket(st->st_dev, st->st_ino);
+    while (cached && (cached->st.st_dev != st->st_dev || cached->st.st_ino != st->st_ino))
+        cached = cached->hashNext;
+
+    if (cached) {
+        if (bftps_cache_file_valid(cached, st)) {
+            ++gp_cacheFile->stats.hits;
+            ++cached->references;
+            bftps_cache_file_lru_unlink(cached);
+            bftps_cache_file_lru_push(cached);
+            *entry = cached;
+            return 0;
+        }
+        // the file was changed since we read it
+        bftps_cache_file_remove(cached);
+        ++gp_cacheFile->stats.invalidations;
+    }
+    ++gp_cacheFile->stats.misses;
+
+    // make room for the new contents, entries being sent can't be dropped
+    bftps_cache_file_entry_t* victim = gp_cacheFile->lruTail;
+    while (victim && gp_cacheFile->stats.bytes + st->st_size > BFTPS_CACHE_FILE_BUDGET) {
+        bftps_cache_file_entry_t* previous = victim->lruPrev;
+        if (0 == victim->references) {
+            bftps_cache_file_remove(victim);
+            ++gp_cacheFile->stats.evictions;
+        }
+        victim = previous;
+    }
+    if (gp_cacheFile->stats.bytes + st->st_size > BFTPS_CACHE_FILE_BUDGET)
+        return 0;
+
+    int nErrorCode = 0;
+    if (FAILED(nErrorCode = bftps_cache_file_read(path, st, &cached)))
+        return nErrorCode;
+
+    bftps_cache_file_entry_t** bucket = bftps_cache_file_bucket(st->st_dev, st->st_ino);
+    cached->hashNext = *bucket;
+    *bucket = cached;
+    bftps_cache_file_lru_push(cached);
+    ++gp_cacheFile->stats.entries;
+    gp_cacheFile->stats.bytes += cached->st.st_size;
+
+    ++cached->references;
+    *entry = cached;
+    return 0;
+}
+
+const char* bftps_cache_file_data(const bftps_cache_file_entry_t *entry) {
+    return entry->data;
+}
+
+void bftps_cache_file_release(bftps_cache_file_entry_t *entry) {
+    if (NULL == entry)
+        return;
+
+    if (0 < entry->references && 0 == --entry->references && entry->detached)
+        free(entry);
+}
+
+void bftps_cache_file_stats(bftps_cache_stats_t *stats) {
+    if (NULL == gp_cacheFile)
+        memset(stats, 0, sizeof (bftps_cache_stats_t));
+    else
+        memcpy(stats, &gp_cacheFile->stats, sizeof (bftps_cache_stats_t));
+}
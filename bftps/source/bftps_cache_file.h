@@ -0,0 +1,45 @@
+#ifndef BFTPS_CACHE_FILE_H
+#define BFTPS_CACHE_FILE_H
+
+#include <sys/stat.h>
+
+#include "bftps.h"
+
+// both can be overridden at build time
+#ifndef BFTPS_CACHE_FILE_MAX_SIZE /* only files up to this size are cached */
+#ifdef _3DS
+#define BFTPS_CACHE_FILE_MAX_SIZE (64 * 1024)
+#else
+#define BFTPS_CACHE_FILE_MAX_SIZE (256 * 1024)
+#endif
+#endif
+#ifndef BFTPS_CACHE_FILE_BUDGET /* memory used by all cached contents */
+#ifdef _3DS
+#define BFTPS_CACHE_FILE_BUDGET (1024 * 1024)
+#else
+#define BFTPS_CACHE_FILE_BUDGET (32 * 1024 * 1024)
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _bftps_cache_file_entry_t bftps_cache_file_entry_t;
+
+    extern int bftps_cache_file_init();
+    extern void bftps_cache_file_destroy();
+    // get the contents of path, st must be its current status, entry is set
+    // to NULL when the file is not worth caching or there is no room for it
+    extern int bftps_cache_file_acquire(const char *path, const struct stat *st,
+            bftps_cache_file_entry_t **entry);
+    extern const char* bftps_cache_file_data(const bftps_cache_file_entry_t *entry);
+    extern void bftps_cache_file_release(bftps_cache_file_entry_t *entry);
+    extern void bftps_cache_file_stats(bftps_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_CACHE_FILE_H */
+
@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "bftps_cache_meta.h"
+#include "macros.h"
+
+#ifdef __linux__
+#define BFTPS_CACHE_META_WATCH_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | \
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+    IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+typedef struct _bftps_cache_meta_entry_t {
+    struct _bftps_cache_meta_entry_t* hashNext; /* next entry in the same bucket */
+    struct _bftps_cache_meta_entry_t* lruPrev; /* more recently used entry */
+    struct _bftps_cache_meta_entry_t* lruNext; /* less recently used entry */
+    unsigned int hash;
+    int watch; /* index of the parent directory watch, -1 if not watched */
+    bool nofollow; /* this is a lstat result */
+    time_t time; /* when the entry was filled */
+    struct stat st;
+    size_t pathLength;
+    char path[]; /* key */
+} bftps_cache_meta_entry_t;
+
+typedef struct {
+    int wd; /* inotify watch descriptor, -1 if slot is free */
+    unsigned int references; /* number of entries that depend on this watch */
+    char* path; /* watched directory */
+} bftps_cache_meta_watch_t;
+
+typedef struct {
+    bftps_cache_meta_entry_t* buckets[BFTPS_CACHE_META_BUCKETS];
+    bftps_cache_meta_entry_t* lruHead;
+    bftps_cache_meta_entry_t* lruTail;
+    bftps_cache_meta_watch_t watches[BFTPS_CACHE_META_WATCHES];
+    int lastWatch; /* last watch used, consecutive lookups are usually on the same dir */
+    int notifyFd;
+    bftps_cache_stats_t stats;
+} bftps_cache_meta_t;
+
+static bftps_cache_meta_t* gp_cacheMeta = NULL;
+
+static unsigned int bftps_cache_meta_hash(const char *path, size_t len) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// length of the parent directory of path, keeping the root '/'
+
+static size_t bftps_cache_meta_parent_length(const char *path, size_t len) {
+    while (len > 0 && path[len - 1] != '/')
+        --len;
+    if (len > 1)
+        --len; // remove the trailing '/' unless it is the root
+    return len;
+}
+
+static void bftps_cache_meta_watch_release(int watch) {
+    if (0 > watch)
+        return;
+
+    bftps_cache_meta_watch_t* w = &gp_cacheMeta->watches[watch];
+    if (0 < w->references && 0 == --w->references) {
+#ifdef __linux__
+        inotify_rm_watch(gp_cacheMeta->notifyFd, w->wd);
+#endif
+        free(w->path);
+        w->path = NULL;
+        w->wd = -1;
+    }
+}
+
+#ifdef __linux__
+
+static int bftps_cache_meta_watch_acquire(const char *path, size_t len) {
+    if (0 > gp_cacheMeta->notifyFd || len == 0)
+        return -1;
+
+    // most of the time we will be looking for the same directory as before
+    int freeSlot = -1;
+    bftps_cache_meta_watch_t* w = &gp_cacheMeta->watches[gp_cacheMeta->lastWatch];
+    if (0 > w->wd || strlen(w->path) != len || 0 != strncmp(w->path, path, len)) {
+        w = NULL;
+        for (int i = 0; i < BFTPS_CACHE_META_WATCHES; ++i) {
+            bftps_cache_meta_watch_t* candidate = &gp_cacheMeta->watches[i];
+            if (0 > candidate->wd) {
+                if (0 > freeSlot)
+                    freeSlot = i;
+            } else if (strlen(candidate->path) == len &&
+                    0 == strncmp(candidate->path, path, len)) {
+                w = candidate;
+                gp_cacheMeta->lastWatch = i;
+                break;
+            }
+        }
+    }
+
+    if (NULL == w) {
+        // all slots taken, this entry will have to rely on the TTL
+        if (0 > freeSlot)
+            return -1;
+
+        char* dir = strndup(path, len);
+        if (NULL == dir)
+            return -1;
+
+        int wd = inotify_add_watch(gp_cacheMeta->notifyFd, dir,
+                BFTPS_CACHE_META_WATCH_EVENTS | IN_ONLYDIR);
+        if (0 > wd) {
+            CONSOLE_LOG("inotify_add_watch '%s': %d %s", dir, errno, strerror(errno));
+            free(dir);
+            return -1;
+        }
+
+        // the same directory reached through another path, keep the first one
+        for (int i = 0; i < BFTPS_CACHE_META_WATCHES; ++i) {
+            if (gp_cacheMeta->watches[i].wd == wd) {
+                free(dir);
+                return -1;
+            }
+        }
+
+        w = &gp_cacheMeta->watches[freeSlot];
+        w->wd = wd;
+        w->references = 0;
+        w->path = dir;
+        gp_cacheMeta->lastWatch = freeSlot;
+    }
+
+    ++w->references;
+    return w - gp_cacheMeta->watches;
+}
+#endif
+
+static void bftps_cache_meta_lru_unlink(bftps_cache_meta_entry_t* entry) {
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        gp_cacheMeta->lruHead = entry->lruNext;
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        gp_cacheMeta->lruTail = entry->lruPrev;
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+static void bftps_cache_meta_lru_push(bftps_cache_meta_entry_t* entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = gp_cacheMeta->lruHead;
+    if (gp_cacheMeta->lruHead)
+        gp_cacheMeta->lruHead->lruPrev = entry;
+    else
+        gp_cacheMeta->lruTail = entry;
+    gp_cacheMeta->lruHead = entry;
+}
+
+static void bftps_cache_meta_remove(bftps_cache_meta_entry_t* entry) {
+    // remove from the bucket
+    bftps_cache_meta_entry_t** p = &gp_cacheMeta->buckets[entry->hash % BFTPS_CACHE_META_BUCKETS];
+    while (*p != entry)
+        p = &(*p)->hashNext;
+    *p = entry->hashNext;
+
+    bftps_cache_meta_lru_unlink(entry);
+    bftps_cache_meta_watch_release(entry->watch);
+    --gp_cacheMeta->stats.entries;
+    free(entry);
+}
+
+// drop all entries for path (both stat and lstat), and below it if recursive
+
+static void bftps_cache_meta_invalidate_length(const char *path, size_t len,
+        bool recursive) {
+    if (recursive) {
+        // we need to look at every entry for the children
+        bftps_cache_meta_entry_t* entry = gp_cacheMeta->lruHead;
+        while (entry) {
+            bftps_cache_meta_entry_t* next = entry->lruNext;
+            if (entry->pathLength >= len && 0 == memcmp(entry->path, path, len) &&
+                    (entry->pathLength == len || entry->path[len] == '/' ||
+                    (len == 1 && path[0] == '/'))) {
+                bftps_cache_meta_remove(entry);
+                ++gp_cacheMeta->stats.invalidations;
+            }
+            entry = next;
+        }
+        return;
+    }
+
+    unsigned int hash = bftps_cache_meta_hash(path, len);
+    bftps_cache_meta_entry_t* entry = gp_cacheMeta->buckets[hash % BFTPS_CACHE_META_BUCKETS];
+    while (entry) {
+        bftps_cache_meta_entry_t* next = entry->hashNext;
+        if (entry->hash == hash && entry->pathLength == len &&
+                0 == memcmp(entry->path, path, len)) {
+            bftps_cache_meta_remove(entry);
+            ++gp_cacheMeta->stats.invalidations;
+        }
+        entry = next;
+    }
+}
+
+static void bftps_cache_meta_flush() {
+    while (gp_cacheMeta->lruHead) {
+        bftps_cache_meta_remove(gp_cacheMeta->lruHead);
+        ++gp_cacheMeta->stats.invalidations;
+    }
+}
+
+int bftps_cache_meta_init() {
+    if (NULL != gp_cacheMeta)
+        return EALREADY;
+
+    gp_cacheMeta = malloc(sizeof (bftps_cache_meta_t));
+    if (NULL == gp_cacheMeta)
+        return ENOMEM;
+
+    memset(gp_cacheMeta, 0, sizeof (bftps_cache_meta_t));
+    for (int i = 0; i < BFTPS_CACHE_META_WATCHES; ++i)
+        gp_cacheMeta->watches[i].wd = -1;
+    gp_cacheMeta->stats.capacity = BFTPS_CACHE_META_CAPACITY;
+    gp_cacheMeta->notifyFd = -1;
+#ifdef __linux__
+    // it's okay if this fails, entries will expire with the TTL instead
+    gp_cacheMeta->notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (0 > gp_cacheMeta->notifyFd) {
+        CONSOLE_LOG("inotify_init1: %d %s", errno, strerror(errno));
+    }
+#endif
+
+    return 0;
+}
+
+void bftps_cache_meta_destroy() {
+    if (NULL == gp_cacheMeta)
+        return;
+
+    bftps_cache_meta_flush();
+    if (0 <= gp_cacheMeta->notifyFd)
+        close(gp_cacheMeta->notifyFd);
+    free(gp_cacheMeta);
+    gp_cacheMeta = NULL;
+}
+
+int bftps_cache_meta_fd() {
+    if (NULL == gp_cacheMeta)
+        return -1;
+    return gp_cacheMeta->notifyFd;
+}
+
+void bftps_cache_meta_poll() {
+#ifdef __linux__
+    if (NULL == gp_cacheMeta || 0 > gp_cacheMeta->notifyFd)
+        return;
+
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char dir[MAX_PATH];
+    char path[MAX_PATH];
+    ssize_t rc;
+    while (0 < (rc = read(gp_cacheMeta->notifyFd, buffer, sizeof (buffer)))) {
+        for (char* p = buffer; p < buffer + rc;) {
+            const struct inotify_event* event = (const struct inotify_event*) p;
+            p += sizeof (struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // we lost track of what changed
+                bftps_cache_meta_flush();
+                continue;
+            }
+
+            // find the watched directory
+            int watch = 0;
+            while (watch < BFTPS_CACHE_META_WATCHES &&
+                    gp_cacheMeta->watches[watch].wd != event->wd)
+                ++watch;
+            // the watch was already released
+            if (watch == BFTPS_CACHE_META_WATCHES)
+                continue;
+
+            // copy it, the watch is released with the last entry using it
+            size_t dirLength = strlen(gp_cacheMeta->watches[watch].path);
+            memcpy(dir, gp_cacheMeta->watches[watch].path, dirLength + 1);
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                // the whole directory is gone
+                bftps_cache_meta_invalidate_length(dir, dirLength, true);
+                continue;
+            }
+
+            if (event->len > 0) {
+                int len = snprintf(path, sizeof (path), "%s/%s",
+                        (dirLength == 1) ? "" : dir, event->name);
+                if (0 < len && len < sizeof (path))
+                    bftps_cache_meta_invalidate_length(path, len,
+                        event->mask & IN_ISDIR);
+            }
+            // the directory itself has changed too (mtime, nlink)
+            bftps_cache_meta_invalidate_length(dir, dirLength, false);
+        }
+    }
+#endif
+}
+
+static int bftps_cache_meta_lookup(const char *path, struct stat *st, bool nofollow) {
+    if (NULL == gp_cacheMeta) {
+        if (0 != (nofollow ? lstat(path, st) : stat(path, st)))
+            return errno;
+        return 0;
+    }
+
+    size_t len = strlen(path);
+    unsigned int hash = bftps_cache_meta_hash(path, len);
+    time_t now = time(NULL);
+    bftps_cache_meta_entry_t* entry = gp_cacheMeta->buckets[hash % BFTPS_CACHE_META_BUCKETS];
+    while (entry) {
+        bftps_cache_meta_entry_t* next = entry->hashNext;
+        if (entry->hash == hash && entry->pathLength == len &&
+                0 == memcmp(entry->path, path, len)) {
+            // a lstat of something that is not a symlink is also a valid stat
+            bool usable = entry->nofollow == nofollow ||
+                    (entry->nofollow && !S_ISLNK(entry->st.st_mode));
+            // entries we can't watch expire, and so do directories since
+            // changes inside them are not reported on their parent watch
+            bool expired = (0 > entry->watch || S_ISDIR(entry->st.st_mode)) &&
+                    (now - entry->time > BFTPS_CACHE_META_TTL || now < entry->time);
+            if (expired) {
+                bftps_cache_meta_remove(entry);
+                ++gp_cacheMeta->stats.invalidations;
+            } else if (usable) {
+                ++gp_cacheMeta->stats.hits;
+                bftps_cache_meta_lru_unlink(entry);
+                bftps_cache_meta_lru_push(entry);
+                memcpy(st, &entry->st, sizeof (struct stat));
+                return 0;
+            }
+        }
+        entry = next;
+    }
+
+    ++gp_cacheMeta->stats.misses;
+    if (0 != (nofollow ? lstat(path, st) : stat(path, st)))
+        return errno; // we don't cache failures
+
+    // make room for the new entry
+    if (gp_cacheMeta->stats.entries >= BFTPS_CACHE_META_CAPACITY &&
+            gp_cacheMeta->lruTail) {
+        bftps_cache_meta_remove(gp_cacheMeta->lruTail);
+        ++gp_cacheMeta->stats.evictions;
+    }
+
+    entry = malloc(sizeof (bftps_cache_meta_entry_t) + len + 1);
+    if (NULL == entry)
+        return 0; // we still have the result, it just won't be cached
+
+    memcpy(entry->path, path, len + 1);
+    entry->pathLength = len;
+    entry->hash = hash;
+    entry->nofollow = nofollow;
+    entry->time = now;
+    memcpy(&entry->st, st, sizeof (struct stat));
+#ifdef __linux__
+    entry->watch = bftps_cache_meta_watch_acquire(path, bftps_cache_meta_parent_length(path, len));
+#else
+    entry->watch = -1;
+#endif
+
+    bftps_cache_meta_entry_t** bucket = &gp_cacheMeta->buckets[hash % BFTPS_CACHE_META_BUCKETS];
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    bftps_cache_meta_lru_push(entry);
+    ++gp_cacheMeta->stats.entries;
+
+    return 0;
+}
+
+int bftps_cache_meta_stat(const char *path, struct stat *st) {
+    return bftps_cache_meta_lookup(path, st, false);
+}
+
+int bftps_cache_meta_lstat(const char *path, struct stat *st) {
+    return bftps_cache_meta_lookup(path, st, true);
+}
+
+void bftps_cache_meta_invalidate(const char *path, bool recursive) {
+    if (NULL == gp_cacheMeta)
+        return;
+
+    size_t len = strlen(path);
+    bftps_cache_meta_invalidate_length(path, len, recursive);
+    bftps_cache_meta_invalidate_length(path, bftps_cache_meta_parent_length(path, len), false);
+}
+
+void bftps_cache_meta_stats(bftps_cache_stats_t *stats) {
+    if (NULL == gp_cacheMeta)
+        memset(stats, 0, sizeof (bftps_cache_stats_t));
+    else
+        memcpy(stats, &gp_cacheMeta->stats, sizeof (bftps_cache_stats_t));
+}
@@ -0,0 +1,41 @@
+#ifndef BFTPS_CACHE_META_H
+#define BFTPS_CACHE_META_H
+
+#include <sys/stat.h>
+
+#include "bftps.h"
+#include "bool.h"
+
+#ifdef _3DS
+#define BFTPS_CACHE_META_CAPACITY 128
+#else
+#define BFTPS_CACHE_META_CAPACITY 4096
+#endif
+#define BFTPS_CACHE_META_BUCKETS (2 * BFTPS_CACHE_META_CAPACITY)
+#define BFTPS_CACHE_META_WATCHES 256 /* max directories watched with inotify */
+#define BFTPS_CACHE_META_TTL 2 /* seconds, for entries we can't watch */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern int bftps_cache_meta_init();
+    extern void bftps_cache_meta_destroy();
+    // file descriptor to poll for external changes, -1 if there is none
+    extern int bftps_cache_meta_fd();
+    // process pending external change notifications
+    extern void bftps_cache_meta_poll();
+    // both return 0 or the errno of the underlying stat/lstat
+    extern int bftps_cache_meta_stat(const char *path, struct stat *st);
+    extern int bftps_cache_meta_lstat(const char *path, struct stat *st);
+    // drop the path and its parent directory, and everything below the path
+    // when recursive is set (renamed/removed directories)
+    extern void bftps_cache_meta_invalidate(const char *path, bool recursive);
+    extern void bftps_cache_meta_stats(bftps_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_CACHE_META_H */
+
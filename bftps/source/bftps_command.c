@@ -22,6 +22,15 @@
 #include "bftps_common.h"
 #include "bftps_transfer_dir.h"
 #include "bftps_transfer_file.h"
+#include "bftps_cache_meta.h"
+#include "bftps_cache_fd.h"
+#include "bftps_transfer_pool.h"
+#include "bftps_transfer_pasv.h"
+#include "bftps_transfer_demux.h"
+#include "bftps_transfer_deflate.h"
+#include "bftps_transfer_tar.h"
+#include "bftps_transfer_copy.h"
+#include "bftps_transfer_tree.h"
 
 #include "macros.h"
 #include "bool.h"
@@ -39,6 +48,7 @@ FTP_DECLARE(APPE);
 FTP_DECLARE(CDUP);
 FTP_DECLARE(CWD);
 FTP_DECLARE(DELE);
+FTP_DECLARE(EPSV);
 FTP_DECLARE(FEAT);
 FTP_DECLARE(HELP);
 FTP_DECLARE(LIST);
@@ -60,6 +70,7 @@ FTP_DECLARE(RETR);
 FTP_DECLARE(RMD);
 FTP_DECLARE(RNFR);
 FTP_DECLARE(RNTO);
+FTP_DECLARE(SITE);
 FTP_DECLARE(SIZE);
 FTP_DECLARE(STAT);
 FTP_DECLARE(STOR);
@@ -90,6 +101,7 @@ static bftps_command_t bftps_commands[] = {
     FTP_COMMAND(CDUP),
     FTP_COMMAND(CWD),
     FTP_COMMAND(DELE),
+    FTP_COMMAND(EPSV),
     FTP_COMMAND(FEAT),
     FTP_COMMAND(HELP),
     FTP_COMMAND(LIST),
@@ -111,6 +123,7 @@ static bftps_command_t bftps_commands[] = {
     FTP_COMMAND(RMD),
     FTP_COMMAND(RNFR),
     FTP_COMMAND(RNTO),
+    FTP_COMMAND(SITE),
     FTP_COMMAND(SIZE),
     FTP_COMMAND(STAT),
     FTP_COMMAND(STOR),
@@ -155,6 +168,88 @@ in_port_t bftps_command_next_data_port(void) {
 #endif
 }
 
+// create a socket to listen on for PASV when the pool has none left
+
+static int bftps_command_pasv_listen(bftps_session_context_t *session) {
+    int nErrorCode = 0;
+    // create a socket to listen on
+    session->pasvFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (session->pasvFd < 0) {
+        nErrorCode = errno;
+        CONSOLE_LOG("Failed to create socket for PASV: %d %s", nErrorCode, strerror(nErrorCode));
+        return nErrorCode;
+    }
+
+    // set the socket options
+    if (FAILED(nErrorCode = bftps_socket_options_increase_buffers(session->pasvFd))) {
+        // failed to set socket options
+        CONSOLE_LOG("Failed to increase the buffer size: %d %s", nErrorCode, strerror(nErrorCode));
+        bftps_session_close_pasv(session);
+        return nErrorCode;
+    }
+    // grab a new port
+    session->pasvAddress.sin_port = htons(bftps_command_next_data_port());
+
+    // bind to the port
+
+    if (0 != bind(session->pasvFd, (struct sockaddr*) &session->pasvAddress, sizeof (session->pasvAddress))) {
+        // failed to bind
+        nErrorCode = errno;
+        CONSOLE_LOG("Failed to bind to a new port: %d %s", nErrorCode, strerror(nErrorCode));
+        bftps_session_close_pasv(session);
+        return nErrorCode;
+    }
+
+    // listen on the socket
+    if (0 != listen(session->pasvFd, 1)) {
+        // failed to listen
+        nErrorCode = errno;
+        CONSOLE_LOG("Failed to listen on the socket: %d %s", nErrorCode,
+                strerror(nErrorCode));
+        bftps_session_close_pasv(session);
+        return nErrorCode;
+    }
+
+    //#ifndef _3DS
+    {
+        // get the socket address since we requested an ephemeral port
+        socklen_t addrlen = sizeof (session->pasvAddress);
+        if (0 != getsockname(session->pasvFd, (struct sockaddr*)
+                &session->pasvAddress, &addrlen)) {
+            // failed to get socket address
+            nErrorCode = errno;
+            CONSOLE_LOG("Failed to get socket address: %d %s", nErrorCode,
+                    strerror(nErrorCode));
+            bftps_session_close_pasv(session);
+            return nErrorCode;
+        }
+    }
+    //#endif
+
+    return 0;
+}
+
+// get ready for the data connection of PASV and EPSV, pasvAddress tells
+// where the peer has to connect
+
+static int bftps_command_pasv_open(bftps_session_context_t *session) {
+    // the shared port is always listening and tells the sessions apart
+    if (SUCCEEDED(bftps_transfer_demux_wait(session))) {
+        session->flags |= BFTPS_SESSION_FLAG_SHARED;
+        session->pasvAddress.sin_port = htons(BFTPS_TRANSFER_DEMUX_PORT);
+        return 0;
+    }
+
+    // take a socket that is already listening, so there is nothing to set up
+    in_port_t poolPort;
+    if (SUCCEEDED(bftps_transfer_pasv_acquire(&session->pasvFd, &poolPort))) {
+        session->pasvAddress.sin_port = htons(poolPort);
+        return 0;
+    }
+
+    return bftps_command_pasv_listen(session);
+}
+
 #ifdef __GNUC__
 
 __attribute__ ((format(printf, 3, 4)))
@@ -343,6 +438,15 @@ int bftps_command_receive(bftps_session_context_t *session, int events) {
             // update command timestamp
             session->timestamp = time(NULL);
 
+            // commands work with the session buffers, idle sessions have none
+            if (FAILED(nErrorCode = bftps_session_buffers_acquire(session))) {
+                CONSOLE_LOG("Failed to get the session buffers: %d %s", nErrorCode, strerror(nErrorCode));
+                if (FAILED(nErrorCode = bftps_command_send_response(session, 421,
+                        "Out of memory\r\n")))
+                    return nErrorCode;
+                return ENOMEM;
+            }
+
             // execute the command
             if (command == NULL) {
                 if (*args) {
@@ -431,6 +535,9 @@ int bftps_command_receive(bftps_session_context_t *session, int events) {
                 // clear RENAME flag for all commands except RNTO
                 if (strcasecmp(command->name, "RNTO") != 0)
                     session->flags &= ~BFTPS_SESSION_FLAG_RENAME;
+                // and COPY for all except SITE, which keeps it for CPTO only
+                if (strcasecmp(command->name, "SITE") != 0)
+                    session->flags &= ~BFTPS_SESSION_FLAG_COPY;
 
                 if (FAILED(nErrorCode = command->handler(session, args))) {
                     CONSOLE_LOG("Failed to handle command: %d", nErrorCode);
@@ -477,7 +584,26 @@ FTP_DECLARE(ALLO) {
 
     bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
 
+#ifdef __linux__
+    // make sure an argument is provided
+    if (args == NULL || !isdigit((int) *args)) {
+        return bftps_command_send_response(session, 501, "invalid argument\r\n");
+    }
+
+    // parse the size, the optional record size is of no use to us
+    char *end = NULL;
+    errno = 0;
+    unsigned long long size = strtoull(args, &end, 10);
+    if (errno == ERANGE || (*end && *end != ' ')) {
+        return bftps_command_send_response(session, 501, "invalid argument\r\n");
+    }
+
+    // the space is reserved when the next upload opens the file
+    session->fileAllocate = size;
+    return bftps_command_send_response(session, 200, "OK\r\n");
+#else
     return bftps_command_send_response(session, 202, "superfluous command\r\n");
+#endif
 }
 
 // append data to a file - requires a PASV or PORT connection
@@ -523,8 +649,7 @@ FTP_DECLARE(CWD) {
 
     // get the path status
     struct stat st;
-    if (0 != stat(session->dataBuffer, &st)) {
-        nErrorCode = errno;
+    if (FAILED(nErrorCode = bftps_cache_meta_stat(session->dataBuffer, &st))) {
         CONSOLE_LOG("stat '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
         return bftps_command_send_response(session, 550, "unavailable\r\n");
     }
@@ -560,11 +685,42 @@ FTP_DECLARE(DELE) {
         CONSOLE_LOG("unlink: %d %s\n", nErrorCode, strerror(nErrorCode));
         return bftps_command_send_response(session, 550, "failed to delete file\r\n");
     }
+    bftps_cache_meta_invalidate(session->dataBuffer, false);
 
     bftps_common_update_free_space(session);
     return bftps_command_send_response(session, 250, "OK\r\n");
 }
 
+// request a port to connect to, the address is the one of the control connection
+
+FTP_DECLARE(EPSV) {
+    CONSOLE_LOG("EPSV %s", args ? args : "");
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA |
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV);
+    session->flags &= ~(BFTPS_SESSION_FLAG_PASV | BFTPS_SESSION_FLAG_PORT);
+
+    // from now on the client will only use EPSV
+    if (strcasecmp(args, "ALL") == 0) {
+        session->epsvAll = true;
+        return bftps_command_send_response(session, 200, "OK\r\n");
+    }
+
+    // we only listen on IPv4
+    if (*args && strcmp(args, "1") != 0)
+        return bftps_command_send_response(session, 522, "Network protocol not supported, use (1)\r\n");
+
+    if (FAILED(bftps_command_pasv_open(session)))
+        return bftps_command_send_response(session, 451, "\r\n");
+
+    CONSOLE_LOG("Listening on %s:%u", inet_ntoa(session->pasvAddress.sin_addr),
+            ntohs(session->pasvAddress.sin_port));
+    session->flags |= BFTPS_SESSION_FLAG_PASV;
+
+    return bftps_command_send_response(session, 229, "Entering Extended Passive Mode (|||%u|)\r\n",
+            ntohs(session->pasvAddress.sin_port));
+}
+
 // list server features
 
 FTP_DECLARE(FEAT) {
@@ -574,8 +730,12 @@ FTP_DECLARE(FEAT) {
 
     // list our features
     return bftps_command_send_response(session, -211, "\r\n"
+            " EPSV\r\n"
             " MDTM\r\n"
             " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;\r\n"
+#if 0 < BFTPS_TRANSFER_DEFLATE
+            " MODE Z\r\n"
+#endif
             " PASV\r\n"
             " SIZE\r\n"
             " TVFS\r\n"
@@ -599,9 +759,9 @@ FTP_DECLARE(HELP) {
     // list our accepted commands
     return bftps_command_send_response(session, -214,
             "The following commands are recognized\r\n"
-            " ABOR ALLO APPE CDUP CWD DELE FEAT HELP LIST MDTM MKD MLSD MLST MODE\r\n"
-            " NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO STAT\r\n"
-            " STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
+            " ABOR ALLO APPE CDUP CWD DELE EPSV FEAT HELP LIST MDTM MKD MLSD MLST\r\n"
+            " MODE NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO\r\n"
+            " SITE STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
             "214 End\r\n");
 }
 
@@ -636,7 +796,7 @@ FTP_DECLARE(MDTM) {
     t_mtime = mtime;
 #else
     struct stat st;
-    if (0 != stat(session->dataBuffer, &st)) {
+    if (FAILED(bftps_cache_meta_stat(session->dataBuffer, &st))) {
         return bftps_command_send_response(session, 550, "Error getting mtime\r\n");
     }
     t_mtime = st.st_mtime;
@@ -647,7 +807,7 @@ FTP_DECLARE(MDTM) {
         return bftps_command_send_response(session, 550, "Error getting mtime\r\n");
     }
 
-    session->dataBufferSize = strftime(session->dataBuffer, sizeof (session->dataBuffer), "%Y%m%d%H%M%S", tm);
+    session->dataBufferSize = strftime(session->dataBuffer, BFTPS_SESSION_TRANSFER_BUFFER_SIZE, "%Y%m%d%H%M%S", tm);
     if (session->dataBufferSize == 0) {
         return bftps_command_send_response(session, 550, "Error getting mtime\r\n");
     }
@@ -679,6 +839,7 @@ FTP_DECLARE(MKD) {
         CONSOLE_LOG("mkdir: %d %s", nErrorCode, strerror(nErrorCode));
         return bftps_command_send_response(session, 550, "failed to create directory\r\n");
     }
+    bftps_cache_meta_invalidate(session->dataBuffer, false);
 
     bftps_common_update_free_space(session);
     return bftps_command_send_response(session, 250, "OK\r\n");
@@ -708,8 +869,8 @@ FTP_DECLARE(MLST) {
 
     // stat path
     struct stat st;
-    if (0 != lstat(session->dataBuffer, &st)) {
-        return bftps_command_send_response(session, 550, "%s\r\n", strerror(errno));
+    if (FAILED(nErrorCode = bftps_cache_meta_lstat(session->dataBuffer, &st))) {
+        return bftps_command_send_response(session, 550, "%s\r\n", strerror(nErrorCode));
     }
 
     // encode \n in path
@@ -743,14 +904,27 @@ FTP_DECLARE(MLST) {
 FTP_DECLARE(MODE) {
     CONSOLE_LOG("MODE %s", args ? args : "");
 
-    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
-
-    // we only accept S (stream) mode
-    if (strcasecmp(args, "S") == 0) {
-        return bftps_command_send_response(session, 200, "OK\r\n");
+    bftps_transfer_mode_t mode;
+    if (strcasecmp(args, "S") == 0)
+        mode = BFTPS_TRANSFER_MODE_STREAM;
+    else if (strcasecmp(args, "B") == 0)
+        mode = BFTPS_TRANSFER_MODE_BLOCK;
+#if 0 < BFTPS_TRANSFER_DEFLATE
+    else if (strcasecmp(args, "Z") == 0)
+        mode = BFTPS_TRANSFER_MODE_DEFLATE;
+#endif
+    else {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+        return bftps_command_send_response(session, 504, "unavailable\r\n");
     }
 
-    return bftps_command_send_response(session, 504, "unavailable\r\n");
+    // a connection kept by MODE B can't be used with another mode
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+            mode != session->transferMode ? BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA : 0);
+    session->transferMode = mode;
+    if (mode != BFTPS_TRANSFER_MODE_DEFLATE)
+        bftps_transfer_deflate_release(session);
+    return bftps_command_send_response(session, 200, "OK\r\n");
 }
 
 // retrieve a name list - Requires a PASV or PORT connection
@@ -785,6 +959,91 @@ FTP_DECLARE(OPTS) {
         return bftps_command_send_response(session, 200, "OK\r\n");
     }
 
+    // check RETR engine
+    if (strncasecmp(args, "RETR ", 5) == 0) {
+
+        static const struct {
+            const char *name;
+            bftps_transfer_engine_t engine;
+        } retr_engines[] = {
+            { "READ", BFTPS_TRANSFER_ENGINE_READ,},
+#ifdef __linux__
+            { "SENDFILE", BFTPS_TRANSFER_ENGINE_SENDFILE,},
+            { "MMAP", BFTPS_TRANSFER_ENGINE_MMAP,},
+#endif
+        };
+        static const size_t num_retr_engines = sizeof (retr_engines) / sizeof (retr_engines[0]);
+
+        for (size_t i = 0; i < num_retr_engines; ++i) {
+            if (strcasecmp(retr_engines[i].name, args + 5) == 0) {
+                session->retrEngine = retr_engines[i].engine;
+                return bftps_command_send_response(session, 200, "RETR OPTS %s\r\n",
+                        retr_engines[i].name);
+            }
+        }
+    }
+
+    // check STOR mode
+    if (strcasecmp(args, "STOR BUFFERED") == 0) {
+        session->storDirect = false;
+        return bftps_command_send_response(session, 200, "STOR OPTS BUFFERED\r\n");
+    }
+#ifdef __linux__
+    if (strcasecmp(args, "STOR DIRECT") == 0) {
+        session->storDirect = true;
+        return bftps_command_send_response(session, 200, "STOR OPTS DIRECT\r\n");
+    }
+#endif
+
+    // check how STOR publishes the file
+    if (strcasecmp(args, "STOR INPLACE") == 0) {
+        session->storAtomic = false;
+        return bftps_command_send_response(session, 200, "STOR OPTS INPLACE\r\n");
+    }
+#ifdef __linux__
+    if (strcasecmp(args, "STOR ATOMIC") == 0) {
+        session->storAtomic = true;
+        return bftps_command_send_response(session, 200, "STOR OPTS ATOMIC\r\n");
+    }
+#endif
+
+    // check STOR durability
+    if (strncasecmp(args, "STOR SYNC ", 10) == 0) {
+
+        static const struct {
+            const char *name;
+            bftps_transfer_durability_t durability;
+        } stor_durabilities[] = {
+            { "NONE", BFTPS_TRANSFER_DURABILITY_NONE,},
+#ifdef __linux__
+            { "FDATASYNC", BFTPS_TRANSFER_DURABILITY_FDATASYNC,},
+            { "GROUP", BFTPS_TRANSFER_DURABILITY_GROUP,},
+#endif
+        };
+        static const size_t num_stor_durabilities = sizeof (stor_durabilities) / sizeof (stor_durabilities[0]);
+
+        for (size_t i = 0; i < num_stor_durabilities; ++i) {
+            if (strcasecmp(stor_durabilities[i].name, args + 10) == 0) {
+                session->storDurability = stor_durabilities[i].durability;
+                return bftps_command_send_response(session, 200, "STOR OPTS SYNC %s\r\n",
+                        stor_durabilities[i].name);
+            }
+        }
+    }
+
+#if 0 < BFTPS_TRANSFER_DEFLATE
+    // check MODE Z compression level, the next transfer starts with it
+    if (strncasecmp(args, "MODE Z LEVEL ", 13) == 0) {
+        char *end = NULL;
+        long level = strtol(args + 13, &end, 10);
+        if (end != args + 13 && *end == '\0' && 0 <= level && level <= 9) {
+            session->deflateLevel = level;
+            return bftps_command_send_response(session, 200, "MODE Z LEVEL set to %ld\r\n",
+                    level);
+        }
+    }
+#endif
+
     // check MLST options
     if (strncasecmp(args, "MLST ", 5) == 0) {
 
@@ -852,60 +1111,12 @@ FTP_DECLARE(PASV) {
             BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV);
     session->flags &= ~(BFTPS_SESSION_FLAG_PASV | BFTPS_SESSION_FLAG_PORT);
 
-    int nErrorCode = 0;
-    // create a socket to listen on
-    session->pasvFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (session->pasvFd < 0) {
-        nErrorCode = errno;
-        CONSOLE_LOG("Failed to create socket for PASV: %d %s", nErrorCode, strerror(nErrorCode))
-        return bftps_command_send_response(session, 451, "\r\n");
-    }
-
-    // set the socket options
-    if (FAILED(nErrorCode = bftps_socket_options_increase_buffers(session->pasvFd))) {
-        // failed to set socket options
-        CONSOLE_LOG("Failed to increase the buffer size: %d %s", nErrorCode, strerror(nErrorCode));
-        bftps_session_close_pasv(session);
-        return bftps_command_send_response(session, 451, "\r\n");
-    }
-    // grab a new port
-    session->pasvAddress.sin_port = htons(bftps_command_next_data_port());
-
-    // bind to the port
-
-    if (0 != bind(session->pasvFd, (struct sockaddr*) &session->pasvAddress, sizeof (session->pasvAddress))) {
-        // failed to bind
-        nErrorCode = errno;
-        CONSOLE_LOG("Failed to bind to a new port: %d %s", nErrorCode, strerror(nErrorCode));
-        bftps_session_close_pasv(session);
-        return bftps_command_send_response(session, 451, "\r\n");
-    }
+    // EPSV ALL promised we would see no other
+    if (session->epsvAll)
+        return bftps_command_send_response(session, 503, "Bad sequence of commands\r\n");
 
-    // listen on the socket
-    if (0 != listen(session->pasvFd, 1)) {
-        // failed to listen
-        nErrorCode = errno;
-        CONSOLE_LOG("Failed to listen on the socket: %d %s", nErrorCode,
-                strerror(nErrorCode));
-        bftps_session_close_pasv(session);
+    if (FAILED(bftps_command_pasv_open(session)))
         return bftps_command_send_response(session, 451, "\r\n");
-    }
-
-    //#ifndef _3DS
-    {
-        // get the socket address since we requested an ephemeral port
-        socklen_t addrlen = sizeof (session->pasvAddress);
-        if (0 != getsockname(session->pasvFd, (struct sockaddr*)
-                &session->pasvAddress, &addrlen)) {
-            // failed to get socket address
-            nErrorCode = errno;
-            CONSOLE_LOG("Failed to get socket address: %d %s", nErrorCode,
-                    strerror(nErrorCode));
-            bftps_session_close_pasv(session);
-            return bftps_command_send_response(session, 451, "\r\n");
-        }
-    }
-    //#endif
 
     // we are now listening on the socket
     CONSOLE_LOG("Listening on %s:%u", inet_ntoa(session->pasvAddress.sin_addr),
@@ -939,6 +1150,10 @@ FTP_DECLARE(PORT) {
     session->flags &= ~(BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
             BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
 
+    // EPSV ALL promised we would see no other
+    if (session->epsvAll)
+        return bftps_command_send_response(session, 503, "Bad sequence of commands\r\n");
+
     // dup the args since they are const and we need to change it
     char *addrstr = strdup(args);
     if (addrstr == NULL) {
@@ -1131,6 +1346,7 @@ FTP_DECLARE(RMD) {
         CONSOLE_LOG("rmdir: %d %s", nErrorCode, strerror(nErrorCode));
         return bftps_command_send_response(session, 550, "failed to delete directory\r\n");
     }
+    bftps_cache_meta_invalidate(session->dataBuffer, true);
 
     bftps_common_update_free_space(session);
     return bftps_command_send_response(session, 250, "OK\r\n");
@@ -1151,9 +1367,8 @@ FTP_DECLARE(RNFR) {
 
     // make sure the path exists
     struct stat st;
-    if (0 != lstat(session->dataBuffer, &st)) {
+    if (FAILED(nErrorCode = bftps_cache_meta_lstat(session->dataBuffer, &st))) {
         // error getting path status
-        nErrorCode = errno;
         CONSOLE_LOG("lstat: %d %s", nErrorCode, strerror(nErrorCode));
         return bftps_command_send_response(session, 450, "no such file or directory\r\n");
     }
@@ -1195,11 +1410,144 @@ FTP_DECLARE(RNTO) {
         CONSOLE_LOG("rename: %d %s", nErrorCode, strerror(nErrorCode));
         return bftps_command_send_response(session, 550, "failed to rename file/directory\r\n");
     }
+    bftps_cache_meta_invalidate(rnfr, true);
+    bftps_cache_meta_invalidate(session->dataBuffer, true);
 
     bftps_common_update_free_space(session);
     return bftps_command_send_response(session, 250, "OK\r\n");
 }
 
+// SITE commands, sorted like the ftp ones
+
+// copy from - Must be followed by SITE CPTO
+
+static int bftps_command_site_cpfr(bftps_session_context_t *session, const char *args) {
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+
+    // build the path to copy from
+    int nErrorCode = 0;
+    if (FAILED(nErrorCode = bftps_common_build_path(session, session->cwd, args))) {
+        return bftps_command_send_response(session, 553, "%s\r\n", strerror(nErrorCode));
+    }
+
+    // only regular files can be copied
+    struct stat st;
+    if (FAILED(nErrorCode = bftps_cache_meta_stat(session->dataBuffer, &st)) ||
+            !S_ISREG(st.st_mode)) {
+        return bftps_command_send_response(session, 450, "no such file\r\n");
+    }
+
+    // we are ready for SITE CPTO
+    session->flags |= BFTPS_SESSION_FLAG_COPY;
+    return bftps_command_send_response(session, 350, "OK\r\n");
+}
+
+// copy to - Must be preceded by SITE CPFR, the reply comes once the copy
+// thread is done
+
+static int bftps_command_site_cpto(bftps_session_context_t *session, const char *args) {
+    static char cpfr[BFTPS_SESSION_TRANSFER_BUFFER_SIZE]; // copy-from buffer
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+
+    // make sure the previous command was SITE CPFR
+    if (!(session->flags & BFTPS_SESSION_FLAG_COPY)) {
+        return bftps_command_send_response(session, 503, "Bad sequence of commands\r\n");
+    }
+
+    // clear the copy state
+    session->flags &= ~BFTPS_SESSION_FLAG_COPY;
+
+    // copy the SITE CPFR path
+    memcpy(cpfr, session->dataBuffer, BFTPS_SESSION_TRANSFER_BUFFER_SIZE);
+
+    // build the path to copy to
+    int nErrorCode = 0;
+    if (FAILED(nErrorCode = bftps_common_build_path(session, session->cwd, args))) {
+        return bftps_command_send_response(session, 554, "%s\r\n", strerror(nErrorCode));
+    }
+
+    return bftps_transfer_copy(session, cpfr);
+}
+
+static int bftps_command_site_du(bftps_session_context_t *session, const char *args) {
+    // add up the sizes of everything below a directory
+    return bftps_transfer_tree(session, args, BFTPS_TRANSFER_TREE_USAGE);
+}
+
+static int bftps_command_site_find(bftps_session_context_t *session, const char *args) {
+    // send the paths below a directory that match - Requires a PORT or PASV
+    // connection
+    return bftps_transfer_tree_find(session, args);
+}
+
+static int bftps_command_site_mget(bftps_session_context_t *session, const char *args) {
+    // send the files as one tar stream - Requires a PORT or PASV connection
+    return bftps_transfer_tar(session, args);
+}
+
+static int bftps_command_site_mput(bftps_session_context_t *session, const char *args) {
+    // extract a tar stream in a directory - Requires a PORT or PASV connection
+    return bftps_transfer_untar(session, args);
+}
+
+static int bftps_command_site_rmtree(bftps_session_context_t *session, const char *args) {
+    // remove a directory and everything below it
+    return bftps_transfer_tree(session, args, BFTPS_TRANSFER_TREE_REMOVE);
+}
+
+static bftps_command_t bftps_site_commands[] = {
+    { "CPFR", bftps_command_site_cpfr,},
+    { "CPTO", bftps_command_site_cpto,},
+    { "DU", bftps_command_site_du,},
+    { "FIND", bftps_command_site_find,},
+    { "MGET", bftps_command_site_mget,},
+    { "MPUT", bftps_command_site_mput,},
+    { "RMTREE", bftps_command_site_rmtree,},
+};
+// number of SITE commands
+static const size_t bftps_site_commands_total =
+        sizeof (bftps_site_commands) / sizeof (bftps_site_commands[0]);
+
+// run a server specific command, the first word of args picks it
+
+FTP_DECLARE(SITE) {
+    CONSOLE_LOG("SITE %s", args ? args : "");
+
+    char name[8];
+    size_t length = 0;
+    if (NULL != args) {
+        length = strcspn(args, " ");
+        if (length < sizeof (name)) {
+            memcpy(name, args, length);
+            name[length] = '\0';
+        }
+    }
+
+    bftps_command_t* command = NULL;
+    if (0 < length && length < sizeof (name)) {
+        bftps_command_t key = {name, NULL};
+        command = bsearch(&key, bftps_site_commands, bftps_site_commands_total,
+                sizeof (bftps_command_t), bftps_command_cmp);
+    }
+
+    // CPFR is only kept for CPTO
+    if (NULL == command || 0 != strcasecmp(command->name, "CPTO"))
+        session->flags &= ~BFTPS_SESSION_FLAG_COPY;
+    if (NULL == command) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 502, "unavailable\r\n");
+    }
+
+    // the arguments of the command follow it
+    args += length;
+    while (' ' == *args)
+        ++args;
+    return command->handler(session, args);
+}
+
 // get file size
 
 FTP_DECLARE(SIZE) {
@@ -1213,7 +1561,7 @@ FTP_DECLARE(SIZE) {
         return bftps_command_send_response(session, 553, "%s\r\n", strerror(nErrorCode));
     }
     struct stat st;
-    int rc = stat(session->dataBuffer, &st);
+    int rc = bftps_cache_meta_stat(session->dataBuffer, &st);
     if (0 != rc || !S_ISREG(st.st_mode)) {
         return bftps_command_send_response(session, 550, "Could not get file size.\r\n");
     }
@@ -1250,10 +1598,28 @@ FTP_DECLARE(STAT) {
 
     if (strlen(args) == 0) {
         /* no argument provided, send the server status */
+        bftps_cache_stats_t meta, fd, file;
+        bftps_cache_meta_stats(&meta);
+        bftps_cache_fd_stats(&fd);
+        bftps_cache_file_stats(&file);
+        bftps_transfer_pool_stats_t pool;
+        bftps_transfer_pool_stats(&pool);
         return bftps_command_send_response(session, -211, "FTP server status\r\n"
                 " Uptime: %02d:%02d:%02d\r\n"
+                " Metadata cache: %lu/%lu entries, %lu hits, %lu misses, %lu evictions, %lu invalidations\r\n"
+                " Descriptors cache: %lu/%lu entries, %lu hits, %lu misses, %lu evictions, %lu expired\r\n"
+                " Contents cache: %lu entries, %llu/%llu bytes, %lu hits, %lu misses, %lu evictions, %lu invalidations\r\n"
+                " Transfer buffers: %lu in use, %lu idle, %lu bytes, %lu bytes per session\r\n"
                 "211 End\r\n",
-                hours, minutes, seconds);
+                hours, minutes, seconds,
+                meta.entries, meta.capacity, meta.hits, meta.misses,
+                meta.evictions, meta.invalidations,
+                fd.entries, fd.capacity, fd.hits, fd.misses,
+                fd.evictions, fd.invalidations,
+                file.entries, file.bytes, file.budget, file.hits, file.misses,
+                file.evictions, file.invalidations,
+                (unsigned long) pool.used, (unsigned long) pool.idle,
+                (unsigned long) pool.bytes, (unsigned long) sizeof (bftps_session_context_t));
     }
 
     // argument provided, open the path in STAT mode
@@ -148,7 +148,7 @@ int bftps_common_validate_path(const char *args) {
 int bftps_common_build_path(bftps_session_context_t *session,
         const char* cwd, const char* args) {
     session->dataBufferSize = 0;
-    memset(session->dataBuffer, 0, sizeof (session->dataBuffer));
+    memset(session->dataBuffer, 0, BFTPS_SESSION_TRANSFER_BUFFER_SIZE);
 
     // make sure the input is a valid path
     if (0 != bftps_common_validate_path(args)) {
@@ -158,7 +158,7 @@ int bftps_common_build_path(bftps_session_context_t *session,
     if (args[0] == '/') {
         // this is an absolute path
         size_t len = strlen(args);
-        if (len > sizeof (session->dataBuffer) - 1) {
+        if (len > BFTPS_SESSION_TRANSFER_BUFFER_SIZE - 1) {
             return ENAMETOOLONG;
         }
 
@@ -168,12 +168,12 @@ int bftps_common_build_path(bftps_session_context_t *session,
         // this is a relative path
         int result = 0;
         if (strcmp(cwd, "/") == 0)
-            result = snprintf(session->dataBuffer, sizeof (session->dataBuffer),
+            result = snprintf(session->dataBuffer, BFTPS_SESSION_TRANSFER_BUFFER_SIZE,
                 "/%s", args);
         else
-            result = snprintf(session->dataBuffer, sizeof (session->dataBuffer),
+            result = snprintf(session->dataBuffer, BFTPS_SESSION_TRANSFER_BUFFER_SIZE,
                 "%s/%s", cwd, args);
-        if (result >= sizeof (session->dataBuffer)) {
+        if (result >= BFTPS_SESSION_TRANSFER_BUFFER_SIZE) {
             return ENAMETOOLONG;
         }
         session->dataBufferSize = result;
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* accept4 */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -8,10 +11,26 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #include "bftps_session.h"
+#include "bftps_session_registry.h"
 #include "bftps_command.h"
 #include "bftps_socket.h"
+#include "bftps_cache_fd.h"
+#include "bftps_transfer_direct.h"
+#include "bftps_transfer_atomic.h"
+#include "bftps_transfer_chunk.h"
+#include "bftps_transfer_block.h"
+#include "bftps_transfer_deflate.h"
+#include "bftps_transfer_pool.h"
+#include "bftps_transfer_pasv.h"
+#include "bftps_transfer_demux.h"
+#include "bftps_transfer_tar.h"
+#include "bftps_transfer_copy.h"
+#include "bftps_transfer_tree.h"
 #include "bool.h"
 
 #define POLL_UNKNOWN (~(POLLIN|POLLPRI|POLLOUT))
@@ -24,7 +43,7 @@ int bftps_session_init(bftps_session_context_t** p_session, int fd_listen) {
     if (!p_session || *p_session || (0 > fd_listen))
         return EINVAL;
 
-    bftps_session_context_t* session = malloc(sizeof(bftps_session_context_t));
+    bftps_session_context_t* session = bftps_session_registry_acquire();
     if(NULL == session)
         return ENOMEM;
     
@@ -33,10 +52,19 @@ int bftps_session_init(bftps_session_context_t** p_session, int fd_listen) {
     /* accept connection, saving the client connection address in the session pasv address just to save memory since we will re-write this value below */
     int fdSession;
     socklen_t addressLenght = sizeof (session->pasvAddress);
+#ifdef __linux__
+    // only the listen socket is non-blocking, replies are sent whole on a
+    // blocking command socket
+    fdSession = accept4(fd_listen, (struct sockaddr*) &session->pasvAddress, &addressLenght,
+            SOCK_CLOEXEC);
+#else
     fdSession = accept(fd_listen, (struct sockaddr*) &session->pasvAddress, &addressLenght);
+#endif
     if (0 > fdSession) {
         nErrorCode = errno;
-        CONSOLE_LOG("Failed to accept new session: %d", nErrorCode);
+        // the listen socket is non-blocking, so this only means we took them all
+        if (nErrorCode != EAGAIN && nErrorCode != EWOULDBLOCK)
+            CONSOLE_LOG("Failed to accept new session: %d", nErrorCode);
     } else {
         // initialize session with default values
         strcpy(session->cwd, "/");
@@ -46,10 +74,15 @@ int bftps_session_init(bftps_session_context_t** p_session, int fd_listen) {
         session->flags = 0;
         session->timestamp = 0;
         session->pasvFd = -1;
+        session->pasvParkedFd = -1;
         session->dirMode = BFTPS_TRANSFER_DIR_MODE_INVALID;
         session->transfer = NULL;
+        session->dataBuffer = NULL;
+        session->lwd = NULL;
+        session->filename = NULL;
         session->dataBufferPosition = 0;
         session->dataBufferSize = 0;
+        bftps_transfer_chunk_reset(session);
         session->dataFd = -1;
         session->dataAddress.sin_addr.s_addr = INADDR_ANY;
         session->dir = NULL;
@@ -57,6 +90,16 @@ int bftps_session_init(bftps_session_context_t** p_session, int fd_listen) {
                 BFTPS_TRANSFER_DIR_MLST_SIZE |
                 BFTPS_TRANSFER_DIR_MLST_MODIFY |
                 BFTPS_TRANSFER_DIR_MLST_PERM;
+        session->epsvAll = false;
+        session->transferMode = BFTPS_TRANSFER_MODE_STREAM;
+        session->deflateLevel = BFTPS_TRANSFER_DEFLATE_LEVEL;
+        session->deflate = NULL;
+        session->tar = NULL;
+        bftps_transfer_block_reset(session);
+        session->retrEngine = BFTPS_TRANSFER_ENGINE;
+        session->storDirect = BFTPS_TRANSFER_DIRECT;
+        session->storAtomic = BFTPS_TRANSFER_ATOMIC;
+        session->storDurability = BFTPS_TRANSFER_DURABILITY;
         //session->fileBig = false;
         //session->fileBigIO = NULL;
         session->filenameRefresh = false;
@@ -64,7 +107,31 @@ int bftps_session_init(bftps_session_context_t** p_session, int fd_listen) {
         session->fileFd = -1;
 #else
         session->filep = NULL;
+        session->fileBuffer = NULL;
+#endif
+        session->fileCache = NULL;
+        session->fileShared = NULL;
+        session->fileDeflateFill = NULL;
+#ifdef __linux__
+        session->fileReadFd = -1;
+        session->fileEngine = BFTPS_TRANSFER_ENGINE_READ;
+        session->fileMap = NULL;
+        session->fileMapOffset = 0;
+        session->fileMapSize = 0;
+        session->fileDirectFd = -1;
+        session->fileDirectBuffer = NULL;
+        session->fileDirectSize = 0;
+        session->fileDeflateFd = -1;
+        session->fileAtomic = false;
+        session->fileAtomicPath = NULL;
 #endif
+        session->fileAllocate = 0;
+        session->fileTrim = -1;
+        session->fileSync = NULL;
+        session->fileCopy = NULL;
+        session->tree = NULL;
+        session->fileHintPosition = 0;
+        session->fileHintDropped = 0;
         session->filepos = 0;
         session->filesize = 0;
         session->next = NULL;
@@ -87,7 +154,7 @@ int bftps_session_init(bftps_session_context_t** p_session, int fd_listen) {
     
     // Check if something has failed or not
     if(FAILED(nErrorCode))
-        free(session);
+        bftps_session_registry_release(session);
     else
         *p_session = session;
 
@@ -111,14 +178,25 @@ int bftps_session_poll(bftps_session_context_t *session) {
     fds[0].events = POLLIN | POLLPRI;
     fds[0].revents = 0;
     nfds_t nfds = 1;
+    bool parking = false;
 
     switch (session->mode) {
         case BFTPS_SESSION_MODE_COMMAND:
-            // we are waiting to read a command
+            // we are waiting to read a command, and for the PASV connection
+            // the client may open before sending the transfer command
+            if ((session->flags & BFTPS_SESSION_FLAG_PASV) &&
+                    0 <= session->pasvFd && 0 > session->pasvParkedFd) {
+                fds[1].fd = session->pasvFd;
+                fds[1].events = POLLIN;
+                fds[1].revents = 0;
+                nfds = 2;
+                parking = true;
+            }
             break;
         case BFTPS_SESSION_MODE_DATA_CONNECT:
             if (session->flags & BFTPS_SESSION_FLAG_PASV) {
-                // we are waiting for a PASV connection
+                // we are waiting for a PASV connection, there is no socket
+                // to poll if it comes through the shared data port
                 fds[1].fd = session->pasvFd;
                 fds[1].events = POLLIN;
             } else {
@@ -139,6 +217,10 @@ int bftps_session_poll(bftps_session_context_t *session) {
             fds[1].revents = 0;
             nfds = 2;
             break;
+        case BFTPS_SESSION_MODE_SYNC:
+            // commands sent meanwhile wait for the reply of the upload
+            fds[0].events = 0;
+            break;
         case BFTPS_SESSION_MODE_INVALID:
         default:
             CONSOLE_LOG("Invalid mode: %d", session->mode);
@@ -178,7 +260,12 @@ int bftps_session_poll(bftps_session_context_t *session) {
     }
 
     /* check the data/pasv socket */
-    if (nfds > 1 && fds[1].revents != 0) {
+    if (parking) {
+        // keep it for the transfer command, the command we just handled may
+        // have closed the socket or replaced it
+        if ((fds[1].revents & POLLIN) && (session->flags & BFTPS_SESSION_FLAG_PASV))
+            bftps_session_accept(session);
+    } else if (nfds > 1 && fds[1].revents != 0) {
         switch (session->mode) {
             case BFTPS_SESSION_MODE_COMMAND:
                 // this shouldn't happen?
@@ -197,11 +284,15 @@ int bftps_session_poll(bftps_session_context_t *session) {
                             BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
                     bftps_command_send_response(session, 426, "Data connection failed\r\n");
                 } else if (fds[1].revents & POLLIN) {
-                    if (FAILED(bftps_session_accept(session)))
+                    // it is started below
+                    int result = bftps_session_accept(session);
+                    if (FAILED(result) && result != EAGAIN && result != EWOULDBLOCK) {
                         bftps_session_mode_set(session,
                             BFTPS_SESSION_MODE_COMMAND,
                             BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
                             BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+                        bftps_command_send_response(session, 425, "Failed to establish connection\r\n");
+                    }
                 } else if (fds[1].revents & POLLOUT) {
                     CONSOLE_LOG("connected to %s:%u",
                             inet_ntoa(session->dataAddress.sin_addr),
@@ -236,6 +327,20 @@ int bftps_session_poll(bftps_session_context_t *session) {
         }
     }
 
+    // start the transfer right away if its PASV connection is already here
+    if (session->mode == BFTPS_SESSION_MODE_DATA_CONNECT)
+        bftps_session_connect_parked(session);
+
+    // check if the upload we are replying to is on disk
+    if (session->mode == BFTPS_SESSION_MODE_SYNC)
+        bftps_session_transfer(session);
+
+    // an idle session doesn't need its buffers, unless RNTO or SITE CPTO
+    // will look for the RNFR or SITE CPFR path
+    if (session->mode == BFTPS_SESSION_MODE_COMMAND &&
+            !(session->flags & (BFTPS_SESSION_FLAG_RENAME | BFTPS_SESSION_FLAG_COPY)))
+        bftps_session_buffers_release(session);
+
     return 0;
 }
 
@@ -256,13 +361,44 @@ int bftps_session_destroy(bftps_session_context_t* session) {
         return EINVAL;
     
     // Supposedly all connections where already closed when setting the mode
-    // in bftps_session_mode_set, so let's just free the memory
-    
-    free(session);
+    // in bftps_session_mode_set, so let's just give the memory back
+    bftps_session_buffers_release(session);
+    bftps_transfer_deflate_release(session);
+    bftps_session_registry_release(session);
+
+    return 0;
+}
 
+int bftps_session_buffers_acquire(bftps_session_context_t *session) {
+    if (NULL != session->dataBuffer)
+        return 0;
+
+    bftps_session_buffers_t* buffers = bftps_transfer_pool_acquire(BFTPS_TRANSFER_POOL_SESSION);
+    if (NULL == buffers)
+        return ENOMEM;
+
+    session->dataBuffer = buffers->data;
+    session->lwd = buffers->lwd;
+    session->filename = buffers->filename;
+    session->filename[0] = '\0';
+#ifdef __linux__
+    session->fileAtomicPath = buffers->fileAtomicPath;
+    session->fileAtomicPath[0] = '\0';
+#endif
     return 0;
 }
 
+void bftps_session_buffers_release(bftps_session_context_t *session) {
+    // data is the first member, so this is the start of the buffers
+    bftps_transfer_pool_release(BFTPS_TRANSFER_POOL_SESSION, session->dataBuffer);
+    session->dataBuffer = NULL;
+    session->lwd = NULL;
+    session->filename = NULL;
+#ifdef __linux__
+    session->fileAtomicPath = NULL;
+#endif
+}
+
 // open current working directory for ftp session
 
 int bftps_session_open_cwd(bftps_session_context_t *session) {
@@ -298,12 +434,25 @@ int bftps_session_close_cwd(bftps_session_context_t *session) {
 int bftps_session_close_pasv(bftps_session_context_t *session) {
     if (!session)
         return EINVAL;
+    // a connection nobody used
+    if (0 <= session->pasvParkedFd)
+        bftps_socket_destroy(&session->pasvParkedFd, false);
+    // stop waiting on the shared data port
+    if (session->flags & BFTPS_SESSION_FLAG_SHARED) {
+        bftps_transfer_demux_release(session);
+        session->flags &= ~BFTPS_SESSION_FLAG_SHARED;
+    }
     if (0 > session->pasvFd)
         return 0;
     // close pasv socket
     CONSOLE_LOG("Stop listening on %s:%u",
             inet_ntoa(session->pasvAddress.sin_addr),
             ntohs(session->pasvAddress.sin_port));
+    // sockets from the pool keep listening for the next PASV
+    if (bftps_transfer_pasv_release(session->pasvFd, ntohs(session->pasvAddress.sin_port))) {
+        session->pasvFd = -1;
+        return 0;
+    }
     return bftps_socket_destroy(&session->pasvFd, false);
 }
 
@@ -330,6 +479,41 @@ int bftps_session_close_data(bftps_session_context_t *session) {
     return 0;
 }
 
+// descriptor of the file being uploaded, with everything buffered written to it
+
+int bftps_session_upload_fd(bftps_session_context_t *session) {
+#ifdef __linux__
+    if (0 <= session->fileDirectFd)
+        return session->fileDirectFd;
+#endif
+#ifdef _USE_FD_TRANSFER
+    return session->fileFd;
+#else
+    if (NULL != session->filep && 0 == fflush(session->filep))
+        return fileno(session->filep);
+    return -1;
+#endif
+}
+
+// give back the space ALLO reserved that the upload didn't use
+
+int bftps_session_trim_file(bftps_session_context_t *session) {
+    if (0 > session->fileTrim)
+        return 0;
+
+    int nErrorCode = 0;
+    int fd = bftps_session_upload_fd(session);
+    uint64_t size = session->filepos > (uint64_t) session->fileTrim ?
+            session->filepos : (uint64_t) session->fileTrim;
+    if (0 <= fd && 0 != ftruncate(fd, size)) {
+        nErrorCode = errno;
+        CONSOLE_LOG("ftruncate: %d %s", nErrorCode, strerror(nErrorCode));
+    }
+    session->fileTrim = -1;
+
+    return nErrorCode;
+}
+
 // close open file for ftp session
 
 int bftps_session_close_file(bftps_session_context_t *session) {
@@ -337,6 +521,22 @@ int bftps_session_close_file(bftps_session_context_t *session) {
     bftps_file_transfer_end(session);
     
     int nErrorCode = 0;
+    // a broken direct upload still keeps what we received
+    if (FAILED(nErrorCode = bftps_transfer_direct_flush(session))) {
+        CONSOLE_LOG("write: %d %s", nErrorCode, strerror(nErrorCode));
+    }
+
+    if (0 <= session->fileTrim)
+        nErrorCode = bftps_session_trim_file(session);
+    bftps_transfer_sync_release(session->fileSync);
+    session->fileSync = NULL;
+    bftps_transfer_copy_release(session->fileCopy);
+    session->fileCopy = NULL;
+    bftps_transfer_tree_release(session->tree);
+    session->tree = NULL;
+    bftps_transfer_direct_close(session);
+    bftps_transfer_tar_close(session);
+
 #ifdef _USE_FD_TRANSFER
     if (-1 != session->fileFd) {
         if (-1 == close(session->fileFd)) {
@@ -353,6 +553,34 @@ int bftps_session_close_file(bftps_session_context_t *session) {
         }
     }
     session->filep = NULL;
+    bftps_transfer_pool_release(BFTPS_TRANSFER_POOL_FILE, session->fileBuffer);
+    session->fileBuffer = NULL;
+#endif
+    bftps_transfer_atomic_close(session);
+    bftps_cache_file_release(session->fileCache);
+    session->fileCache = NULL;
+    bftps_transfer_shared_detach(session->fileShared);
+    session->fileShared = NULL;
+    // the download ended before the compressed stream did
+    bftps_cache_deflate_abort(session->fileDeflateFill);
+    session->fileDeflateFill = NULL;
+#ifdef __linux__
+    if (0 <= session->fileDeflateFd && 0 != close(session->fileDeflateFd)) {
+        nErrorCode = errno;
+        CONSOLE_LOG("close: %d %s", nErrorCode, strerror(nErrorCode));
+    }
+    session->fileDeflateFd = -1;
+    if (NULL != session->fileMap) {
+        if (0 != munmap(session->fileMap, session->fileMapSize)) {
+            nErrorCode = errno;
+            CONSOLE_LOG("munmap: %d %s", nErrorCode, strerror(nErrorCode));
+        }
+    }
+    session->fileMap = NULL;
+    session->fileMapSize = 0;
+    // the descriptor is kept open by the cache for the next download
+    bftps_cache_fd_release(session->fileReadFd);
+    session->fileReadFd = -1;
 #endif
 
     /* if(NULL != session->fileBigIO)
@@ -417,56 +645,70 @@ int bftps_session_set_socket_nonblocking(int fd) {
     return nErrorCode;
 }
 
-// accept PASV connection for ftp session
+// accept PASV connection for ftp session, it is parked until the transfer
+// command needs it
 
 int bftps_session_accept(bftps_session_context_t *session) {
+    if (!(session->flags & BFTPS_SESSION_FLAG_PASV) || 0 > session->pasvFd)
+        return EINVAL;
+    if (0 <= session->pasvParkedFd)
+        return 0;
+
+    int nErrorCode = 0;
+    // accept connection from peer
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof (addr);
+#ifdef __linux__
+    int newFd = accept4(session->pasvFd, (struct sockaddr*) &addr, &addrlen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int newFd = accept(session->pasvFd, (struct sockaddr*) &addr, &addrlen);
+#endif
+    if (0 > newFd) {
+        nErrorCode = errno;
+        // the peer may have given up before we took it
+        if (nErrorCode != EAGAIN && nErrorCode != EWOULDBLOCK)
+            CONSOLE_LOG("accept: %d %s", nErrorCode, strerror(nErrorCode));
+        return nErrorCode;
+    }
 
-    if (session->flags & BFTPS_SESSION_FLAG_PASV) {
-        // clear PASV flag
-        session->flags &= ~BFTPS_SESSION_FLAG_PASV;
+#ifndef __linux__
+    // set the socket to non-blocking
+    if (FAILED(nErrorCode = bftps_session_set_socket_nonblocking(newFd))) {
+        bftps_socket_destroy(&newFd, true);
+        return nErrorCode;
+    }
+#endif
 
-        // tell the peer that we're ready to accept the connection
-        bftps_command_send_response(session, 150, "Ready\r\n");
+    CONSOLE_LOG("accepted connection from %s:%u",
+            inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    session->pasvParkedFd = newFd;
+    session->dataAddress = addr;
 
-        int nErrorCode = 0;
-        // accept connection from peer
-        struct sockaddr_in addr;
-        socklen_t addrlen = sizeof (addr);
-        int newFd = accept(session->pasvFd, (struct sockaddr*) &addr, &addrlen);
-        if (0 > newFd) {
-            nErrorCode = errno;
-            CONSOLE_LOG("accept: %d %s", nErrorCode, strerror(nErrorCode));
-            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
-            bftps_command_send_response(session, 425, "Failed to establish connection\r\n");
-            return nErrorCode;
-        }
+    return 0;
+}
 
-        // set the socket to non-blocking
-        if (FAILED(nErrorCode = bftps_session_set_socket_nonblocking(newFd))) {
-            bftps_socket_destroy(&newFd, true);
-            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
-            bftps_command_send_response(session, 425, "Failed to establish connection\r\n");
-            return -1;
-        }
+// move the parked PASV connection to the data socket and start the transfer
 
-        CONSOLE_LOG("accepted connection from %s:%u",
-                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+bool bftps_session_connect_parked(bftps_session_context_t *session) {
+    if (!(session->flags & BFTPS_SESSION_FLAG_PASV))
+        return false;
 
-        // we are ready to transfer data
-        bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_TRANSFER,
-                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV);
-        session->dataFd = newFd;
+    // the shared data port accepts for us
+    if ((session->flags & BFTPS_SESSION_FLAG_SHARED) && 0 > session->pasvParkedFd)
+        session->pasvParkedFd = bftps_transfer_demux_take(session, &session->dataAddress);
+    if (0 > session->pasvParkedFd)
+        return false;
 
-        return 0;
-    } else {
-        // peer didn't send PASV command 
-        bftps_command_send_response(session, 503, "Bad sequence of commands\r\n");
-        return -1;
-    }
+    // we are ready to transfer data
+    session->dataFd = session->pasvParkedFd;
+    session->pasvParkedFd = -1;
+    session->flags &= ~BFTPS_SESSION_FLAG_PASV;
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_TRANSFER,
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV);
+    bftps_command_send_response(session, 150, "Ready\r\n");
+
+    return true;
 }
 
 // connect to peer for ftp session
@@ -10,9 +10,19 @@
 #include "macros.h"
 #include "bool.h"
 #include "file_io.h"
+#include "bftps_cache_file.h"
+#include "bftps_cache_deflate.h"
+#include "bftps_transfer_shared.h"
+#include "bftps_transfer_sync.h"
 
-#define BFTPS_SESSION_COMMUNICATION_BUFFER_SIZE BFTPS_SOCKET_BUFFER_SIZE
+// command lines are a path at most, this leaves room for telnet escapes and pipelining
+#define BFTPS_SESSION_COMMUNICATION_BUFFER_SIZE (2 * MAX_PATH)
+#ifdef __linux__
+// room for the data chunks to grow on fast links
+#define BFTPS_SESSION_TRANSFER_BUFFER_SIZE (64 * 1024)
+#else
 #define BFTPS_SESSION_TRANSFER_BUFFER_SIZE BFTPS_SOCKET_BUFFER_SIZE
+#endif
 #define BFTPS_SESSION_FILE_BUFFER_SIZE 2*BFTPS_SOCKET_BUFFER_SIZE
 
 #ifdef __cplusplus
@@ -27,6 +37,8 @@ extern "C" {
         BFTPS_SESSION_FLAG_SEND = BIT(4), /* data transfer in sink mode */
         BFTPS_SESSION_FLAG_RENAME = BIT(5), /* last command was RNFR and buffer contains path */
         BFTPS_SESSION_FLAG_URGENT = BIT(6), /* in telnet urgent mode */
+        BFTPS_SESSION_FLAG_SHARED = BIT(7), /* the PASV connection comes through the shared data port */
+        BFTPS_SESSION_FLAG_COPY = BIT(8), /* last command was SITE CPFR and buffer contains path */
     } bftps_session_flags_t;
 
     typedef enum {
@@ -34,6 +46,7 @@ extern "C" {
         BFTPS_SESSION_MODE_COMMAND,
         BFTPS_SESSION_MODE_DATA_CONNECT,
         BFTPS_SESSION_MODE_DATA_TRANSFER,        
+        BFTPS_SESSION_MODE_SYNC, /* waiting for the upload to be on disk, or a copy or tree walk to end, to reply */
         BFTPS_SESSION_MODE_DESTROY
     } bftps_session_mode_t;
 
@@ -42,44 +55,103 @@ extern "C" {
         BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA = BIT(1), // Close the data_fd
     } bftps_session_mode_set_flags_t;
 
+    // what a session only needs while it runs a command or a transfer, taken
+    // from the transfer pool so idle sessions stay small
+    typedef struct {
+        char data[BFTPS_SESSION_TRANSFER_BUFFER_SIZE];
+        char lwd[MAX_PATH];
+        char filename[MAX_PATH];
+#ifdef __linux__
+        char fileAtomicPath[MAX_PATH];
+#endif
+    } bftps_session_buffers_t;
+
+    // names a session without keeping a pointer to it, see bftps_session_registry.h
+    typedef uint64_t bftps_session_handle_t;
+
     typedef struct _bftps_session_context_t{
-        char cwd[MAX_PATH]; /* current working directory */
-        char lwd[MAX_PATH];  /* list working directory */
-        char commandBuffer[BFTPS_SESSION_COMMUNICATION_BUFFER_SIZE]; /* communication buffer */
-        size_t commandBufferSize; /* length of communication buffer */
+        // used on every poll and transfer callback
         int commandFd; /* socket for command connection */
+        int dataFd;    /* socket for data transfer */
+        int pasvFd; /* listen socket for PASV */
+        int pasvParkedFd; /* PASV connection accepted before a transfer needed it */
         bftps_session_mode_t mode; /* session state */
         bftps_session_flags_t flags; /* session flags */
-        time_t timestamp; /* time from last command */
-        struct sockaddr_in pasvAddress;  /* listen address for PASV connection */
-        int pasvFd; /* listen socket for PASV */
         bftps_transfer_loop_status_t (*transfer)(struct _bftps_session_context_t*);  /* data transfer callback */
-        bftps_transfer_dir_mode_t dirMode; /* dir transfer mode */
-        struct sockaddr_in dataAddress;  /* client address for data connection */
-        int dataFd;    /* socket for data transfer */
-        char dataBuffer[BFTPS_SESSION_TRANSFER_BUFFER_SIZE]; /* persistent data between callbacks */
+        char* dataBuffer; /* persistent data between callbacks, from the session buffers */
         size_t dataBufferPosition; /* persistent buffer position between callbacks */
         size_t dataBufferSize; /* persistent buffer size between callbacks */
-        DIR *dir; /* persistent open directory pointer between callbacks */
-        bftps_transfer_dir_mlst_flags_t mlstFlags; /* session MLST flags */
-        //bool fileBig; /* check if it is a big file or small */
-        //file_io_context_t* fileBigIO; /* with big files we use this */
-        bool filenameRefresh; /* session could be re-used for other file */
-        char filename[MAX_PATH]; /* where we will save the filename */
+        size_t dataChunk; /* bytes of dataBuffer used by each recv or read */
+        int dataChunkStreak; /* transfers in a row that filled (> 0) or barely used (< 0) dataChunk */
+        bftps_transfer_block_t dataBlock; /* MODE B framing of the transfer */
+        uint64_t filepos; /* persistent file position between callbacks */
+        uint64_t filesize; /* persistent file size between callbacks */ 
 #ifdef _USE_FD_TRANSFER
         int fileFd; /* file descriptor for the open file being transferred */
 #else
         FILE* filep;
-        char fileBuffer[BFTPS_SESSION_FILE_BUFFER_SIZE]; /* stdio file buffer */
+        char* fileBuffer; /* stdio file buffer, from the transfer pool */
 #endif
-        uint64_t filepos; /* persistent file position between callbacks */
-        uint64_t filesize; /* persistent file size between callbacks */ 
+#ifdef __linux__
+        int fileReadFd; /* shared read-only descriptor for RETR, from the descriptors cache */
+        bftps_transfer_engine_t fileEngine; /* how fileReadFd is being sent */
+        char* fileMap; /* mapped window of the file for the mmap engine */
+        uint64_t fileMapOffset; /* file offset of fileMap */
+        size_t fileMapSize; /* bytes mapped at fileMap */
+        int fileDirectFd; /* O_DIRECT descriptor for STOR, -1 if not used */
+        char* fileDirectBuffer; /* aligned buffer gathering the data for fileDirectFd */
+        size_t fileDirectSize; /* bytes in fileDirectBuffer, the ones right before filepos */
+        int fileDeflateFd; /* compressed variant sent instead of the file in MODE Z, -1 if none */
+#endif
+        bftps_cache_deflate_entry_t* fileDeflateFill; /* compressed variant this RETR writes for the next ones */
+        bftps_cache_file_entry_t* fileCache; /* cached contents for RETR, read nothing from disk */
+        bftps_transfer_shared_reader_t* fileShared; /* read-ahead window shared with other RETR of the file */
+        bftps_transfer_sync_t* fileSync; /* group sync the upload waits for */
+        bftps_transfer_copy_t* fileCopy; /* SITE CPTO copy the session waits for */
+        bftps_transfer_tree_t* tree; /* SITE RMTREE or DU the session waits for */
+        uint64_t fileHintPosition; /* read ahead or written back up to here */
+        uint64_t fileHintDropped; /* dropped from the page cache up to here */
+        DIR *dir; /* persistent open directory pointer between callbacks */
+        bftps_transfer_dir_mode_t dirMode; /* dir transfer mode */
         struct _bftps_session_context_t* next;
+
+        // used once per command or transfer
+        bftps_session_handle_t handle; /* unique for the server lifetime, set by the registry */
+        time_t timestamp; /* time from last command */
+        size_t commandBufferSize; /* length of communication buffer */
+        struct sockaddr_in pasvAddress;  /* listen address for PASV connection */
+        struct sockaddr_in dataAddress;  /* client address for data connection */
+        bftps_transfer_dir_mlst_flags_t mlstFlags; /* session MLST flags */
+        bool epsvAll; /* EPSV ALL was sent, only EPSV sets up data connections */
+        bftps_transfer_mode_t transferMode; /* MODE of the data connection */
+        int deflateLevel; /* MODE Z compression level set with OPTS MODE Z LEVEL */
+        bftps_transfer_deflate_t* deflate; /* MODE Z streams, kept across transfers */
+        bftps_transfer_tar_t* tar; /* archive SITE MGET or MPUT is working on */
+        bftps_transfer_engine_t retrEngine; /* engine asked for RETR */
+        bool storDirect; /* STOR skips the page cache */
+        bool storAtomic; /* STOR uploads to a hidden file and publishes it when done */
+        bftps_transfer_durability_t storDurability; /* what STOR does before replying */
+        //bool fileBig; /* check if it is a big file or small */
+        //file_io_context_t* fileBigIO; /* with big files we use this */
+        bool filenameRefresh; /* session could be re-used for other file */
+#ifdef __linux__
+        bool fileAtomic; /* the upload isn't published yet */
+#endif
+        uint64_t fileAllocate; /* bytes announced with ALLO for the next upload */
+        int64_t fileTrim; /* size before reserving ALLO space, -1 if none was reserved */
+        char* lwd;  /* list working directory, from the session buffers */
+        char* filename; /* where we will save the filename, from the session buffers */
+#ifdef __linux__
+        char* fileAtomicPath; /* hidden name of the upload, empty if it has none, from the session buffers */
+#endif
+        char cwd[MAX_PATH]; /* current working directory */
+        char commandBuffer[BFTPS_SESSION_COMMUNICATION_BUFFER_SIZE]; /* communication buffer */
     } bftps_session_context_t;
 
     extern int bftps_session_init(bftps_session_context_t** p_session, int fd_listen);
     extern int bftps_session_destroy(bftps_session_context_t* session);
     extern int bftps_session_accept(bftps_session_context_t *session);
+    extern bool bftps_session_connect_parked(bftps_session_context_t *session);
     extern int bftps_session_connect(bftps_session_context_t *session);
     extern int bftps_session_transfer(bftps_session_context_t *session);
     extern int bftps_session_open_cwd(bftps_session_context_t *session);
@@ -88,6 +160,12 @@ extern "C" {
     extern int bftps_session_mode_set(bftps_session_context_t* session,
             bftps_session_mode_t mode, bftps_session_mode_set_flags_t flags);
     extern int bftps_session_poll(bftps_session_context_t* session);
+    extern int bftps_session_set_socket_nonblocking(int fd);
+    extern int bftps_session_upload_fd(bftps_session_context_t *session);
+    extern int bftps_session_trim_file(bftps_session_context_t *session);
+    // take the session buffers from the pool if we don't have them yet
+    extern int bftps_session_buffers_acquire(bftps_session_context_t *session);
+    extern void bftps_session_buffers_release(bftps_session_context_t *session);
 
 #ifdef __cplusplus
 }
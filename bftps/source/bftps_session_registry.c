@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "bftps_session_registry.h"
+
+// the handle keeps the slot index in the low half and the generation the
+// slot was acquired with in the high half
+#define BFTPS_SESSION_REGISTRY_INDEX(handle) ((uint32_t) ((handle) & 0xFFFFFFFF))
+#define BFTPS_SESSION_REGISTRY_HANDLE(generation, index) \
+    (((bftps_session_handle_t) (generation) << 32) | (index))
+
+typedef struct _bftps_session_registry_slot_t {
+    bftps_session_context_t session; /* first, so the session is the slot */
+    uint32_t index; /* where lookup finds it */
+    bool used;
+    struct _bftps_session_registry_slot_t* nextFree;
+} bftps_session_registry_slot_t;
+
+// only the worker thread uses them, so no lock is needed
+static bftps_session_registry_slot_t** gp_sessionSlabs = NULL;
+static size_t g_sessionSlabsCount = 0;
+static size_t g_sessionSlabsCapacity = 0;
+static bftps_session_registry_slot_t* gp_sessionFree = NULL;
+// keeps going across restarts so an old handle never resolves again
+static uint32_t g_sessionGeneration = 0;
+
+static int bftps_session_registry_grow() {
+    if (g_sessionSlabsCount == g_sessionSlabsCapacity) {
+        size_t capacity = g_sessionSlabsCapacity ? 2 * g_sessionSlabsCapacity : 4;
+        bftps_session_registry_slot_t** slabs = realloc(gp_sessionSlabs,
+                capacity * sizeof (bftps_session_registry_slot_t*));
+        if (NULL == slabs)
+            return ENOMEM;
+        gp_sessionSlabs = slabs;
+        g_sessionSlabsCapacity = capacity;
+    }
+
+    bftps_session_registry_slot_t* slab = malloc(BFTPS_SESSION_REGISTRY_SLAB *
+            sizeof (bftps_session_registry_slot_t));
+    if (NULL == slab)
+        return ENOMEM;
+    gp_sessionSlabs[g_sessionSlabsCount++] = slab;
+
+    // push them backwards so the first slot is handed out first
+    int slot;
+    for (slot = BFTPS_SESSION_REGISTRY_SLAB - 1; slot >= 0; --slot) {
+        slab[slot].index = (g_sessionSlabsCount - 1) * BFTPS_SESSION_REGISTRY_SLAB + slot;
+        slab[slot].used = false;
+        slab[slot].nextFree = gp_sessionFree;
+        gp_sessionFree = &slab[slot];
+    }
+    return 0;
+}
+
+bftps_session_context_t* bftps_session_registry_acquire() {
+    if (NULL == gp_sessionFree && FAILED(bftps_session_registry_grow()))
+        return NULL;
+
+    bftps_session_registry_slot_t* slot = gp_sessionFree;
+    gp_sessionFree = slot->nextFree;
+    slot->used = true;
+    slot->nextFree = NULL;
+    slot->session.handle = BFTPS_SESSION_REGISTRY_HANDLE(++g_sessionGeneration,
+            slot->index);
+    return &slot->session;
+}
+
+void bftps_session_registry_release(bftps_session_context_t* session) {
+    if (NULL == session)
+        return;
+
+    bftps_session_registry_slot_t* slot = (bftps_session_registry_slot_t*) session;
+    slot->used = false;
+    slot->nextFree = gp_sessionFree;
+    gp_sessionFree = slot;
+}
+
+bftps_session_context_t* bftps_session_registry_lookup(bftps_session_handle_t handle) {
+    uint32_t index = BFTPS_SESSION_REGISTRY_INDEX(handle);
+    size_t slab = index / BFTPS_SESSION_REGISTRY_SLAB;
+    if (slab >= g_sessionSlabsCount)
+        return NULL;
+
+    bftps_session_registry_slot_t* slot = &gp_sessionSlabs[slab][index % BFTPS_SESSION_REGISTRY_SLAB];
+    if (!slot->used || slot->session.handle != handle)
+        return NULL;
+    return &slot->session;
+}
+
+void bftps_session_registry_destroy() {
+    size_t slab;
+    for (slab = 0; slab < g_sessionSlabsCount; ++slab)
+        free(gp_sessionSlabs[slab]);
+    free(gp_sessionSlabs);
+    gp_sessionSlabs = NULL;
+    g_sessionSlabsCount = 0;
+    g_sessionSlabsCapacity = 0;
+    gp_sessionFree = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef BFTPS_SESSION_REGISTRY_H
+#define BFTPS_SESSION_REGISTRY_H
+
+#include "bftps_session.h"
+
+// can be overridden at build time
+#ifndef BFTPS_SESSION_REGISTRY_SLAB /* sessions allocated at once */
+#ifdef _3DS
+#define BFTPS_SESSION_REGISTRY_SLAB 4
+#else
+#define BFTPS_SESSION_REGISTRY_SLAB 32
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // a free session from the slabs with its handle set, NULL if there is
+    // no memory for a new slab
+    extern bftps_session_context_t* bftps_session_registry_acquire();
+    // give the session back, its handle stops resolving
+    extern void bftps_session_registry_release(bftps_session_context_t* session);
+    // the session the handle was given to, NULL if it was released since
+    extern bftps_session_context_t* bftps_session_registry_lookup(bftps_session_handle_t handle);
+    // free the slabs, all sessions must have been released
+    extern void bftps_session_registry_destroy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_SESSION_REGISTRY_H */
+
@@ -9,7 +9,12 @@
 #include "macros.h"
 
 int bftps_socket_options_increase_buffers(int fd) {
-    static int sockBufferSize = BFTPS_SOCKET_BUFFER_SIZE;
+    static int sockBufferSize = BFTPS_SOCKET_KERNEL_BUFFER_SIZE;
+    // setting them turns the kernel autotuning off, which would cap the
+    // throughput on long fat links
+    if (0 == sockBufferSize)
+        return 0;
+
     int nErrorCode = 0;
     // increase receive buffer size
     if (0 != setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockBufferSize,
@@ -8,6 +8,15 @@ extern "C" {
 #endif
 
     #define BFTPS_SOCKET_BUFFER_SIZE 32768
+    // SO_SNDBUF/SO_RCVBUF of data sockets, 0 leaves them to the kernel autotuning,
+    // can be overridden at build time
+#ifndef BFTPS_SOCKET_KERNEL_BUFFER_SIZE
+#ifdef __linux__
+    #define BFTPS_SOCKET_KERNEL_BUFFER_SIZE 0
+#else
+    #define BFTPS_SOCKET_KERNEL_BUFFER_SIZE BFTPS_SOCKET_BUFFER_SIZE
+#endif
+#endif
     extern int bftps_socket_options_increase_buffers(int fd);
     extern int bftps_socket_destroy(int* p_fd, bool session_socket);
 
@@ -2,6 +2,10 @@
 #ifndef BFTPS_TRANSFER_H
 #define BFTPS_TRANSFER_H
 
+#include <stddef.h>
+
+#include "bool.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +18,51 @@ extern "C" {
         BFTPS_TRANSFER_LOOP_STATUS_EXIT, /* Terminate looping */
     } bftps_transfer_loop_status_t;
 
+    // how RETR gets the file to the socket
+    typedef enum {
+        BFTPS_TRANSFER_ENGINE_READ, /* read into the session buffer and send it */
+        BFTPS_TRANSFER_ENGINE_SENDFILE, /* let the kernel send from the page cache */
+        BFTPS_TRANSFER_ENGINE_MMAP, /* map the file and send from the mapping */
+    } bftps_transfer_engine_t;
+
+    // default engine, can be overridden at build time and changed per
+    // session with OPTS RETR
+#ifndef BFTPS_TRANSFER_ENGINE
+#ifdef __linux__
+#define BFTPS_TRANSFER_ENGINE BFTPS_TRANSFER_ENGINE_SENDFILE
+#else
+#define BFTPS_TRANSFER_ENGINE BFTPS_TRANSFER_ENGINE_READ
+#endif
+#endif
+
+    // how the data is laid out on the data connection, set with MODE
+    typedef enum {
+        BFTPS_TRANSFER_MODE_STREAM, /* raw bytes, closing the connection ends the data */
+        BFTPS_TRANSFER_MODE_BLOCK, /* blocks with a header, the connection is kept for the next transfer */
+        BFTPS_TRANSFER_MODE_DEFLATE, /* a zlib stream, closing the connection ends it */
+    } bftps_transfer_mode_t;
+
+    // MODE Z stream state of a session
+    typedef struct _bftps_transfer_deflate_t bftps_transfer_deflate_t;
+
+    // SITE MGET archive being sent
+    typedef struct _bftps_transfer_tar_t bftps_transfer_tar_t;
+
+    // SITE CPTO copy being done by the copy thread
+    typedef struct _bftps_transfer_copy_t bftps_transfer_copy_t;
+
+    // SITE RMTREE or DU being walked by the tree threads
+    typedef struct _bftps_transfer_tree_t bftps_transfer_tree_t;
+
+    // MODE B block being sent or received
+    typedef struct {
+        unsigned char header[3]; /* descriptor and big-endian byte count */
+        size_t headerSize; /* header bytes received, or to be sent */
+        size_t headerPosition; /* header bytes already sent */
+        unsigned char descriptor; /* of the block whose data comes now */
+        size_t remaining; /* data bytes left in the block */
+        bool eof; /* the EOF block was received, or is being sent */
+    } bftps_transfer_block_t;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,179 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* O_TMPFILE */
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bftps_transfer_atomic.h"
+#include "bftps_transfer_sync.h"
+#include "macros.h"
+
+#ifdef __linux__
+
+static unsigned int g_transferAtomicCounter = 0;
+
+// hidden name next to path, unique for this process
+static int bftps_transfer_atomic_name(char* tempPath, const char* path) {
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    // the copy thread makes names too
+    if (MAX_PATH <= snprintf(tempPath, MAX_PATH, "%.*s.%s.bftps.%d.%u",
+            (int) (name - path), path, name, (int) getpid(),
+            __sync_add_and_fetch(&g_transferAtomicCounter, 1)))
+        return ENAMETOOLONG;
+    return 0;
+}
+
+// directory of path
+static void bftps_transfer_atomic_dir(char* dir, const char* path) {
+    const char* name = strrchr(path, '/');
+    if (NULL == name)
+        strcpy(dir, ".");
+    else
+        snprintf(dir, MAX_PATH, "%.*s", (int) (name - path + 1), path);
+}
+
+// it's okay if this fails, the file itself is on disk already
+static void bftps_transfer_atomic_sync_dir(const char* path) {
+    char dir[MAX_PATH];
+    bftps_transfer_atomic_dir(dir, path);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (0 > fd || 0 != fsync(fd)) {
+        CONSOLE_LOG("fsync '%s': %d %s", dir, errno, strerror(errno));
+    }
+    if (0 <= fd)
+        close(fd);
+}
+
+int bftps_transfer_atomic_open(bftps_session_context_t *session, int flags) {
+    // we may be trying again without O_DIRECT
+    bftps_transfer_atomic_close(session);
+    session->fileAtomic = true;
+
+    // an unnamed file leaves nothing behind if the upload breaks, but we can
+    // only name it later through /proc
+    if (0 == access("/proc/self/fd", X_OK)) {
+        char dir[MAX_PATH];
+        bftps_transfer_atomic_dir(dir, session->dataBuffer);
+
+        int fd = open(dir, (flags & ~(O_CREAT | O_TRUNC)) | O_TMPFILE,
+                S_IRWXU | S_IRWXG | S_IRWXO);
+        if (0 <= fd || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+            return fd;
+    }
+
+    // the filesystem doesn't have them, so use a hidden name
+    int fd = bftps_transfer_atomic_create(session->dataBuffer, session->fileAtomicPath,
+            flags, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (0 > fd)
+        session->fileAtomicPath[0] = '\0';
+    return fd;
+}
+
+int bftps_transfer_atomic_create(const char *path, char *tempPath, int flags, mode_t mode) {
+    int nErrorCode = 0;
+    int tries;
+    for (tries = 0; tries < 8; ++tries) {
+        if (FAILED(nErrorCode = bftps_transfer_atomic_name(tempPath, path)))
+            break;
+        int fd = open(tempPath, flags | O_CREAT | O_EXCL, mode);
+        if (0 <= fd)
+            return fd;
+        if (EEXIST != (nErrorCode = errno))
+            break;
+    }
+
+    errno = nErrorCode;
+    return -1;
+}
+
+int bftps_transfer_atomic_publish(bftps_session_context_t *session) {
+    if (!session->fileAtomic)
+        return 0;
+
+    int nErrorCode = 0;
+    if ('\0' == session->fileAtomicPath[0]) {
+        char procPath[32];
+        snprintf(procPath, sizeof (procPath), "/proc/self/fd/%d",
+                bftps_session_upload_fd(session));
+        if (0 != linkat(AT_FDCWD, procPath, AT_FDCWD, session->filename, AT_SYMLINK_FOLLOW)) {
+            if (errno != EEXIST) {
+                nErrorCode = errno;
+                CONSOLE_LOG("linkat '%s': %d %s", session->filename, nErrorCode, strerror(nErrorCode));
+                return nErrorCode;
+            }
+
+            // link can't replace the old file, so give it a hidden name and
+            // rename it over
+            int tries;
+            for (tries = 0; tries < 8; ++tries) {
+                if (FAILED(nErrorCode = bftps_transfer_atomic_name(session->fileAtomicPath,
+                        session->filename)))
+                    break;
+                if (0 == linkat(AT_FDCWD, procPath, AT_FDCWD, session->fileAtomicPath,
+                        AT_SYMLINK_FOLLOW))
+                    break;
+                if (EEXIST != (nErrorCode = errno))
+                    break;
+            }
+            if (FAILED(nErrorCode)) {
+                CONSOLE_LOG("linkat '%s': %d %s", session->fileAtomicPath, nErrorCode, strerror(nErrorCode));
+                session->fileAtomicPath[0] = '\0';
+                return nErrorCode;
+            }
+        }
+    }
+
+    if ('\0' != session->fileAtomicPath[0] &&
+            0 != rename(session->fileAtomicPath, session->filename)) {
+        nErrorCode = errno;
+        CONSOLE_LOG("rename '%s': %d %s", session->fileAtomicPath, nErrorCode, strerror(nErrorCode));
+        return nErrorCode;
+    }
+    session->fileAtomic = false;
+    session->fileAtomicPath[0] = '\0';
+
+    // a durable upload needs its name to be durable too
+    if (BFTPS_TRANSFER_DURABILITY_NONE != session->storDurability)
+        bftps_transfer_atomic_sync_dir(session->filename);
+    return 0;
+}
+
+void bftps_transfer_atomic_close(bftps_session_context_t *session) {
+    // the session buffers are only there while the upload is
+    if (!session->fileAtomic)
+        return;
+
+    // the old file stays as it was
+    if ('\0' != session->fileAtomicPath[0] && 0 != unlink(session->fileAtomicPath)) {
+        CONSOLE_LOG("unlink '%s': %d %s", session->fileAtomicPath, errno, strerror(errno));
+    }
+    session->fileAtomic = false;
+    session->fileAtomicPath[0] = '\0';
+}
+
+#else
+
+int bftps_transfer_atomic_open(bftps_session_context_t *session, int flags) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int bftps_transfer_atomic_create(const char *path, char *tempPath, int flags, mode_t mode) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int bftps_transfer_atomic_publish(bftps_session_context_t *session) {
+    return 0;
+}
+
+void bftps_transfer_atomic_close(bftps_session_context_t *session) {
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef BFTPS_TRANSFER_ATOMIC_H
+#define BFTPS_TRANSFER_ATOMIC_H
+
+#include "bftps_session.h"
+
+// can be overridden at build time
+#ifndef BFTPS_TRANSFER_ATOMIC /* STOR publishes whole files unless OPTS STOR says otherwise */
+#define BFTPS_TRANSFER_ATOMIC false
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // open a file nobody sees in the directory of session->dataBuffer,
+    // returns the descriptor or -1 with errno set
+    extern int bftps_transfer_atomic_open(bftps_session_context_t *session, int flags);
+    // create a file under a hidden name next to path, tempPath is set to it,
+    // returns the descriptor or -1 with errno set
+    extern int bftps_transfer_atomic_create(const char *path, char *tempPath, int flags,
+            mode_t mode);
+    // give the uploaded file the name session->filename, replacing the old one
+    extern int bftps_transfer_atomic_publish(bftps_session_context_t *session);
+    // remove what a broken upload left behind
+    extern void bftps_transfer_atomic_close(bftps_session_context_t *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_ATOMIC_H */
+
@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "bftps_transfer_block.h"
+#include "bftps_transfer_deflate.h"
+#include "bftps_command.h"
+#include "macros.h"
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+void bftps_transfer_block_reset(bftps_session_context_t *session) {
+    memset(&session->dataBlock, 0, sizeof (session->dataBlock));
+    bftps_transfer_deflate_reset(session);
+}
+
+bool bftps_transfer_block_framed(bftps_session_context_t *session) {
+    return session->transferMode == BFTPS_TRANSFER_MODE_BLOCK &&
+            session->dataFd != session->commandFd;
+}
+
+bool bftps_transfer_block_encoded(bftps_session_context_t *session) {
+    return session->transferMode != BFTPS_TRANSFER_MODE_STREAM &&
+            session->dataFd != session->commandFd;
+}
+
+bool bftps_transfer_block_reuse(bftps_session_context_t *session) {
+    if (session->transferMode != BFTPS_TRANSFER_MODE_BLOCK ||
+            0 > session->dataFd || session->dataFd == session->commandFd)
+        return false;
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_TRANSFER, 0);
+    bftps_command_send_response(session, 125, "Data connection already open\r\n");
+    return true;
+}
+
+// send what is left of the header, EWOULDBLOCK if it didn't all go
+static int bftps_transfer_block_send_header(bftps_session_context_t *session) {
+    bftps_transfer_block_t *block = &session->dataBlock;
+    while (block->headerPosition < block->headerSize) {
+        // the data follows right away, so let it share the segment
+        ssize_t rc = send(session->dataFd, block->header + block->headerPosition,
+                block->headerSize - block->headerPosition, MSG_NOSIGNAL | MSG_MORE);
+        if (0 > rc)
+            return errno;
+        block->headerPosition += rc;
+    }
+    block->headerSize = 0;
+    block->headerPosition = 0;
+    return 0;
+}
+
+ssize_t bftps_transfer_block_send(bftps_session_context_t *session,
+        const char *data, size_t size) {
+    if (!bftps_transfer_block_encoded(session))
+        return send(session->dataFd, data, size, MSG_NOSIGNAL);
+    else if (session->transferMode == BFTPS_TRANSFER_MODE_DEFLATE)
+        return bftps_transfer_deflate_send(session, data, size);
+
+    bftps_transfer_block_t *block = &session->dataBlock;
+    if (0 == block->remaining && 0 == block->headerSize) {
+        // start a new block with as much as it takes
+        size_t count = size > BFTPS_TRANSFER_BLOCK_MAX ? BFTPS_TRANSFER_BLOCK_MAX : size;
+        block->header[0] = 0;
+        block->header[1] = (count >> 8) & 0xFF;
+        block->header[2] = count & 0xFF;
+        block->headerSize = sizeof (block->header);
+        block->headerPosition = 0;
+        block->remaining = count;
+    }
+
+    int nErrorCode = bftps_transfer_block_send_header(session);
+    if (FAILED(nErrorCode)) {
+        errno = nErrorCode;
+        return -1;
+    }
+
+    ssize_t rc = send(session->dataFd, data,
+            size < block->remaining ? size : block->remaining, MSG_NOSIGNAL);
+    if (0 < rc)
+        block->remaining -= rc;
+    return rc;
+}
+
+ssize_t bftps_transfer_block_recv(bftps_session_context_t *session,
+        char *buffer, size_t size) {
+    if (!bftps_transfer_block_encoded(session))
+        return recv(session->dataFd, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    else if (session->transferMode == BFTPS_TRANSFER_MODE_DEFLATE)
+        return bftps_transfer_deflate_recv(session, buffer, size);
+
+    bftps_transfer_block_t *block = &session->dataBlock;
+    if (block->eof && 0 == block->remaining)
+        return 0;
+
+    // take the rest of the block and the header of the next one, but
+    // nothing after the EOF block, that is already the next transfer
+    size_t wanted = block->remaining;
+    if (!block->eof)
+        wanted += sizeof (block->header) - block->headerSize;
+    if (wanted > size)
+        wanted = size;
+
+    ssize_t rc = recv(session->dataFd, buffer, wanted, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (0 == rc) {
+        // the client can't close the connection to end the data in MODE B
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (0 > rc)
+        return rc;
+
+    size_t data = (size_t) rc < block->remaining ? (size_t) rc : block->remaining;
+    unsigned char descriptor = block->descriptor;
+    block->remaining -= data;
+
+    // whatever comes after the data is the next header
+    size_t headerBytes = rc - data;
+    if (0 < headerBytes) {
+        memcpy(block->header + block->headerSize, buffer + data, headerBytes);
+        block->headerSize += headerBytes;
+        if (block->headerSize == sizeof (block->header)) {
+            block->descriptor = block->header[0];
+            block->remaining = (block->header[1] << 8) | block->header[2];
+            block->headerSize = 0;
+            if (block->descriptor & BFTPS_TRANSFER_BLOCK_EOF)
+                block->eof = true;
+        }
+    }
+
+    // restart markers aren't file data, and we don't restart from them
+    if (descriptor & BFTPS_TRANSFER_BLOCK_RESTART)
+        data = 0;
+    if (0 == data) {
+        if (block->eof && 0 == block->remaining)
+            return 0;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    return data;
+}
+
+bftps_transfer_loop_status_t bftps_transfer_block_complete(
+        bftps_session_context_t *session, int code) {
+    bftps_session_mode_set_flags_t flags = BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA;
+
+    if (bftps_transfer_block_framed(session)) {
+        bftps_transfer_block_t *block = &session->dataBlock;
+        if (!block->eof) {
+            // an empty block marks the end
+            block->header[0] = BFTPS_TRANSFER_BLOCK_EOF;
+            block->header[1] = 0;
+            block->header[2] = 0;
+            block->headerSize = sizeof (block->header);
+            block->headerPosition = 0;
+            block->eof = true;
+        }
+
+        int nErrorCode = bftps_transfer_block_send_header(session);
+        if (nErrorCode == EWOULDBLOCK)
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT; // we will end it in next poll
+        if (FAILED(nErrorCode)) {
+            CONSOLE_LOG("send: %d %s", nErrorCode, strerror(nErrorCode));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, flags);
+            bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        }
+        flags = BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV;
+    } else if (bftps_transfer_block_encoded(session)) {
+        // the compressed stream has to be ended before the connection
+        int nErrorCode = bftps_transfer_deflate_finish(session);
+        if (nErrorCode == EWOULDBLOCK)
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT; // we will end it in next poll
+        if (FAILED(nErrorCode)) {
+            CONSOLE_LOG("send: %d %s", nErrorCode, strerror(nErrorCode));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, flags);
+            bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        }
+    }
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, flags);
+    bftps_command_send_response(session, code, "OK\r\n");
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+bftps_session_mode_set_flags_t bftps_transfer_block_close_flags(
+        bftps_session_context_t *session) {
+    if (bftps_transfer_block_framed(session))
+        return BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV;
+    return BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV | BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA;
+}
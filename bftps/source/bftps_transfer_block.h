@@ -0,0 +1,52 @@
+#ifndef BFTPS_TRANSFER_BLOCK_H
+#define BFTPS_TRANSFER_BLOCK_H
+
+#include <sys/types.h>
+
+#include "bftps_transfer.h"
+#include "bftps_session.h"
+
+// MODE B descriptor codes (RFC 959)
+#define BFTPS_TRANSFER_BLOCK_EOR 0x80 /* end of record */
+#define BFTPS_TRANSFER_BLOCK_EOF 0x40 /* end of file */
+#define BFTPS_TRANSFER_BLOCK_ERRORS 0x20 /* suspected errors in the data */
+#define BFTPS_TRANSFER_BLOCK_RESTART 0x10 /* the data is a restart marker */
+#define BFTPS_TRANSFER_BLOCK_MAX 0xFFFF /* data bytes of a block */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // start a new transfer with no block in progress
+    extern void bftps_transfer_block_reset(bftps_session_context_t *session);
+    // the data of this transfer goes in blocks, STAT sends on the control
+    // connection so it never does
+    extern bool bftps_transfer_block_framed(bftps_session_context_t *session);
+    // the data of this transfer goes in blocks or compressed, so it must
+    // pass through send and recv below
+    extern bool bftps_transfer_block_encoded(bftps_session_context_t *session);
+    // start the transfer on the connection the last MODE B transfer kept,
+    // false if there is none
+    extern bool bftps_transfer_block_reuse(bftps_session_context_t *session);
+    // send and recv of the data connection, in MODE B they add and remove
+    // the block headers and only count data bytes, recv returns 0 after
+    // the EOF block, in MODE Z they compress and uncompress
+    extern ssize_t bftps_transfer_block_send(bftps_session_context_t *session,
+            const char *data, size_t size);
+    extern ssize_t bftps_transfer_block_recv(bftps_session_context_t *session,
+            char *buffer, size_t size);
+    // end a download that went well, in MODE B the EOF block is sent first
+    // and the connection is kept for the next transfer, in MODE Z the end
+    // of the compressed stream is sent first
+    extern bftps_transfer_loop_status_t bftps_transfer_block_complete(
+            bftps_session_context_t *session, int code);
+    // how to leave the data connection once an upload got all its data
+    extern bftps_session_mode_set_flags_t bftps_transfer_block_close_flags(
+            bftps_session_context_t *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_BLOCK_H */
+
@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
+
+#include "bftps_transfer_chunk.h"
+#include "macros.h"
+
+// bytes the connection moves in a round trip, 0 if we can't tell
+static size_t bftps_transfer_chunk_window(bftps_session_context_t *session) {
+#ifdef __linux__
+    struct tcp_info info;
+    socklen_t length = sizeof (info);
+    if (0 != getsockopt(session->dataFd, IPPROTO_TCP, TCP_INFO, &info, &length)) {
+        CONSOLE_LOG("getsockopt: %d %s", errno, strerror(errno));
+        return 0;
+    }
+
+    // the receive space is what the kernel measured arriving in one rtt,
+    // the congestion window is what we may have in flight during one
+    if (session->flags & BFTPS_SESSION_FLAG_RECV)
+        return info.tcpi_rcv_space;
+    return (size_t) info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+#else
+    return 0;
+#endif
+}
+
+void bftps_transfer_chunk_reset(bftps_session_context_t *session) {
+    session->dataChunk = BFTPS_TRANSFER_CHUNK_MIN;
+    if (session->dataChunk > BFTPS_SESSION_TRANSFER_BUFFER_SIZE)
+        session->dataChunk = BFTPS_SESSION_TRANSFER_BUFFER_SIZE;
+    session->dataChunkStreak = 0;
+}
+
+void bftps_transfer_chunk_update(bftps_session_context_t *session,
+        size_t requested, ssize_t transferred) {
+    if (0 >= transferred)
+        return;
+
+    if ((size_t) transferred >= requested) {
+        // there was more to move than we asked for
+        if (0 > session->dataChunkStreak)
+            session->dataChunkStreak = 0;
+        if (++session->dataChunkStreak < BFTPS_TRANSFER_CHUNK_STREAK ||
+                session->dataChunk == BFTPS_SESSION_TRANSFER_BUFFER_SIZE)
+            return;
+
+        // double it, but a bigger chunk than a round trip worth of data
+        // only wastes cache
+        size_t chunk = session->dataChunk * 2;
+        size_t window = bftps_transfer_chunk_window(session);
+        if (0 < window && window < chunk)
+            chunk = window > session->dataChunk ? window : session->dataChunk;
+        if (chunk > BFTPS_SESSION_TRANSFER_BUFFER_SIZE)
+            chunk = BFTPS_SESSION_TRANSFER_BUFFER_SIZE;
+        session->dataChunk = chunk;
+    } else if ((size_t) transferred < requested / 4) {
+        // the link is slower than the chunk
+        if (0 < session->dataChunkStreak)
+            session->dataChunkStreak = 0;
+        if (--session->dataChunkStreak > -BFTPS_TRANSFER_CHUNK_STREAK ||
+                session->dataChunk <= BFTPS_TRANSFER_CHUNK_MIN)
+            return;
+
+        session->dataChunk /= 2;
+        if (session->dataChunk < BFTPS_TRANSFER_CHUNK_MIN)
+            session->dataChunk = BFTPS_TRANSFER_CHUNK_MIN;
+    } else
+        return;
+
+    session->dataChunkStreak = 0;
+}
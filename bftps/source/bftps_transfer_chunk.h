@@ -0,0 +1,30 @@
+#ifndef BFTPS_TRANSFER_CHUNK_H
+#define BFTPS_TRANSFER_CHUNK_H
+
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_CHUNK_MIN /* chunk a transfer starts with */
+#define BFTPS_TRANSFER_CHUNK_MIN (4 * 1024)
+#endif
+#ifndef BFTPS_TRANSFER_CHUNK_STREAK /* transfers in a row needed to grow or shrink the chunk */
+#define BFTPS_TRANSFER_CHUNK_STREAK 4
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // start a new data connection with the smallest chunk
+    extern void bftps_transfer_chunk_reset(bftps_session_context_t *session);
+    // tell how much of requested the last recv or send moved, so the chunk
+    // follows what the connection can take
+    extern void bftps_transfer_chunk_update(bftps_session_context_t *session,
+            size_t requested, ssize_t transferred);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_CHUNK_H */
+
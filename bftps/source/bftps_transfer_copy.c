@@ -0,0 +1,347 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* copy_file_range */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "bftps_transfer_copy.h"
+#include "bftps_transfer_atomic.h"
+#include "bftps_command.h"
+#include "bftps_common.h"
+#include "bftps_cache_meta.h"
+#include "thread.h"
+#include "event.h"
+#include "atomic.h"
+#include "macros.h"
+
+extern void bftps_file_transfer_store(bftps_session_context_t* session);
+
+#ifdef __linux__
+
+struct _bftps_transfer_copy_t {
+    struct _bftps_transfer_copy_t* next;
+    char from[MAX_PATH];
+    char to[MAX_PATH];
+    uint64_t copied; /* bytes already in to */
+    int result; /* errno of the copy */
+    bool done; /* the copy ended */
+    bool released; /* nobody is waiting anymore, stop and free it */
+};
+
+typedef struct {
+    thread_handle_t thread;
+    event_handle_t event; /* wakes the thread up */
+    int fd; /* eventfd signaled after each copy */
+    spinlock_t lock; /* protects the queue and the copied/done/released fields */
+    bftps_transfer_copy_t* pending; /* copies waiting their turn, oldest first */
+    bftps_transfer_copy_t** pendingLast;
+    volatile bool exit;
+} bftps_transfer_copy_context_t;
+
+static bftps_transfer_copy_context_t* gp_transferCopy = NULL;
+
+// copy the whole file, the kernel does it with copy_file_range, which
+// shares the extents on filesystems with reflinks, or with sendfile when
+// the files are on different filesystems
+
+static int bftps_transfer_copy_run(bftps_transfer_copy_context_t* context,
+        bftps_transfer_copy_t* copy) {
+    int nErrorCode = 0;
+    int from = open(copy->from, O_RDONLY | O_CLOEXEC);
+    if (0 > from)
+        return errno;
+
+    // the copy is written next to the destination and only replaces it
+    // once whole, so a failed or cancelled copy leaves the old file as it was
+    struct stat fromSt, toSt;
+    char temp[MAX_PATH];
+    int to = -1;
+    if (0 != fstat(from, &fromSt))
+        nErrorCode = errno;
+    else if (!S_ISREG(fromSt.st_mode))
+        nErrorCode = EINVAL;
+    else if (0 == stat(copy->to, &toSt) && toSt.st_dev == fromSt.st_dev &&
+            toSt.st_ino == fromSt.st_ino)
+        nErrorCode = EINVAL;
+    else if (0 > (to = bftps_transfer_atomic_create(copy->to, temp, O_WRONLY | O_CLOEXEC,
+            fromSt.st_mode & 0777)))
+        nErrorCode = errno;
+
+    bool kernelCopy = true;
+    while (SUCCEEDED(nErrorCode)) {
+        if (context->exit || copy->released) {
+            nErrorCode = ECANCELED;
+            break;
+        }
+
+        ssize_t rc;
+        if (kernelCopy) {
+            rc = copy_file_range(from, NULL, to, NULL, BFTPS_TRANSFER_COPY_CHUNK, 0);
+            if (0 > rc && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+                    errno == EINVAL)) {
+                // older kernels only copy within a filesystem
+                kernelCopy = false;
+                continue;
+            }
+        } else
+            rc = sendfile(to, from, NULL, BFTPS_TRANSFER_COPY_CHUNK);
+
+        if (0 > rc) {
+            if (errno != EINTR)
+                nErrorCode = errno;
+        } else if (0 == rc)
+            break;
+        else {
+            spinlock_acquire(context->lock);
+            copy->copied += rc;
+            spinlock_release(context->lock);
+        }
+    }
+
+    close(from);
+    if (0 <= to) {
+        if (0 != close(to) && SUCCEEDED(nErrorCode))
+            nErrorCode = errno;
+        if (SUCCEEDED(nErrorCode) && 0 != rename(temp, copy->to))
+            nErrorCode = errno;
+        // don't leave half a file behind
+        if (FAILED(nErrorCode))
+            unlink(temp);
+    }
+    return nErrorCode;
+}
+
+THREAD_CALLBACK_DEFINITION(bftps_transfer_copy_thread, arg) {
+    bftps_transfer_copy_context_t* context = (bftps_transfer_copy_context_t*) arg;
+
+    while (true) {
+        spinlock_acquire(context->lock);
+        bftps_transfer_copy_t* copy = context->pending;
+        if (NULL != copy) {
+            context->pending = copy->next;
+            if (NULL == context->pending)
+                context->pendingLast = &context->pending;
+        }
+        spinlock_release(context->lock);
+
+        if (NULL == copy) {
+            if (context->exit)
+                break;
+            event_wait(context->event, INT_MAX);
+            event_reset(context->event);
+            continue;
+        }
+
+        // when leaving, what is still queued is only ended
+        int result = context->exit ? ECANCELED : bftps_transfer_copy_run(context, copy);
+
+        spinlock_acquire(context->lock);
+        bool released = copy->released;
+        copy->result = result;
+        copy->done = true;
+        spinlock_release(context->lock);
+        if (released)
+            free(copy);
+
+        // wake the worker thread so the reply goes out
+        uint64_t value = 1;
+        if (0 > write(context->fd, &value, sizeof (value))) {
+            CONSOLE_LOG("write: %d %s", errno, strerror(errno));
+        }
+    }
+
+    THREAD_CALLBACK_RETURN(0);
+}
+
+int bftps_transfer_copy_init() {
+    if (NULL != gp_transferCopy)
+        return EALREADY;
+
+    bftps_transfer_copy_context_t* context = malloc(sizeof (bftps_transfer_copy_context_t));
+    if (NULL == context)
+        return ENOMEM;
+    memset(context, 0, sizeof (bftps_transfer_copy_context_t));
+    context->pendingLast = &context->pending;
+
+    int nErrorCode = 0;
+    context->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (0 > context->fd) {
+        nErrorCode = errno;
+        free(context);
+        return nErrorCode;
+    }
+    if (FAILED(nErrorCode = event_create(&context->event))) {
+        close(context->fd);
+        free(context);
+        return nErrorCode;
+    }
+    if (FAILED(nErrorCode = thread_create(&context->thread, bftps_transfer_copy_thread, context))) {
+        event_destroy(&context->event);
+        close(context->fd);
+        free(context);
+        return nErrorCode;
+    }
+
+    gp_transferCopy = context;
+    return 0;
+}
+
+void bftps_transfer_copy_destroy() {
+    if (NULL == gp_transferCopy)
+        return;
+
+    // the copy running is stopped and the queued ones are not started
+    gp_transferCopy->exit = true;
+    event_set(gp_transferCopy->event);
+    thread_join(&gp_transferCopy->thread, NULL);
+    event_destroy(&gp_transferCopy->event);
+    close(gp_transferCopy->fd);
+    free(gp_transferCopy);
+    gp_transferCopy = NULL;
+}
+
+int bftps_transfer_copy_fd() {
+    return NULL == gp_transferCopy ? -1 : gp_transferCopy->fd;
+}
+
+void bftps_transfer_copy_poll() {
+    if (NULL == gp_transferCopy)
+        return;
+
+    // the sessions check their own copies, we only need to clear the signal
+    uint64_t value;
+    if (0 > read(gp_transferCopy->fd, &value, sizeof (value)) && errno != EAGAIN) {
+        CONSOLE_LOG("read: %d %s", errno, strerror(errno));
+    }
+}
+
+int bftps_transfer_copy(bftps_session_context_t *session, const char *from) {
+    int nErrorCode = 0;
+    struct stat st;
+    bftps_transfer_copy_t* copy = NULL;
+    if (NULL == gp_transferCopy)
+        nErrorCode = ENOSYS;
+    else if (FAILED(nErrorCode = bftps_cache_meta_stat(from, &st))) {
+        CONSOLE_LOG("stat: %d %s", nErrorCode, strerror(nErrorCode));
+    } else if (NULL == (copy = malloc(sizeof (bftps_transfer_copy_t))))
+        nErrorCode = ENOMEM;
+    if (FAILED(nErrorCode)) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+        if (nErrorCode == ENOSYS)
+            return bftps_command_send_response(session, 502, "unavailable\r\n");
+        return bftps_command_send_response(session, 550, "failed to copy file\r\n");
+    }
+
+    snprintf(copy->from, sizeof (copy->from), "%s", from);
+    snprintf(copy->to, sizeof (copy->to), "%s", session->dataBuffer);
+    copy->next = NULL;
+    copy->copied = 0;
+    copy->result = 0;
+    copy->done = false;
+    copy->released = false;
+
+    spinlock_acquire(gp_transferCopy->lock);
+    *gp_transferCopy->pendingLast = copy;
+    gp_transferCopy->pendingLast = &copy->next;
+    spinlock_release(gp_transferCopy->lock);
+    event_set(gp_transferCopy->event);
+
+    // the transfer info shows the file being written
+    session->fileCopy = copy;
+    session->flags &= ~(BFTPS_SESSION_FLAG_RECV | BFTPS_SESSION_FLAG_SEND);
+    session->flags |= BFTPS_SESSION_FLAG_RECV;
+    session->filepos = 0;
+    session->filesize = st.st_size;
+    session->filenameRefresh = true; // new file name was set
+    strncpy(session->filename, session->dataBuffer, MAX_PATH);
+    bftps_file_transfer_store(session);
+
+    // we reply once the copy thread is done with it
+    session->transfer = bftps_transfer_copy_wait;
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_SYNC, 0);
+    return 0;
+}
+
+bftps_transfer_loop_status_t bftps_transfer_copy_wait(bftps_session_context_t *session) {
+    bftps_transfer_copy_t* copy = session->fileCopy;
+
+    spinlock_acquire(gp_transferCopy->lock);
+    bool done = copy->done;
+    int result = copy->result;
+    session->filepos = copy->copied;
+    spinlock_release(gp_transferCopy->lock);
+
+    bftps_file_transfer_store(session);
+    if (!done)
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+
+    if (FAILED(result)) {
+        CONSOLE_LOG("copy '%s': %d %s", copy->to, result, strerror(result));
+    }
+    bftps_cache_meta_invalidate(session->filename, false);
+    bftps_common_update_free_space(session);
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    if (result == ENOSPC || result == EDQUOT)
+        bftps_command_send_response(session, 552, "Insufficient storage space\r\n");
+    else if (FAILED(result))
+        bftps_command_send_response(session, 550, "failed to copy file\r\n");
+    else
+        bftps_command_send_response(session, 250, "OK\r\n");
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+void bftps_transfer_copy_release(bftps_transfer_copy_t *copy) {
+    if (NULL == copy)
+        return;
+
+    spinlock_acquire(gp_transferCopy->lock);
+    bool done = copy->done;
+    if (!done)
+        copy->released = true;
+    spinlock_release(gp_transferCopy->lock);
+
+    if (done)
+        free(copy);
+}
+
+#else
+
+int bftps_transfer_copy_init() {
+    return ENOSYS;
+}
+
+void bftps_transfer_copy_destroy() {
+}
+
+int bftps_transfer_copy_fd() {
+    return -1;
+}
+
+void bftps_transfer_copy_poll() {
+}
+
+int bftps_transfer_copy(bftps_session_context_t *session, const char *from) {
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    return bftps_command_send_response(session, 502, "unavailable\r\n");
+}
+
+bftps_transfer_loop_status_t bftps_transfer_copy_wait(bftps_session_context_t *session) {
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+void bftps_transfer_copy_release(bftps_transfer_copy_t *copy) {
+}
+
+#endif
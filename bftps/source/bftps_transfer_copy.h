@@ -0,0 +1,36 @@
+#ifndef BFTPS_TRANSFER_COPY_H
+#define BFTPS_TRANSFER_COPY_H
+
+#include "bftps_transfer.h"
+#include "bftps_session.h"
+
+// can be overridden at build time
+#ifndef BFTPS_TRANSFER_COPY_CHUNK /* bytes copied between progress updates */
+#define BFTPS_TRANSFER_COPY_CHUNK (16 * 1024 * 1024)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern int bftps_transfer_copy_init();
+    extern void bftps_transfer_copy_destroy();
+    // descriptor to poll, it is readable once a copy is done, -1 if there is none
+    extern int bftps_transfer_copy_fd();
+    extern void bftps_transfer_copy_poll();
+    // copy the file from to the path in the session buffer on the copy
+    // thread, the session replies once it is done
+    extern int bftps_transfer_copy(bftps_session_context_t *session, const char *from);
+    // transfer callback, publishes the progress of the copy and replies once
+    // it is done
+    extern bftps_transfer_loop_status_t bftps_transfer_copy_wait(
+            bftps_session_context_t *session);
+    // the session doesn't wait anymore, a copy still running is stopped
+    extern void bftps_transfer_copy_release(bftps_transfer_copy_t *copy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_COPY_H */
+
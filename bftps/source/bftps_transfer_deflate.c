@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "bftps_transfer_deflate.h"
+#include "bftps_cache_deflate.h"
+#include "macros.h"
+
+#if 0 < BFTPS_TRANSFER_DEFLATE
+
+#include <zlib.h>
+
+struct _bftps_transfer_deflate_t {
+    z_stream deflateStream;
+    z_stream inflateStream;
+    bool deflateReady; /* deflateInit was done */
+    bool inflateReady; /* inflateInit was done */
+    bool started; /* the stream of this transfer was reset */
+    bool ended; /* the end of the stream was compressed or uncompressed */
+    int level; /* deflateStream compresses with it */
+    size_t bufferSize; /* compressed bytes in the buffer */
+    size_t bufferPosition; /* of them already sent */
+    unsigned char buffer[BFTPS_TRANSFER_DEFLATE_BUFFER_SIZE];
+};
+
+// only the worker thread compresses, so no lock is needed
+static struct timespec g_deflateGuardStart;
+static unsigned long long g_deflateGuardBusy = 0; /* ns spent compressing in this window */
+static int g_deflateGuardDrop = 0; /* levels below what the sessions asked */
+
+static unsigned long long bftps_transfer_deflate_elapsed(const struct timespec* from,
+        const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+// account the time a deflate call took and, once the window is over, lower
+// the level if compressing took most of the worker or raise it back
+
+static void bftps_transfer_deflate_guard(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    g_deflateGuardBusy += bftps_transfer_deflate_elapsed(start, &now);
+
+    unsigned long long window = bftps_transfer_deflate_elapsed(&g_deflateGuardStart, &now);
+    if (window < BFTPS_TRANSFER_DEFLATE_GUARD_WINDOW * 1000000ULL)
+        return;
+
+    unsigned long long busy = g_deflateGuardBusy * 100 / window;
+    if (busy >= BFTPS_TRANSFER_DEFLATE_GUARD_BUSY && g_deflateGuardDrop < Z_BEST_COMPRESSION - 1)
+        ++g_deflateGuardDrop;
+    else if (busy < BFTPS_TRANSFER_DEFLATE_GUARD_BUSY / 2 && 0 < g_deflateGuardDrop)
+        --g_deflateGuardDrop;
+    g_deflateGuardStart = now;
+    g_deflateGuardBusy = 0;
+}
+
+static int bftps_transfer_deflate_level(bftps_session_context_t *session) {
+    // level 0 only stores, there is nothing to lower
+    if (0 == session->deflateLevel)
+        return 0;
+    int level = session->deflateLevel - g_deflateGuardDrop;
+    return level < Z_BEST_SPEED ? Z_BEST_SPEED : level;
+}
+
+// the state is kept across transfers, only the streams are reset
+
+static int bftps_transfer_deflate_start(bftps_session_context_t *session, bool compress) {
+    bftps_transfer_deflate_t *state = session->deflate;
+    if (NULL == state) {
+        if (NULL == (state = malloc(sizeof (bftps_transfer_deflate_t))))
+            return ENOMEM;
+        state->deflateReady = false;
+        state->inflateReady = false;
+        state->started = false;
+        session->deflate = state;
+    }
+    if (state->started)
+        return 0;
+
+    if (compress) {
+        int level = bftps_transfer_deflate_level(session);
+        if (state->deflateReady) {
+            deflateReset(&state->deflateStream);
+            if (level != state->level && Z_OK == deflateParams(&state->deflateStream,
+                    level, Z_DEFAULT_STRATEGY))
+                state->level = level;
+        } else {
+            memset(&state->deflateStream, 0, sizeof (z_stream));
+            if (Z_OK != deflateInit(&state->deflateStream, level))
+                return ENOMEM;
+            state->deflateReady = true;
+            state->level = level;
+        }
+    } else {
+        if (state->inflateReady)
+            inflateReset(&state->inflateStream);
+        else {
+            memset(&state->inflateStream, 0, sizeof (z_stream));
+            if (Z_OK != inflateInit(&state->inflateStream))
+                return ENOMEM;
+            state->inflateReady = true;
+        }
+    }
+
+    state->started = true;
+    state->ended = false;
+    state->bufferSize = 0;
+    state->bufferPosition = 0;
+    return 0;
+}
+
+// send the compressed bytes in the buffer, EWOULDBLOCK if some are left
+
+static int bftps_transfer_deflate_flush(bftps_session_context_t *session) {
+    bftps_transfer_deflate_t *state = session->deflate;
+    while (state->bufferPosition < state->bufferSize) {
+        ssize_t rc = send(session->dataFd, state->buffer + state->bufferPosition,
+                state->bufferSize - state->bufferPosition, MSG_NOSIGNAL);
+        if (0 > rc)
+            return errno;
+        else if (0 == rc)
+            return ECONNRESET;
+        state->bufferPosition += rc;
+    }
+    state->bufferSize = 0;
+    state->bufferPosition = 0;
+    return 0;
+}
+
+// compress into the empty buffer, returns the data bytes taken
+
+static size_t bftps_transfer_deflate_compress(bftps_session_context_t *session,
+        const char *data, size_t size, int flush) {
+    bftps_transfer_deflate_t *state = session->deflate;
+    z_stream *stream = &state->deflateStream;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    stream->next_out = state->buffer;
+    stream->avail_out = sizeof (state->buffer);
+
+    // follow the guard between calls, whatever is pending goes out first
+    int level = bftps_transfer_deflate_level(session);
+    if (level != state->level) {
+        stream->next_in = Z_NULL;
+        stream->avail_in = 0;
+        if (Z_OK == deflateParams(stream, level, Z_DEFAULT_STRATEGY))
+            state->level = level;
+    }
+
+    stream->next_in = (Bytef *) data;
+    stream->avail_in = size;
+    if (Z_STREAM_END == deflate(stream, flush))
+        state->ended = true;
+
+    state->bufferSize = sizeof (state->buffer) - stream->avail_out;
+    state->bufferPosition = 0;
+    bftps_transfer_deflate_guard(&start);
+
+    // the cache keeps variants of the level that was asked for only
+    if (NULL != session->fileDeflateFill && (state->level != session->deflateLevel ||
+            FAILED(bftps_cache_deflate_write(session->fileDeflateFill, state->buffer,
+            state->bufferSize)))) {
+        bftps_cache_deflate_abort(session->fileDeflateFill);
+        session->fileDeflateFill = NULL;
+    }
+    return size - stream->avail_in;
+}
+
+void bftps_transfer_deflate_reset(bftps_session_context_t *session) {
+    if (NULL != session->deflate)
+        session->deflate->started = false;
+}
+
+ssize_t bftps_transfer_deflate_send(bftps_session_context_t *session,
+        const char *data, size_t size) {
+    int nErrorCode = bftps_transfer_deflate_start(session, true);
+    if (SUCCEEDED(nErrorCode))
+        nErrorCode = bftps_transfer_deflate_flush(session);
+    if (FAILED(nErrorCode)) {
+        errno = nErrorCode;
+        return -1;
+    }
+
+    size_t taken = bftps_transfer_deflate_compress(session, data, size, Z_NO_FLUSH);
+
+    // what doesn't go now is sent before compressing more
+    nErrorCode = bftps_transfer_deflate_flush(session);
+    if (FAILED(nErrorCode) && nErrorCode != EWOULDBLOCK) {
+        errno = nErrorCode;
+        return -1;
+    }
+    return taken;
+}
+
+ssize_t bftps_transfer_deflate_recv(bftps_session_context_t *session,
+        char *buffer, size_t size) {
+    int nErrorCode = bftps_transfer_deflate_start(session, false);
+    if (FAILED(nErrorCode)) {
+        errno = nErrorCode;
+        return -1;
+    }
+
+    bftps_transfer_deflate_t *state = session->deflate;
+    z_stream *stream = &state->inflateStream;
+    while (true) {
+        // uncompress what we already have before asking for more
+        stream->next_out = (Bytef *) buffer;
+        stream->avail_out = size;
+        int rc = inflate(stream, Z_NO_FLUSH);
+        if (Z_STREAM_END == rc)
+            state->ended = true;
+        else if (Z_OK != rc && Z_BUF_ERROR != rc) {
+            CONSOLE_LOG("inflate: %d %s", rc, stream->msg ? stream->msg : "");
+            errno = EPROTO;
+            return -1;
+        }
+
+        size_t produced = size - stream->avail_out;
+        if (0 < produced)
+            return produced;
+        if (state->ended)
+            return 0;
+
+        ssize_t received = recv(session->dataFd, state->buffer, sizeof (state->buffer),
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (0 > received)
+            return received;
+        else if (0 == received) {
+            // the connection closed before the end of the stream
+            errno = ECONNRESET;
+            return -1;
+        }
+        stream->next_in = state->buffer;
+        stream->avail_in = received;
+    }
+}
+
+int bftps_transfer_deflate_finish(bftps_session_context_t *session) {
+    int nErrorCode = bftps_transfer_deflate_start(session, true);
+    while (SUCCEEDED(nErrorCode)) {
+        if (FAILED(nErrorCode = bftps_transfer_deflate_flush(session)))
+            break;
+        if (session->deflate->ended) {
+            // the whole stream went out, so the cache can send it next time
+            bftps_cache_deflate_commit(session->fileDeflateFill);
+            session->fileDeflateFill = NULL;
+            break;
+        }
+        bftps_transfer_deflate_compress(session, NULL, 0, Z_FINISH);
+    }
+    return nErrorCode;
+}
+
+void bftps_transfer_deflate_release(bftps_session_context_t *session) {
+    bftps_transfer_deflate_t *state = session->deflate;
+    if (NULL == state)
+        return;
+
+    if (state->deflateReady)
+        deflateEnd(&state->deflateStream);
+    if (state->inflateReady)
+        inflateEnd(&state->inflateStream);
+    free(state);
+    session->deflate = NULL;
+}
+
+#else
+
+void bftps_transfer_deflate_reset(bftps_session_context_t *session) {
+}
+
+ssize_t bftps_transfer_deflate_send(bftps_session_context_t *session,
+        const char *data, size_t size) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t bftps_transfer_deflate_recv(bftps_session_context_t *session,
+        char *buffer, size_t size) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int bftps_transfer_deflate_finish(bftps_session_context_t *session) {
+    return ENOTSUP;
+}
+
+void bftps_transfer_deflate_release(bftps_session_context_t *session) {
+}
+
+#endif
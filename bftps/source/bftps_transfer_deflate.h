@@ -0,0 +1,53 @@
+#ifndef BFTPS_TRANSFER_DEFLATE_H
+#define BFTPS_TRANSFER_DEFLATE_H
+
+#include <sys/types.h>
+
+#include "bftps_transfer.h"
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_DEFLATE /* MODE Z is offered, it needs zlib */
+#ifdef _3DS
+#define BFTPS_TRANSFER_DEFLATE 0
+#else
+#define BFTPS_TRANSFER_DEFLATE 1
+#endif
+#endif
+#ifndef BFTPS_TRANSFER_DEFLATE_LEVEL /* until OPTS MODE Z LEVEL says otherwise */
+#define BFTPS_TRANSFER_DEFLATE_LEVEL 6
+#endif
+#ifndef BFTPS_TRANSFER_DEFLATE_BUFFER_SIZE /* compressed bytes held for the socket */
+#define BFTPS_TRANSFER_DEFLATE_BUFFER_SIZE (64 * 1024)
+#endif
+#ifndef BFTPS_TRANSFER_DEFLATE_GUARD_WINDOW /* ms over which the compression time is measured */
+#define BFTPS_TRANSFER_DEFLATE_GUARD_WINDOW 1000
+#endif
+#ifndef BFTPS_TRANSFER_DEFLATE_GUARD_BUSY /* % of the window spent compressing that lowers the level */
+#define BFTPS_TRANSFER_DEFLATE_GUARD_BUSY 50
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // the next send or recv starts a new stream
+    extern void bftps_transfer_deflate_reset(bftps_session_context_t *session);
+    // compress the data and send what fits, returns the data bytes taken
+    // or -1 with errno set, EWOULDBLOCK until earlier output is sent
+    extern ssize_t bftps_transfer_deflate_send(bftps_session_context_t *session,
+            const char *data, size_t size);
+    // receive and uncompress, returns 0 at the end of the stream
+    extern ssize_t bftps_transfer_deflate_recv(bftps_session_context_t *session,
+            char *buffer, size_t size);
+    // end the stream and send the rest of it, EWOULDBLOCK if it didn't all go
+    extern int bftps_transfer_deflate_finish(bftps_session_context_t *session);
+    // free the stream state once the session leaves MODE Z
+    extern void bftps_transfer_deflate_release(bftps_session_context_t *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_DEFLATE_H */
+
@@ -0,0 +1,252 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* accept4 */
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bftps_transfer_demux.h"
+#include "bftps_session_registry.h"
+#include "bftps_socket.h"
+#include "macros.h"
+
+#if 0 < BFTPS_TRANSFER_DEMUX_PORT
+
+typedef struct {
+    bftps_session_handle_t handle; /* waiting session, 0 if the entry is free */
+    struct in_addr peer; /* only connections from here are for the session */
+    time_t expires; /* the session gave up waiting by then */
+    int fd; /* connection accepted for the session, -1 until it arrives */
+    struct sockaddr_in address; /* where fd comes from */
+} bftps_transfer_demux_entry_t;
+
+typedef struct {
+    int fd;
+    bftps_transfer_demux_entry_t entries[BFTPS_TRANSFER_DEMUX_WAITING];
+} bftps_transfer_demux_t;
+
+// only the worker thread uses it, so no lock is needed
+static bftps_transfer_demux_t* gp_transferDemux = NULL;
+
+static void bftps_transfer_demux_free(bftps_transfer_demux_entry_t* entry) {
+    if (0 <= entry->fd)
+        bftps_socket_destroy(&entry->fd, false);
+    entry->handle = 0;
+}
+
+// the session may be gone or have forgotten about it
+static bool bftps_transfer_demux_stale(bftps_transfer_demux_entry_t* entry, time_t now) {
+    return entry->expires <= now || NULL == bftps_session_registry_lookup(entry->handle);
+}
+
+static bftps_transfer_demux_entry_t* bftps_transfer_demux_find(bftps_session_context_t *session) {
+    int i;
+    for (i = 0; i < BFTPS_TRANSFER_DEMUX_WAITING; ++i) {
+        if (gp_transferDemux->entries[i].handle == session->handle)
+            return &gp_transferDemux->entries[i];
+    }
+    return NULL;
+}
+
+int bftps_transfer_demux_init() {
+    if (NULL != gp_transferDemux)
+        return EALREADY;
+
+    gp_transferDemux = malloc(sizeof (bftps_transfer_demux_t));
+    if (NULL == gp_transferDemux)
+        return ENOMEM;
+
+    int i;
+    for (i = 0; i < BFTPS_TRANSFER_DEMUX_WAITING; ++i) {
+        gp_transferDemux->entries[i].handle = 0;
+        gp_transferDemux->entries[i].fd = -1;
+    }
+
+    int nErrorCode = 0;
+    int enable = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(BFTPS_TRANSFER_DEMUX_PORT);
+    // accepted sockets inherit the buffer sizes, so set them once here
+    gp_transferDemux->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (0 > gp_transferDemux->fd ||
+            0 != setsockopt(gp_transferDemux->fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (int)) ||
+            FAILED(bftps_session_set_socket_nonblocking(gp_transferDemux->fd)) ||
+            FAILED(bftps_socket_options_increase_buffers(gp_transferDemux->fd)) ||
+            0 != bind(gp_transferDemux->fd, (struct sockaddr*) &address, sizeof (address)) ||
+            0 != listen(gp_transferDemux->fd, BFTPS_TRANSFER_DEMUX_WAITING)) {
+        nErrorCode = errno;
+        CONSOLE_LOG("Failed to listen on the shared data port %u: %d %s",
+                BFTPS_TRANSFER_DEMUX_PORT, nErrorCode, strerror(nErrorCode));
+        bftps_transfer_demux_destroy();
+    }
+    return nErrorCode;
+}
+
+void bftps_transfer_demux_destroy() {
+    if (NULL == gp_transferDemux)
+        return;
+
+    int i;
+    for (i = 0; i < BFTPS_TRANSFER_DEMUX_WAITING; ++i)
+        bftps_transfer_demux_free(&gp_transferDemux->entries[i]);
+    if (0 <= gp_transferDemux->fd)
+        bftps_socket_destroy(&gp_transferDemux->fd, false);
+    free(gp_transferDemux);
+    gp_transferDemux = NULL;
+}
+
+int bftps_transfer_demux_fd() {
+    return gp_transferDemux ? gp_transferDemux->fd : -1;
+}
+
+void bftps_transfer_demux_poll() {
+    if (NULL == gp_transferDemux)
+        return;
+
+    time_t now = time(NULL);
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof (address);
+#ifdef __linux__
+        int fd = accept4(gp_transferDemux->fd, (struct sockaddr*) &address, &addrlen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int fd = accept(gp_transferDemux->fd, (struct sockaddr*) &address, &addrlen);
+#endif
+        if (0 > fd) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                CONSOLE_LOG("accept: %d %s", errno, strerror(errno));
+            return;
+        }
+
+        // only one session of each address waits here, so the address
+        // tells who the connection is for
+        bftps_transfer_demux_entry_t* entry = NULL;
+        int i;
+        for (i = 0; i < BFTPS_TRANSFER_DEMUX_WAITING; ++i) {
+            bftps_transfer_demux_entry_t* candidate = &gp_transferDemux->entries[i];
+            if (0 != candidate->handle && 0 > candidate->fd &&
+                    candidate->peer.s_addr == address.sin_addr.s_addr &&
+                    !bftps_transfer_demux_stale(candidate, now)) {
+                entry = candidate;
+                break;
+            }
+        }
+
+        if (NULL == entry) {
+            CONSOLE_LOG("Nobody is waiting for a connection from %s:%u",
+                    inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+            bftps_socket_destroy(&fd, false);
+            continue;
+        }
+#ifndef __linux__
+        if (FAILED(bftps_session_set_socket_nonblocking(fd))) {
+            bftps_socket_destroy(&fd, false);
+            continue;
+        }
+#endif
+        entry->fd = fd;
+        entry->address = address;
+    }
+}
+
+int bftps_transfer_demux_wait(bftps_session_context_t *session) {
+    if (NULL == gp_transferDemux)
+        return ENOTSUP;
+
+    struct sockaddr_in peer;
+    socklen_t addrlen = sizeof (peer);
+    if (0 != getpeername(session->commandFd, (struct sockaddr*) &peer, &addrlen)) {
+        int nErrorCode = errno;
+        CONSOLE_LOG("getpeername: %d %s", nErrorCode, strerror(nErrorCode));
+        return nErrorCode;
+    }
+
+    time_t now = time(NULL);
+    bftps_transfer_demux_entry_t* entry = NULL;
+    int i;
+    for (i = 0; i < BFTPS_TRANSFER_DEMUX_WAITING; ++i) {
+        bftps_transfer_demux_entry_t* candidate = &gp_transferDemux->entries[i];
+        // make room from whoever stopped waiting
+        if (0 != candidate->handle && bftps_transfer_demux_stale(candidate, now))
+            bftps_transfer_demux_free(candidate);
+
+        if (0 == candidate->handle) {
+            if (NULL == entry)
+                entry = candidate;
+        } else if (candidate->peer.s_addr == peer.sin_addr.s_addr)
+            return EBUSY; // we couldn't tell their connections apart
+    }
+    if (NULL == entry)
+        return ENOSPC;
+
+    entry->handle = session->handle;
+    entry->peer = peer.sin_addr;
+    entry->expires = now + BFTPS_TRANSFER_DEMUX_TIMEOUT;
+    entry->fd = -1;
+    return 0;
+}
+
+int bftps_transfer_demux_take(bftps_session_context_t *session,
+        struct sockaddr_in *address) {
+    if (NULL == gp_transferDemux)
+        return -1;
+
+    bftps_transfer_demux_entry_t* entry = bftps_transfer_demux_find(session);
+    if (NULL == entry || 0 > entry->fd)
+        return -1;
+
+    int fd = entry->fd;
+    *address = entry->address;
+    entry->fd = -1;
+    entry->handle = 0;
+    return fd;
+}
+
+void bftps_transfer_demux_release(bftps_session_context_t *session) {
+    if (NULL == gp_transferDemux)
+        return;
+
+    bftps_transfer_demux_entry_t* entry = bftps_transfer_demux_find(session);
+    if (NULL != entry)
+        bftps_transfer_demux_free(entry);
+}
+
+#else
+
+int bftps_transfer_demux_init() {
+    return 0;
+}
+
+void bftps_transfer_demux_destroy() {
+}
+
+int bftps_transfer_demux_fd() {
+    return -1;
+}
+
+void bftps_transfer_demux_poll() {
+}
+
+int bftps_transfer_demux_wait(bftps_session_context_t *session) {
+    return ENOTSUP;
+}
+
+int bftps_transfer_demux_take(bftps_session_context_t *session,
+        struct sockaddr_in *address) {
+    return -1;
+}
+
+void bftps_transfer_demux_release(bftps_session_context_t *session) {
+}
+
+#endif
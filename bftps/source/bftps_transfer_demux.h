@@ -0,0 +1,46 @@
+#ifndef BFTPS_TRANSFER_DEMUX_H
+#define BFTPS_TRANSFER_DEMUX_H
+
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_DEMUX_PORT /* data port shared by all PASV and EPSV, 0 gives each session its own */
+#ifdef _3DS
+#define BFTPS_TRANSFER_DEMUX_PORT 0
+#else
+#define BFTPS_TRANSFER_DEMUX_PORT 49999
+#endif
+#endif
+#ifndef BFTPS_TRANSFER_DEMUX_WAITING /* sessions waiting for a connection on the shared port */
+#define BFTPS_TRANSFER_DEMUX_WAITING 64
+#endif
+#ifndef BFTPS_TRANSFER_DEMUX_TIMEOUT /* seconds a session waits for its connection */
+#define BFTPS_TRANSFER_DEMUX_TIMEOUT 30
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern int bftps_transfer_demux_init();
+    extern void bftps_transfer_demux_destroy();
+    // listening descriptor the worker polls, -1 if there is no shared port
+    extern int bftps_transfer_demux_fd();
+    // accept the pending connections and keep each one for the session
+    // waiting on the address it comes from
+    extern void bftps_transfer_demux_poll();
+    // wait for the next data connection from the session peer on the shared
+    // port, EBUSY if another session from that address is already waiting
+    extern int bftps_transfer_demux_wait(bftps_session_context_t *session);
+    // the connection kept for the session, -1 if it didn't arrive yet
+    extern int bftps_transfer_demux_take(bftps_session_context_t *session,
+            struct sockaddr_in *address);
+    // stop waiting, closing the connection if it was never taken
+    extern void bftps_transfer_demux_release(bftps_session_context_t *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_DEMUX_H */
+
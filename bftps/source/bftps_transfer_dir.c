@@ -15,6 +15,8 @@
 #include "bftps_transfer_dir.h"
 #include "bftps_command.h"
 #include "bftps_common.h"
+#include "bftps_cache_meta.h"
+#include "bftps_transfer_block.h"
 
 // fill directory entry
 
@@ -66,7 +68,7 @@ int bftps_transfer_dir_fill_dirent_type(bftps_session_context_t *session,
                 return errno;
 
             size_t result = strftime(session->dataBuffer + session->dataBufferSize,
-                    sizeof (session->dataBuffer) - session->dataBufferSize,
+                    BFTPS_SESSION_TRANSFER_BUFFER_SIZE - session->dataBufferSize,
                     "Modify=%Y%m%d%H%M%S;", tm);
             if (result == 0)
                 return EOVERFLOW;
@@ -189,7 +191,7 @@ int bftps_transfer_dir_fill_dirent_type(bftps_session_context_t *session,
 
             session->dataBufferSize +=
                     strftime(session->dataBuffer + session->dataBufferSize,
-                    sizeof (session->dataBuffer) - session->dataBufferSize,
+                    BFTPS_SESSION_TRANSFER_BUFFER_SIZE - session->dataBufferSize,
                     fmt, tm);
         } else {
             session->dataBufferSize +=
@@ -197,7 +199,7 @@ int bftps_transfer_dir_fill_dirent_type(bftps_session_context_t *session,
         }
     }
 
-    if (session->dataBufferSize + len + 2 > sizeof (session->dataBuffer)) {
+    if (session->dataBufferSize + len + 2 > BFTPS_SESSION_TRANSFER_BUFFER_SIZE) {
         // buffer will overflow 
         return EOVERFLOW;
     }
@@ -222,7 +224,7 @@ int bftps_transfer_dir_fill_dirent_cdir(bftps_session_context_t *session,
         const char *path)
 {
   struct stat st;
-  int result = stat(path, &st);
+  int result = bftps_cache_meta_stat(path, &st);
   // double-check this was a directory
   if(result == 0 && !S_ISDIR(st.st_mode))
   {
@@ -262,22 +264,14 @@ bftps_transfer_loop_status_t bftps_transfer_dir_list(
         // check if this was for a file
         if (session->dir == NULL) {
             // we already sent the file's listing
-            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA |
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV);
-            bftps_command_send_response(session, nResponseCode, "OK\r\n");
-            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            return bftps_transfer_block_complete(session, nResponseCode);
         }
 
         // get the next directory entry
         struct dirent* directoryEntry = readdir(session->dir);
         if (directoryEntry == NULL) {
             // we have exhausted the directory listing
-            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA |
-                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV);
-            bftps_command_send_response(session, nResponseCode, "OK\r\n");
-            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            return bftps_transfer_block_complete(session, nResponseCode);
         }
 
         // TODO I think we are supposed to return entries for . and ..
@@ -409,9 +403,9 @@ bftps_transfer_loop_status_t bftps_transfer_dir_list(
     }
 
     // send any pending data
-    ssize_t result = send(session->dataFd, session->dataBuffer +
+    ssize_t result = bftps_transfer_block_send(session, session->dataBuffer +
             session->dataBufferPosition, session->dataBufferSize -
-            session->dataBufferPosition, MSG_NOSIGNAL);
+            session->dataBufferPosition);
     if (result <= 0) {
         // error sending data
         if (result < 0) {
@@ -465,10 +459,10 @@ int bftps_transfer_dir(bftps_session_context_t *session, const char *args,
             size_t len;
             // not a directory; check if it is a file
             struct stat st;
-            int result = stat(session->dataBuffer, &st);
+            int result = bftps_cache_meta_stat(session->dataBuffer, &st);
             if (result != 0) {
                 // error getting stat
-                nErrorCode = errno;
+                nErrorCode = result;
                 // work around broken clients that think LIST -a is valid
                 if (workaround && mode == BFTPS_TRANSFER_DIR_MODE_LIST) {
                     //TODO I don't think we need to dup the arg
@@ -574,9 +568,14 @@ int bftps_transfer_dir(bftps_session_context_t *session, const char *args,
         session->dataFd = session->commandFd;
         session->flags |= BFTPS_SESSION_FLAG_SEND;        
         return bftps_command_send_response(session, -213, "Status\r\n");
+    } else if (bftps_transfer_block_reuse(session)) {
+        // in MODE B the data connection of the last transfer is still open
+        bftps_transfer_block_reset(session);
+        return 0;
     } else if (session->flags & (BFTPS_SESSION_FLAG_PORT | BFTPS_SESSION_FLAG_PASV)) {
         bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_CONNECT,
                 BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        bftps_transfer_block_reset(session);
 
         if (session->flags & BFTPS_SESSION_FLAG_PORT) {
             // setup connection
@@ -0,0 +1,193 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* O_DIRECT */
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bftps_transfer_direct.h"
+#include "bftps_transfer_atomic.h"
+#include "macros.h"
+
+#ifdef __linux__
+
+static char* g_transferDirectPool[BFTPS_TRANSFER_DIRECT_POOL];
+static unsigned int g_transferDirectPoolCount = 0;
+
+static char* bftps_transfer_direct_buffer_acquire() {
+    if (0 < g_transferDirectPoolCount)
+        return g_transferDirectPool[--g_transferDirectPoolCount];
+
+    void* buffer = NULL;
+    if (0 != posix_memalign(&buffer, BFTPS_TRANSFER_DIRECT_ALIGNMENT,
+            BFTPS_TRANSFER_DIRECT_BUFFER_SIZE))
+        return NULL;
+    return buffer;
+}
+
+static void bftps_transfer_direct_buffer_release(char* buffer) {
+    if (NULL == buffer)
+        return;
+    if (g_transferDirectPoolCount < BFTPS_TRANSFER_DIRECT_POOL)
+        g_transferDirectPool[g_transferDirectPoolCount++] = buffer;
+    else
+        free(buffer);
+}
+
+// write all of it at offset
+
+static int bftps_transfer_direct_pwrite(int fd, const char* data, size_t size, off_t offset) {
+    while (0 < size) {
+        ssize_t rc = pwrite(fd, data, size, offset);
+        if (0 > rc) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        } else if (0 == rc) {
+            return EIO;
+        }
+        data += rc;
+        size -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+// go on through the page cache
+
+static int bftps_transfer_direct_buffered(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (-1 == flags || -1 == fcntl(fd, F_SETFL, flags & ~O_DIRECT))
+        return errno;
+    return 0;
+}
+
+int bftps_transfer_direct_open(bftps_session_context_t *session, bool append) {
+    // we always write at filepos, so O_APPEND is not needed
+    int flags = O_WRONLY | O_BINARY | O_DIRECT | O_CLOEXEC;
+    if (!append && session->filepos == 0)
+        flags |= O_CREAT | O_TRUNC;
+
+    int fd = session->fileAtomic ? bftps_transfer_atomic_open(session, flags) :
+            open(session->dataBuffer, flags, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (0 > fd)
+        return errno;
+
+    int nErrorCode = 0;
+    if (append) {
+        // get the file size
+        struct stat st;
+        if (0 != fstat(fd, &st))
+            nErrorCode = errno;
+        else
+            session->filepos = st.st_size;
+    }
+    // the upload must start on a block boundary
+    if (SUCCEEDED(nErrorCode) && 0 != session->filepos % BFTPS_TRANSFER_DIRECT_ALIGNMENT)
+        nErrorCode = EINVAL;
+    if (SUCCEEDED(nErrorCode) && NULL == (session->fileDirectBuffer =
+            bftps_transfer_direct_buffer_acquire()))
+        nErrorCode = ENOMEM;
+
+    if (FAILED(nErrorCode)) {
+        close(fd);
+        return nErrorCode;
+    }
+
+    session->fileDirectFd = fd;
+    session->fileDirectSize = 0;
+    return 0;
+}
+
+ssize_t bftps_transfer_direct_write(bftps_session_context_t *session,
+        const char *data, size_t size) {
+    // the buffer holds the bytes right before filepos
+    off_t offset = session->filepos - session->fileDirectSize;
+    if (size > BFTPS_TRANSFER_DIRECT_BUFFER_SIZE - session->fileDirectSize)
+        size = BFTPS_TRANSFER_DIRECT_BUFFER_SIZE - session->fileDirectSize;
+    memcpy(session->fileDirectBuffer + session->fileDirectSize, data, size);
+    session->fileDirectSize += size;
+
+    if (session->fileDirectSize == BFTPS_TRANSFER_DIRECT_BUFFER_SIZE) {
+        int nErrorCode = bftps_transfer_direct_pwrite(session->fileDirectFd,
+                session->fileDirectBuffer, session->fileDirectSize, offset);
+        // some filesystems take the O_DIRECT open but not the writes
+        if (nErrorCode == EINVAL && SUCCEEDED(nErrorCode =
+                bftps_transfer_direct_buffered(session->fileDirectFd))) {
+            CONSOLE_LOG("O_DIRECT write refused, writing through the page cache");
+            nErrorCode = bftps_transfer_direct_pwrite(session->fileDirectFd,
+                    session->fileDirectBuffer, session->fileDirectSize, offset);
+        }
+        if (FAILED(nErrorCode)) {
+            // the chunk was not taken, so the buffer must still end at filepos
+            session->fileDirectSize -= size;
+            errno = nErrorCode;
+            return -1;
+        }
+        session->fileDirectSize = 0;
+    }
+
+    return size;
+}
+
+int bftps_transfer_direct_flush(bftps_session_context_t *session) {
+    if (0 > session->fileDirectFd || 0 == session->fileDirectSize)
+        return 0;
+
+    // the end is not a whole block, so write it through the page cache
+    int nErrorCode = 0;
+    if (FAILED(nErrorCode = bftps_transfer_direct_buffered(session->fileDirectFd)))
+        return nErrorCode;
+
+    nErrorCode = bftps_transfer_direct_pwrite(session->fileDirectFd,
+            session->fileDirectBuffer, session->fileDirectSize,
+            session->filepos - session->fileDirectSize);
+    if (FAILED(nErrorCode))
+        return nErrorCode;
+    session->fileDirectSize = 0;
+    return 0;
+}
+
+void bftps_transfer_direct_close(bftps_session_context_t *session) {
+    if (0 <= session->fileDirectFd) {
+        if (0 != close(session->fileDirectFd)) {
+            CONSOLE_LOG("close: %d %s", errno, strerror(errno));
+        }
+    }
+    session->fileDirectFd = -1;
+    bftps_transfer_direct_buffer_release(session->fileDirectBuffer);
+    session->fileDirectBuffer = NULL;
+    session->fileDirectSize = 0;
+}
+
+void bftps_transfer_direct_destroy() {
+    while (0 < g_transferDirectPoolCount)
+        free(g_transferDirectPool[--g_transferDirectPoolCount]);
+}
+
+#else
+
+int bftps_transfer_direct_open(bftps_session_context_t *session, bool append) {
+    return EINVAL;
+}
+
+ssize_t bftps_transfer_direct_write(bftps_session_context_t *session,
+        const char *data, size_t size) {
+    errno = EBADF;
+    return -1;
+}
+
+int bftps_transfer_direct_flush(bftps_session_context_t *session) {
+    return 0;
+}
+
+void bftps_transfer_direct_close(bftps_session_context_t *session) {
+}
+
+void bftps_transfer_direct_destroy() {
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef BFTPS_TRANSFER_DIRECT_H
+#define BFTPS_TRANSFER_DIRECT_H
+
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_DIRECT /* STOR skips the page cache unless OPTS STOR says otherwise */
+#define BFTPS_TRANSFER_DIRECT false
+#endif
+#ifndef BFTPS_TRANSFER_DIRECT_ALIGNMENT /* offsets, sizes and buffers of direct writes */
+#define BFTPS_TRANSFER_DIRECT_ALIGNMENT 4096
+#endif
+#ifndef BFTPS_TRANSFER_DIRECT_BUFFER_SIZE /* bytes gathered before each write */
+#define BFTPS_TRANSFER_DIRECT_BUFFER_SIZE (1024 * 1024)
+#endif
+#ifndef BFTPS_TRANSFER_DIRECT_POOL /* idle buffers kept for the next uploads */
+#define BFTPS_TRANSFER_DIRECT_POOL 8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // open session->dataBuffer for writing without the page cache, EINVAL
+    // means the filesystem or the offset don't allow it
+    extern int bftps_transfer_direct_open(bftps_session_context_t *session, bool append);
+    // gather data and write it once there is a whole buffer, returns the
+    // bytes taken or -1 with errno set
+    extern ssize_t bftps_transfer_direct_write(bftps_session_context_t *session,
+            const char *data, size_t size);
+    // write the unaligned end of the upload
+    extern int bftps_transfer_direct_flush(bftps_session_context_t *session);
+    extern void bftps_transfer_direct_close(bftps_session_context_t *session);
+    // free the idle buffers
+    extern void bftps_transfer_direct_destroy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_DIRECT_H */
+
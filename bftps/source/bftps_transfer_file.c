@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* fallocate */
+#endif
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -5,6 +8,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#endif
 #ifdef _3DS
 #include <3ds.h>
 // TODO check if there is really no lseek64
@@ -15,12 +22,27 @@
 #include "bftps_session.h"
 #include "bftps_command.h"
 #include "bftps_common.h"
+#include "bftps_cache_meta.h"
+#include "bftps_cache_fd.h"
+#include "bftps_cache_deflate.h"
+#include "bftps_transfer_shared.h"
+#include "bftps_transfer_hint.h"
+#include "bftps_transfer_direct.h"
+#include "bftps_transfer_sync.h"
+#include "bftps_transfer_atomic.h"
+#include "bftps_transfer_block.h"
+#include "bftps_transfer_chunk.h"
+#include "bftps_transfer_pool.h"
 
 #include "macros.h"
 #include "file_io.h"
 
 //32 MB
 #define BIG_FILE_TRESHOLD 32 * 1024 * 1024 
+// max bytes handed to sendfile at once
+#define BFTPS_TRANSFER_FILE_SENDFILE_SIZE 1024 * 1024
+// bytes sent from each mapping of the mmap engine, must be a multiple of the page size
+#define BFTPS_TRANSFER_FILE_MMAP_WINDOW (8 * 1024 * 1024)
 
 extern void bftps_file_transfer_store(bftps_session_context_t* session);
 
@@ -28,6 +50,23 @@ extern void bftps_file_transfer_store(bftps_session_context_t* session);
 
 int bftps_transfer_file_open_read(bftps_session_context_t *session) {
     int nErrorCode = 0;
+    struct stat st;
+#ifdef __linux__
+    // other sessions may be downloading the same file, so share their
+    // descriptor, we always read at filepos so there is no need to seek
+    if (0 != stat(session->dataBuffer, &st)) {
+        nErrorCode = errno;
+        CONSOLE_LOG("stat '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
+        return nErrorCode;
+    }
+    if (FAILED(nErrorCode = bftps_cache_fd_open(session->dataBuffer, &st,
+            &session->fileReadFd))) {
+        CONSOLE_LOG("open '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
+        return nErrorCode;
+    }
+    // get the file size
+    if (0 != fstat(session->fileReadFd, &st)) {
+#else
     // open file in read mode  
 #ifdef _USE_FD_TRANSFER
     session->fileFd = open(session->dataBuffer, O_RDONLY | O_BINARY);
@@ -45,11 +84,11 @@ int bftps_transfer_file_open_read(bftps_session_context_t *session) {
     }
 #endif
     // get the file size
-    struct stat st;
 #ifdef _USE_FD_TRANSFER
     if (0 != fstat(session->fileFd, &st)) {
 #else
     if (0 != fstat(fileno(session->filep), &st)) {
+#endif
 #endif
         nErrorCode = errno;
         CONSOLE_LOG("fstat '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
@@ -57,6 +96,38 @@ int bftps_transfer_file_open_read(bftps_session_context_t *session) {
     }
     session->filesize = st.st_size;
 
+    // MODE Z downloads of popular files are compressed once and kept, it's
+    // okay if this fails, we will compress the file ourselves
+    if (session->transferMode == BFTPS_TRANSFER_MODE_DEFLATE && 0 == session->filepos) {
+        off_t size = 0;
+        int fd = -1;
+        if (FAILED(nErrorCode = bftps_cache_deflate_acquire(&st, session->deflateLevel,
+                &fd, &size, &session->fileDeflateFill))) {
+            CONSOLE_LOG("Failed to cache compressed '%s': %d %s", session->dataBuffer,
+                    nErrorCode, strerror(nErrorCode));
+        }
+#ifdef __linux__
+        if (0 <= fd) {
+            // what we send is the compressed variant, so is its progress
+            session->fileDeflateFd = fd;
+            session->filesize = size;
+            return 0;
+        }
+#endif
+    }
+
+    // small files are sent from memory, it's okay if this fails, we will
+    // read the file from disk instead
+    if (FAILED(nErrorCode = bftps_cache_file_acquire(session->dataBuffer, &st,
+            &session->fileCache))) {
+        CONSOLE_LOG("Failed to cache '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
+    }
+    if (NULL != session->fileCache)
+        return 0;
+#ifdef __linux__
+    session->fileEngine = session->retrEngine;
+    bftps_transfer_hint_open(session, session->fileReadFd, true);
+#else
     if (session->filepos != 0) {
 #ifdef _USE_FD_TRANSFER
         if (-1 == lseek64(session->fileFd, session->filepos, SEEK_SET)) {
@@ -68,15 +139,83 @@ int bftps_transfer_file_open_read(bftps_session_context_t *session) {
             return nErrorCode;
         }
     }
+#endif
     
     //session->fileBig = session->filesize > BIG_FILE_TRESHOLD;
+
+#ifdef __linux__
+    // downloads of the same big file share what is read from disk, a new
+    // window is only worth it if another session holds the file open too,
+    // and sendfile and mmap don't read into our memory at all, it's okay if
+    // this fails, we will read the file on our own
+    if (session->filesize >= BIG_FILE_TRESHOLD &&
+            session->retrEngine == BFTPS_TRANSFER_ENGINE_READ &&
+            FAILED(nErrorCode = bftps_transfer_shared_attach(session->dataBuffer, &st,
+            session->filepos, 1 < bftps_cache_fd_references(session->fileReadFd),
+            &session->fileShared))) {
+        CONSOLE_LOG("Failed to share '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
+    }
+#endif
     
     return 0;
 }
 
+#ifdef __linux__
+// reserve the space announced with ALLO, so the upload can't run out of it
+// halfway and its blocks aren't allocated one write at a time
+
+static int bftps_transfer_file_allocate(bftps_session_context_t *session, int fd) {
+    struct stat st;
+    if (0 != fstat(fd, &st))
+        return errno;
+
+    // whatever the upload doesn't use is given back when the file is closed
+    session->fileTrim = st.st_size;
+    int nErrorCode = 0;
+    if (0 != fallocate(fd, FALLOC_FL_KEEP_SIZE, session->filepos, session->fileAllocate)) {
+        nErrorCode = errno;
+        // this one grows the file, but works on every filesystem
+        if (nErrorCode == EOPNOTSUPP || nErrorCode == ENOSYS)
+            nErrorCode = posix_fallocate(fd, session->filepos, session->fileAllocate);
+    }
+    if (FAILED(nErrorCode)) {
+        CONSOLE_LOG("fallocate: %d %s", nErrorCode, strerror(nErrorCode));
+        // without space we would fail later anyway, anything else only
+        // means we write without reserving first
+        if (nErrorCode != ENOSPC && nErrorCode != EDQUOT)
+            nErrorCode = 0;
+    }
+
+    return nErrorCode;
+}
+#endif
+
 // open file for writing for ftp session
 int bftps_transfer_file_open_write(bftps_session_context_t *session, bool append) {
     int nErrorCode = 0;
+#ifdef __linux__
+    // only new uploads can be published once they are whole
+    session->fileAtomic = session->storAtomic && !append && session->filepos == 0;
+#endif
+    if (session->storDirect) {
+        // skip the page cache, so a big upload doesn't evict everything else
+        nErrorCode = bftps_transfer_direct_open(session, append);
+        if (SUCCEEDED(nErrorCode)) {
+            bftps_common_update_free_space(session);
+            bftps_cache_meta_invalidate(session->dataBuffer, false);
+#ifdef __linux__
+            if (0 < session->fileAllocate)
+                return bftps_transfer_file_allocate(session, session->fileDirectFd);
+#endif
+            return 0;
+        } else if (nErrorCode != EINVAL) {
+            CONSOLE_LOG("open '%s': %d %s", session->dataBuffer, nErrorCode, strerror(nErrorCode));
+            return nErrorCode;
+        }
+        // the filesystem or the offset don't allow it, so use the page cache
+        nErrorCode = 0;
+    }
+
 #ifdef _USE_FD_TRANSFER
     int openFlags = O_WRONLY | O_BINARY; // if we want to resume a file transfer this is enough
 
@@ -87,6 +226,11 @@ int bftps_transfer_file_open_write(bftps_session_context_t *session, bool append
 
 
     // open file in write mode    
+#ifdef __linux__
+    if (session->fileAtomic)
+        session->fileFd = bftps_transfer_atomic_open(session, openFlags);
+    else
+#endif
     session->fileFd = open(session->dataBuffer, openFlags,
             S_IRWXU | S_IRWXG | S_IRWXO);
     if (-1 == session->fileFd) {
@@ -109,6 +253,16 @@ int bftps_transfer_file_open_write(bftps_session_context_t *session, bool append
     else if (session->filepos != 0)
         mode = "r+b";
 
+#ifdef __linux__
+    if (session->fileAtomic) {
+        int fd = bftps_transfer_atomic_open(session, O_WRONLY | O_BINARY);
+        if (0 <= fd && NULL == (session->filep = fdopen(fd, mode))) {
+            nErrorCode = errno;
+            close(fd);
+            errno = nErrorCode;
+        }
+    } else
+#endif
     session->filep = fopen(session->dataBuffer, mode);
     if (NULL == session->filep) {
         nErrorCode = errno;
@@ -124,13 +278,16 @@ int bftps_transfer_file_open_write(bftps_session_context_t *session, bool append
         }
     }
 
-    // it's okay if this fails 
-    if (0 != setvbuf(session->filep, session->fileBuffer, _IOFBF, BFTPS_SESSION_FILE_BUFFER_SIZE)) {
+    // it's okay if this fails, stdio will get its own buffer
+    session->fileBuffer = bftps_transfer_pool_acquire(BFTPS_TRANSFER_POOL_FILE);
+    if (NULL != session->fileBuffer &&
+            0 != setvbuf(session->filep, session->fileBuffer, _IOFBF, BFTPS_SESSION_FILE_BUFFER_SIZE)) {
         nErrorCode = errno;
         CONSOLE_LOG("setvbuf: %d %s", nErrorCode, strerror(nErrorCode));
     }
 #endif
     bftps_common_update_free_space(session);
+    bftps_cache_meta_invalidate(session->dataBuffer, false);
 
     // check if this had REST but not APPE
     if (session->filepos != 0 && !append) {
@@ -146,6 +303,23 @@ int bftps_transfer_file_open_write(bftps_session_context_t *session, bool append
         }
     }
 
+#ifdef __linux__
+#ifdef _USE_FD_TRANSFER
+    if (0 < session->fileAllocate &&
+            FAILED(nErrorCode = bftps_transfer_file_allocate(session, session->fileFd)))
+#else
+    if (0 < session->fileAllocate &&
+            FAILED(nErrorCode = bftps_transfer_file_allocate(session, fileno(session->filep))))
+#endif
+        return nErrorCode;
+#endif
+
+#ifdef _USE_FD_TRANSFER
+    bftps_transfer_hint_open(session, session->fileFd, false);
+#else
+    bftps_transfer_hint_open(session, fileno(session->filep), false);
+#endif
+
     return 0;
 }
 
@@ -153,10 +327,14 @@ int bftps_transfer_file_open_write(bftps_session_context_t *session, bool append
 
 static ssize_t bftps_transfer_file_read(bftps_session_context_t *session) {
     // read file at current position
-#ifdef _USE_FD_TRANSFER
-    ssize_t rc = read(session->fileFd, session->dataBuffer, sizeof (session->dataBuffer));
+#ifdef __linux__
+    // the descriptor may be shared with other sessions, so leave its offset alone
+    ssize_t rc = pread(session->fileReadFd, session->dataBuffer,
+            session->dataChunk, session->filepos);
+#elif defined(_USE_FD_TRANSFER)
+    ssize_t rc = read(session->fileFd, session->dataBuffer, session->dataChunk);
 #else
-    ssize_t rc = rc = fread(session->dataBuffer, 1, sizeof (session->dataBuffer), session->filep);
+    ssize_t rc = rc = fread(session->dataBuffer, 1, session->dataChunk, session->filep);
 #endif
     if (rc < 0) {
         int nErrorCode = errno;
@@ -166,6 +344,9 @@ static ssize_t bftps_transfer_file_read(bftps_session_context_t *session) {
 
     // adjust file position
     session->filepos += rc;
+#ifdef __linux__
+    bftps_transfer_hint_read(session, session->fileReadFd);
+#endif
     
     bftps_file_transfer_store(session);
 
@@ -175,12 +356,19 @@ static ssize_t bftps_transfer_file_read(bftps_session_context_t *session) {
 // write to an open file for ftp session
 
 ssize_t bftps_transfer_file_write(bftps_session_context_t *session) {
+    ssize_t rc;
     // write to file at current position
+#ifdef __linux__
+    if (0 <= session->fileDirectFd)
+        rc = bftps_transfer_direct_write(session, session->dataBuffer + session->dataBufferPosition,
+            session->dataBufferSize - session->dataBufferPosition);
+    else
+#endif
 #ifdef _USE_FD_TRANSFER
-    ssize_t rc = write(session->fileFd, session->dataBuffer + session->dataBufferPosition,
+    rc = write(session->fileFd, session->dataBuffer + session->dataBufferPosition,
             session->dataBufferSize - session->dataBufferPosition);
 #else
-    ssize_t rc = fwrite(session->dataBuffer + session->dataBufferPosition,
+    rc = fwrite(session->dataBuffer + session->dataBufferPosition,
             1, session->dataBufferSize - session->dataBufferPosition,
             session->filep);
 #endif
@@ -194,6 +382,14 @@ ssize_t bftps_transfer_file_write(bftps_session_context_t *session) {
 
     // adjust file position
     session->filepos += rc;
+#ifdef __linux__
+    if (0 > session->fileDirectFd)
+#endif
+#ifdef _USE_FD_TRANSFER
+    bftps_transfer_hint_write(session, session->fileFd);
+#else
+    bftps_transfer_hint_write(session, fileno(session->filep));
+#endif
 
     bftps_common_update_free_space(session);
     bftps_file_transfer_store(session);
@@ -233,18 +429,53 @@ bftps_transfer_loop_status_t bftps_transfer_file_retrieve(bftps_session_context_
 
         return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
     } else {*/
+#ifdef __linux__
+        // the kernel can't put MODE B headers between the file data or
+        // compress it for MODE Z
+        if (session->fileEngine == BFTPS_TRANSFER_ENGINE_SENDFILE &&
+                session->dataBufferPosition == session->dataBufferSize &&
+                !bftps_transfer_block_encoded(session)) {
+            // let the kernel send straight from the page cache
+            off_t offset = session->filepos;
+            rc = sendfile(session->dataFd, session->fileReadFd, &offset,
+                    BFTPS_TRANSFER_FILE_SENDFILE_SIZE);
+            if (0 < rc) {
+                session->filepos = offset;
+                bftps_transfer_hint_read(session, session->fileReadFd);
+                bftps_file_transfer_store(session);
+                return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+            } else if (0 == rc) {
+                // we have sent the whole file
+                return bftps_transfer_block_complete(session, 226);
+            }
+
+            int nErrorCode = errno;
+            if (nErrorCode == EWOULDBLOCK)
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            if (nErrorCode != EINVAL && nErrorCode != ENOSYS) {
+                CONSOLE_LOG("sendfile: %d %s", nErrorCode, strerror(nErrorCode));
+                bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+                bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            }
+            // this file can't be sent this way, so read it ourselves
+            session->fileEngine = BFTPS_TRANSFER_ENGINE_READ;
+        }
+#endif
         if (session->dataBufferPosition == session->dataBufferSize) {
             // we have sent all the data so read some more
             rc = bftps_transfer_file_read(session);
-            if (0 >= rc) {
+            if (0 == rc) {
+                // we have sent the whole file
+                return bftps_transfer_block_complete(session, 226);
+            } else if (0 > rc) {
                 // can't read any more data
                 bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
                         BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
                         BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
-                if (0 > rc)
-                    bftps_command_send_response(session, 451, "Failed to read file\r\n");
-                else
-                    bftps_command_send_response(session, 226, "OK\r\n");
+                bftps_command_send_response(session, 451, "Failed to read file\r\n");
                 return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
             }
 
@@ -255,8 +486,10 @@ bftps_transfer_loop_status_t bftps_transfer_file_retrieve(bftps_session_context_
 
         int nErrorCode = 0;
         // send any pending data
-        rc = send(session->dataFd, session->dataBuffer + session->dataBufferPosition,
-                session->dataBufferSize - session->dataBufferPosition, MSG_NOSIGNAL);
+        rc = bftps_transfer_block_send(session, session->dataBuffer + session->dataBufferPosition,
+                session->dataBufferSize - session->dataBufferPosition);
+        bftps_transfer_chunk_update(session,
+                session->dataBufferSize - session->dataBufferPosition, rc);
         if (0 >= rc) {
             // error sending data
             if (0 > rc) {
@@ -282,6 +515,260 @@ bftps_transfer_loop_status_t bftps_transfer_file_retrieve(bftps_session_context_
     //}
 }
 
+// send data that is already in memory to the client
+
+static bftps_transfer_loop_status_t bftps_transfer_file_send(bftps_session_context_t *session,
+        const char *data, size_t size) {
+    ssize_t rc = bftps_transfer_block_send(session, data, size);
+    if (0 >= rc) {
+        // error sending data
+        if (0 > rc) {
+            int nErrorCode = errno;
+            if (nErrorCode == EWOULDBLOCK)
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            CONSOLE_LOG("send: %d %s", nErrorCode, strerror(nErrorCode));
+            if (nErrorCode == EFAULT) {
+                // a mapped file shrank, the kernel fails the send instead of
+                // raising SIGBUS when it touches the pages past the end
+                bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+                bftps_command_send_response(session, 451, "File changed during transfer\r\n");
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            }
+        } else
+        {
+            CONSOLE_LOG("send: %d %s", ECONNRESET, strerror(ECONNRESET));
+        }
+
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+    }
+
+    session->filepos += rc;
+    bftps_file_transfer_store(session);
+    return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+}
+
+// send a file to the client from the contents cache
+
+bftps_transfer_loop_status_t bftps_transfer_file_retrieve_cached(bftps_session_context_t *session) {
+    if (session->filepos >= session->filesize) {
+        // we have sent the whole file
+        return bftps_transfer_block_complete(session, 226);
+    }
+
+    // the whole file is already in memory, so hand everything left to the socket
+    return bftps_transfer_file_send(session, bftps_cache_file_data(session->fileCache) +
+            session->filepos, session->filesize - session->filepos);
+}
+
+// send a file to the client from the window shared with other downloads
+
+bftps_transfer_loop_status_t bftps_transfer_file_retrieve_shared(bftps_session_context_t *session) {
+    const char* data = NULL;
+    size_t size = 0;
+    int nErrorCode = bftps_transfer_shared_read(session->fileShared, session->filepos,
+            &data, &size);
+    if (nErrorCode == ESTALE) {
+        // the other downloads are too far ahead, so read the file on our own
+        bftps_transfer_shared_detach(session->fileShared);
+        session->fileShared = NULL;
+#ifndef __linux__
+        // we read at the descriptor position, which is still where we started
+#ifdef _USE_FD_TRANSFER
+        if (-1 == lseek64(session->fileFd, session->filepos, SEEK_SET)) {
+#else
+        if (0 != fseek(session->filep, session->filepos, SEEK_SET)) {
+#endif
+            nErrorCode = errno;
+            CONSOLE_LOG("Seeking '%s': %d %s", session->filename, nErrorCode, strerror(nErrorCode));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            bftps_command_send_response(session, 451, "Failed to read file\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        }
+#endif
+        session->transfer = bftps_transfer_file_retrieve;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+
+    if (FAILED(nErrorCode)) {
+        // can't read any more data
+        CONSOLE_LOG("read: %d %s", nErrorCode, strerror(nErrorCode));
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        bftps_command_send_response(session, 451, "Failed to read file\r\n");
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+    } else if (0 == size) {
+        // we have sent the whole file
+        return bftps_transfer_block_complete(session, 226);
+    }
+
+    return bftps_transfer_file_send(session, data, size);
+}
+
+#ifdef __linux__
+// map the window of the file we are at plus the next one, which the kernel
+// can read ahead while we send the first
+
+static int bftps_transfer_file_map(bftps_session_context_t *session) {
+    if (NULL != session->fileMap) {
+        if (0 != munmap(session->fileMap, session->fileMapSize)) {
+            CONSOLE_LOG("munmap: %d %s", errno, strerror(errno));
+        }
+        session->fileMap = NULL;
+        session->fileMapSize = 0;
+    }
+
+    // sending pages past the end of the file would fail, so make sure it
+    // didn't shrink since we started
+    struct stat st;
+    if (0 != fstat(session->fileReadFd, &st))
+        return errno;
+    if ((uint64_t) st.st_size < session->filesize)
+        return ESTALE;
+
+    // windows are aligned so REST can start anywhere
+    uint64_t offset = session->filepos - session->filepos % BFTPS_TRANSFER_FILE_MMAP_WINDOW;
+    size_t size = session->filesize - offset;
+    if (size > 2 * BFTPS_TRANSFER_FILE_MMAP_WINDOW)
+        size = 2 * BFTPS_TRANSFER_FILE_MMAP_WINDOW;
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, session->fileReadFd, offset);
+    if (MAP_FAILED == map)
+        return errno;
+
+    // it's okay if these fail, they are only hints
+    if (0 != madvise(map, size, MADV_SEQUENTIAL) ||
+            0 != madvise(map, size, MADV_WILLNEED)) {
+        CONSOLE_LOG("madvise: %d %s", errno, strerror(errno));
+    }
+
+    session->fileMap = map;
+    session->fileMapOffset = offset;
+    session->fileMapSize = size;
+    return 0;
+}
+
+// send a file to the client from a mapping of it
+
+bftps_transfer_loop_status_t bftps_transfer_file_retrieve_mmap(bftps_session_context_t *session) {
+    if (session->filepos >= session->filesize) {
+        // we have sent the whole file
+        return bftps_transfer_block_complete(session, 226);
+    }
+
+    // move on once we reach the second window, unless it is the last one
+    if (NULL == session->fileMap ||
+            (session->filepos >= session->fileMapOffset + BFTPS_TRANSFER_FILE_MMAP_WINDOW &&
+            session->fileMapOffset + session->fileMapSize < session->filesize)) {
+        int nErrorCode = bftps_transfer_file_map(session);
+        if (nErrorCode == ENODEV || nErrorCode == EINVAL) {
+            // this file can't be mapped, so send it the default way
+            CONSOLE_LOG("mmap: %d %s", nErrorCode, strerror(nErrorCode));
+            session->fileEngine = BFTPS_TRANSFER_ENGINE_SENDFILE;
+            session->transfer = bftps_transfer_file_retrieve;
+            return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+        } else if (FAILED(nErrorCode)) {
+            CONSOLE_LOG("mmap: %d %s", nErrorCode, strerror(nErrorCode));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            bftps_command_send_response(session, 451, "Failed to read file\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        }
+    }
+
+    bftps_transfer_hint_read(session, session->fileReadFd);
+    return bftps_transfer_file_send(session, session->fileMap +
+            (session->filepos - session->fileMapOffset),
+            session->fileMapOffset + session->fileMapSize - session->filepos);
+}
+
+// send a MODE Z download from the compressed cache, the stream is already
+// complete so it goes out as it is
+
+bftps_transfer_loop_status_t bftps_transfer_file_retrieve_deflated(bftps_session_context_t *session) {
+    off_t offset = session->filepos;
+    ssize_t rc = sendfile(session->dataFd, session->fileDeflateFd, &offset,
+            BFTPS_TRANSFER_FILE_SENDFILE_SIZE);
+    if (0 < rc) {
+        session->filepos = offset;
+        bftps_file_transfer_store(session);
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+
+    int nErrorCode = 0 == rc ? 0 : errno;
+    if (nErrorCode == EWOULDBLOCK)
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+    if (SUCCEEDED(nErrorCode)) {
+        // we have sent the whole stream
+        bftps_command_send_response(session, 226, "OK\r\n");
+    } else {
+        CONSOLE_LOG("sendfile: %d %s", nErrorCode, strerror(nErrorCode));
+        bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+    }
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+#endif
+
+// make the upload as durable as the session asked, EINPROGRESS means it
+// waits for the group sync
+static int bftps_transfer_file_sync(bftps_session_context_t *session) {
+    // the size must be final before syncing
+    bftps_session_trim_file(session);
+    if (BFTPS_TRANSFER_DURABILITY_NONE == session->storDurability)
+        return 0;
+
+    int nErrorCode = 0;
+    int fd = bftps_session_upload_fd(session);
+    if (0 > fd)
+        return EIO;
+#ifdef __linux__
+    if (BFTPS_TRANSFER_DURABILITY_GROUP == session->storDurability) {
+        if (SUCCEEDED(nErrorCode = bftps_transfer_sync_submit(fd, &session->fileSync)))
+            return EINPROGRESS;
+        // without the sync thread each upload syncs on its own
+        CONSOLE_LOG("Failed to queue the sync: %d %s", nErrorCode, strerror(nErrorCode));
+    }
+    if (0 != fdatasync(fd)) {
+        nErrorCode = errno;
+        CONSOLE_LOG("fdatasync: %d %s", nErrorCode, strerror(nErrorCode));
+    }
+#endif
+    return nErrorCode;
+}
+
+// reply to an upload once its group sync is done
+bftps_transfer_loop_status_t bftps_transfer_file_store_synced(bftps_session_context_t *session) {
+    int result = 0;
+    if (!bftps_transfer_sync_done(session->fileSync, &result))
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+
+    if (FAILED(result)) {
+        CONSOLE_LOG("fdatasync: %d %s", result, strerror(result));
+    } else if (SUCCEEDED(result = bftps_transfer_atomic_publish(session))) {
+        bftps_cache_meta_invalidate(session->filename, false);
+    }
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    if (FAILED(result)) {
+        bftps_command_send_response(session, 451, "Failed to write file\r\n");
+    } else
+        bftps_command_send_response(session, 226, "OK\r\n");
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
 // store a file from the client
 bftps_transfer_loop_status_t bftps_transfer_file_store(bftps_session_context_t *session) {
     
@@ -289,8 +776,8 @@ bftps_transfer_loop_status_t bftps_transfer_file_store(bftps_session_context_t *
     int nErrorCode = 0;
     if (session->dataBufferPosition == session->dataBufferSize) {
         // we have written all the received data, so try to get some more
-        rc = recv(session->dataFd, session->dataBuffer, sizeof (session->dataBuffer),
-                MSG_DONTWAIT | MSG_NOSIGNAL);
+        rc = bftps_transfer_block_recv(session, session->dataBuffer, session->dataChunk);
+        bftps_transfer_chunk_update(session, session->dataChunk, rc);
         if (0>= rc) {
             // can't read any more data
             if (0 > rc) {
@@ -298,13 +785,31 @@ bftps_transfer_loop_status_t bftps_transfer_file_store(bftps_session_context_t *
                 if (nErrorCode == EWOULDBLOCK)
                     return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
                 CONSOLE_LOG("recv: %d %s", nErrorCode, strerror(nErrorCode));
+            } else if (FAILED(nErrorCode = bftps_transfer_direct_flush(session))) {
+                // the end of a direct upload is only written now
+                CONSOLE_LOG("write: %d %s", nErrorCode, strerror(nErrorCode));
+            } else if (EINPROGRESS == (nErrorCode = bftps_transfer_file_sync(session))) {
+                // we reply once the batch it joined is on disk
+                bftps_session_mode_set(session, BFTPS_SESSION_MODE_SYNC,
+                        bftps_transfer_block_close_flags(session));
+                bftps_cache_meta_invalidate(session->filename, false);
+                session->transfer = bftps_transfer_file_store_synced;
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            } else if (SUCCEEDED(nErrorCode)) {
+                nErrorCode = bftps_transfer_atomic_publish(session);
             }
 
-            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+            // in MODE B the connection is still good for the next transfer
+            // once all the data came
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, rc == 0 ?
+                    bftps_transfer_block_close_flags(session) :
                     BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
                     BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            bftps_cache_meta_invalidate(session->filename, false);
 
-            if (rc == 0)
+            if (rc == 0 && FAILED(nErrorCode))
+                bftps_command_send_response(session, 451, "Failed to write file\r\n");
+            else if (rc == 0)
                 bftps_command_send_response(session, 226, "OK\r\n");
             else
                 bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
@@ -322,6 +827,7 @@ bftps_transfer_loop_status_t bftps_transfer_file_store(bftps_session_context_t *
         bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
                     BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
                     BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        bftps_cache_meta_invalidate(session->filename, false);
         bftps_command_send_response(session, 451, "Failed to write file\r\n");
         return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
     }
@@ -350,19 +856,27 @@ int bftps_transfer_file(bftps_session_context_t *session, const char *args,
     else
         nErrorCode = bftps_transfer_file_open_write(session, mode == BFTPS_TRANSFER_FILE_APPE);
 
+    // ALLO only applies to the transfer right after it
+    session->fileAllocate = 0;
+
     if (FAILED(nErrorCode)) {
         // error opening the file
         bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
                 BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
                 BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        if (nErrorCode == ENOSPC || nErrorCode == EDQUOT)
+            return bftps_command_send_response(session, 552, "Insufficient storage space\r\n");
         return bftps_command_send_response(session, 450, "failed to open file\r\n");
     }
 
-    if (session->flags & (BFTPS_SESSION_FLAG_PORT | BFTPS_SESSION_FLAG_PASV)) {
-        bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_CONNECT, 
+    // in MODE B the data connection of the last transfer may still be open
+    bool reuse = bftps_transfer_block_reuse(session);
+    if (reuse || (session->flags & (BFTPS_SESSION_FLAG_PORT | BFTPS_SESSION_FLAG_PASV))) {
+        if (!reuse)
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_CONNECT, 
                 BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
 
-        if (session->flags & BFTPS_SESSION_FLAG_PORT) {
+        if (!reuse && (session->flags & BFTPS_SESSION_FLAG_PORT)) {
             // setup connection
             if (FAILED(bftps_session_connect(session))) {
                 // error connecting
@@ -377,7 +891,24 @@ int bftps_transfer_file(bftps_session_context_t *session, const char *args,
         session->flags &= ~(BFTPS_SESSION_FLAG_RECV | BFTPS_SESSION_FLAG_SEND);
         if (mode == BFTPS_TRANSFER_FILE_RETR) {
             session->flags |= BFTPS_SESSION_FLAG_SEND;
-            session->transfer = bftps_transfer_file_retrieve;
+#ifdef __linux__
+            if (0 <= session->fileDeflateFd)
+                session->transfer = bftps_transfer_file_retrieve_deflated;
+            else
+#endif
+            if (NULL != session->fileCache)
+                session->transfer = bftps_transfer_file_retrieve_cached;
+            else if (NULL != session->fileShared)
+                session->transfer = bftps_transfer_file_retrieve_shared;
+#ifdef __linux__
+            // deflate() would read the mapping itself, and a file truncated
+            // meanwhile raises SIGBUS there instead of failing the send
+            else if (session->fileEngine == BFTPS_TRANSFER_ENGINE_MMAP &&
+                    session->transferMode != BFTPS_TRANSFER_MODE_DEFLATE)
+                session->transfer = bftps_transfer_file_retrieve_mmap;
+#endif
+            else
+                session->transfer = bftps_transfer_file_retrieve;
         } else {
             session->flags |= BFTPS_SESSION_FLAG_RECV;
             session->transfer = bftps_transfer_file_store;
@@ -385,8 +916,10 @@ int bftps_transfer_file(bftps_session_context_t *session, const char *args,
 
         session->dataBufferPosition = 0;
         session->dataBufferSize = 0;
+        bftps_transfer_chunk_reset(session);
+        bftps_transfer_block_reset(session);
         session->filenameRefresh = true; // new file name was set
-        strncpy(session->filename, session->dataBuffer, sizeof(session->filename));
+        strncpy(session->filename, session->dataBuffer, MAX_PATH);
 
         bftps_file_transfer_store(session);
 
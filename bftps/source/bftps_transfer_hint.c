@@ -0,0 +1,122 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* readahead and sync_file_range */
+#endif
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "bftps_transfer_hint.h"
+#include "macros.h"
+
+// indexed by size class
+static const bftps_transfer_hint_policy_t g_transferHintPolicies[] = {
+    // small files are read at once or come from the contents cache
+    { false, 0, 0, false,},
+    // medium files are streamed
+    { true, BFTPS_TRANSFER_HINT_READAHEAD, BFTPS_TRANSFER_HINT_WRITE_BEHIND, false,},
+    // large files are streamed without evicting everything else
+    { true, BFTPS_TRANSFER_HINT_READAHEAD, BFTPS_TRANSFER_HINT_WRITE_BEHIND, true,},
+};
+
+static const bftps_transfer_hint_policy_t* bftps_transfer_hint_policy(uint64_t size) {
+    static uint64_t largeSize = BFTPS_TRANSFER_HINT_LARGE_SIZE;
+    if (0 == largeSize) {
+        // files that don't fit in memory would only push everything else out
+        largeSize = UINT64_MAX;
+#ifdef __linux__
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        if (0 < pages && 0 < pageSize)
+            largeSize = (uint64_t) pages * pageSize;
+#endif
+    }
+
+    if (size < BFTPS_TRANSFER_HINT_MEDIUM_SIZE)
+        return &g_transferHintPolicies[0];
+    else if (size < largeSize)
+        return &g_transferHintPolicies[1];
+    return &g_transferHintPolicies[2];
+}
+
+void bftps_transfer_hint_open(bftps_session_context_t *session, int fd, bool read) {
+    // REST or APPE may start us anywhere
+    session->fileHintPosition = session->filepos;
+    session->fileHintDropped = session->filepos;
+    if (!read)
+        return;
+
+#ifdef __linux__
+    // it's okay if this fails, it's only a hint
+    int nErrorCode = 0;
+    if (bftps_transfer_hint_policy(session->filesize)->sequential &&
+            FAILED(nErrorCode = posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL))) {
+        CONSOLE_LOG("posix_fadvise: %d %s", nErrorCode, strerror(nErrorCode));
+    }
+#endif
+    bftps_transfer_hint_read(session, fd);
+}
+
+void bftps_transfer_hint_read(bftps_session_context_t *session, int fd) {
+#ifdef __linux__
+    const bftps_transfer_hint_policy_t* policy = bftps_transfer_hint_policy(session->filesize);
+
+    // keep the next bytes coming from disk, topping them up once half is sent
+    if (0 < policy->readahead) {
+        if (session->fileHintPosition < session->filepos)
+            session->fileHintPosition = session->filepos;
+        if (session->fileHintPosition < session->filesize &&
+                session->fileHintPosition - session->filepos < policy->readahead / 2) {
+            size_t size = session->filepos + policy->readahead - session->fileHintPosition;
+            if (0 != readahead(fd, session->fileHintPosition, size)) {
+                CONSOLE_LOG("readahead: %d %s", errno, strerror(errno));
+            }
+            session->fileHintPosition += size;
+        }
+    }
+
+    // we won't send this part again
+    if (policy->dropBehind &&
+            session->filepos - session->fileHintDropped >= policy->readahead) {
+        int nErrorCode = 0;
+        if (FAILED(nErrorCode = posix_fadvise(fd, session->fileHintDropped,
+                session->filepos - session->fileHintDropped, POSIX_FADV_DONTNEED))) {
+            CONSOLE_LOG("posix_fadvise: %d %s", nErrorCode, strerror(nErrorCode));
+        }
+        session->fileHintDropped = session->filepos;
+    }
+#endif
+}
+
+void bftps_transfer_hint_write(bftps_session_context_t *session, int fd) {
+#ifdef __linux__
+    // we don't know how big uploads will be, so go by what we got so far
+    const bftps_transfer_hint_policy_t* policy = bftps_transfer_hint_policy(session->filepos);
+    if (0 == policy->writeBehind ||
+            session->filepos - session->fileHintPosition < policy->writeBehind)
+        return;
+
+    // start writing the new data instead of letting dirty pages pile up
+    if (0 != sync_file_range(fd, session->fileHintPosition,
+            session->filepos - session->fileHintPosition, SYNC_FILE_RANGE_WRITE)) {
+        CONSOLE_LOG("sync_file_range: %d %s", errno, strerror(errno));
+    }
+
+    // the writeback started last time should be done by now, so wait for it
+    // and drop those pages
+    if (policy->dropBehind && session->fileHintDropped < session->fileHintPosition) {
+        off_t size = session->fileHintPosition - session->fileHintDropped;
+        int nErrorCode = 0;
+        if (0 != sync_file_range(fd, session->fileHintDropped, size,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) {
+            CONSOLE_LOG("sync_file_range: %d %s", errno, strerror(errno));
+        } else if (FAILED(nErrorCode = posix_fadvise(fd, session->fileHintDropped, size,
+                POSIX_FADV_DONTNEED))) {
+            CONSOLE_LOG("posix_fadvise: %d %s", nErrorCode, strerror(nErrorCode));
+        }
+        session->fileHintDropped = session->fileHintPosition;
+    }
+    session->fileHintPosition = session->filepos;
+#endif
+}
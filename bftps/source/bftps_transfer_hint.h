@@ -0,0 +1,43 @@
+#ifndef BFTPS_TRANSFER_HINT_H
+#define BFTPS_TRANSFER_HINT_H
+
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_HINT_MEDIUM_SIZE /* smaller files get no hints */
+#define BFTPS_TRANSFER_HINT_MEDIUM_SIZE (1024 * 1024)
+#endif
+#ifndef BFTPS_TRANSFER_HINT_LARGE_SIZE /* bigger files are dropped from the page cache, 0 for the RAM size */
+#define BFTPS_TRANSFER_HINT_LARGE_SIZE 0
+#endif
+#ifndef BFTPS_TRANSFER_HINT_READAHEAD /* bytes read ahead of the RETR cursor */
+#define BFTPS_TRANSFER_HINT_READAHEAD (8 * 1024 * 1024)
+#endif
+#ifndef BFTPS_TRANSFER_HINT_WRITE_BEHIND /* bytes written by STOR before starting their writeback */
+#define BFTPS_TRANSFER_HINT_WRITE_BEHIND (8 * 1024 * 1024)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // the policy for each file size class
+    typedef struct {
+        bool sequential; /* file is read from start to end */
+        size_t readahead; /* bytes read ahead of the cursor, 0 for none */
+        size_t writeBehind; /* bytes written before starting their writeback, 0 for none */
+        bool dropBehind; /* drop what was already sent or written from the page cache */
+    } bftps_transfer_hint_policy_t;
+
+    // give the kernel hints for the file just opened for RETR or STOR
+    extern void bftps_transfer_hint_open(bftps_session_context_t *session, int fd, bool read);
+    // keep the hints up with the transfer, called after filepos moves
+    extern void bftps_transfer_hint_read(bftps_session_context_t *session, int fd);
+    extern void bftps_transfer_hint_write(bftps_session_context_t *session, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_HINT_H */
+
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "bftps_transfer_pasv.h"
+#include "bftps_session.h"
+#include "bftps_socket.h"
+#include "macros.h"
+
+#if 0 < BFTPS_TRANSFER_PASV_PORTS
+
+typedef struct {
+    int fd; /* -1 if the port couldn't be bound */
+    bool used; /* given to a session */
+} bftps_transfer_pasv_entry_t;
+
+typedef struct {
+    bftps_transfer_pasv_entry_t entries[BFTPS_TRANSFER_PASV_PORTS];
+    // ports ready to be given, oldest first so a late connection to a
+    // released port is less likely to reach the next session
+    int ready[BFTPS_TRANSFER_PASV_PORTS];
+    size_t readyFirst;
+    size_t readyCount;
+} bftps_transfer_pasv_t;
+
+// only the worker thread uses it, so no lock is needed
+static bftps_transfer_pasv_t* gp_transferPasv = NULL;
+
+static int bftps_transfer_pasv_listen(in_port_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (0 > fd) {
+        CONSOLE_LOG("Failed to create socket for PASV: %d %s", errno, strerror(errno));
+        return -1;
+    }
+
+    int enable = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    // accepted sockets inherit the buffer sizes, so set them once here
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (int)) ||
+            FAILED(bftps_session_set_socket_nonblocking(fd)) ||
+            FAILED(bftps_socket_options_increase_buffers(fd)) ||
+            0 != bind(fd, (struct sockaddr*) &address, sizeof (address)) ||
+            0 != listen(fd, 1)) {
+        CONSOLE_LOG("Failed to listen on PASV port %u: %d %s", port, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int bftps_transfer_pasv_init() {
+    if (NULL != gp_transferPasv)
+        return EALREADY;
+
+    gp_transferPasv = malloc(sizeof (bftps_transfer_pasv_t));
+    if (NULL == gp_transferPasv)
+        return ENOMEM;
+
+    gp_transferPasv->readyFirst = 0;
+    gp_transferPasv->readyCount = 0;
+    int i;
+    for (i = 0; i < BFTPS_TRANSFER_PASV_PORTS; ++i) {
+        gp_transferPasv->entries[i].fd =
+                bftps_transfer_pasv_listen(BFTPS_TRANSFER_PASV_PORT_FIRST + i);
+        gp_transferPasv->entries[i].used = false;
+        if (0 <= gp_transferPasv->entries[i].fd)
+            gp_transferPasv->ready[gp_transferPasv->readyCount++] = i;
+    }
+
+    if (0 == gp_transferPasv->readyCount) {
+        bftps_transfer_pasv_destroy();
+        return EADDRINUSE;
+    }
+    return 0;
+}
+
+void bftps_transfer_pasv_destroy() {
+    if (NULL == gp_transferPasv)
+        return;
+
+    int i;
+    for (i = 0; i < BFTPS_TRANSFER_PASV_PORTS; ++i) {
+        if (0 <= gp_transferPasv->entries[i].fd)
+            bftps_socket_destroy(&gp_transferPasv->entries[i].fd, false);
+    }
+    free(gp_transferPasv);
+    gp_transferPasv = NULL;
+}
+
+int bftps_transfer_pasv_acquire(int* p_fd, in_port_t* p_port) {
+    if (NULL == gp_transferPasv || 0 == gp_transferPasv->readyCount)
+        return ENOENT;
+
+    int i = gp_transferPasv->ready[gp_transferPasv->readyFirst];
+    gp_transferPasv->readyFirst = (gp_transferPasv->readyFirst + 1) % BFTPS_TRANSFER_PASV_PORTS;
+    --gp_transferPasv->readyCount;
+    gp_transferPasv->entries[i].used = true;
+
+    *p_fd = gp_transferPasv->entries[i].fd;
+    *p_port = BFTPS_TRANSFER_PASV_PORT_FIRST + i;
+    return 0;
+}
+
+bool bftps_transfer_pasv_release(int fd, in_port_t port) {
+    if (NULL == gp_transferPasv || port < BFTPS_TRANSFER_PASV_PORT_FIRST ||
+            port >= BFTPS_TRANSFER_PASV_PORT_FIRST + BFTPS_TRANSFER_PASV_PORTS)
+        return false;
+
+    int i = port - BFTPS_TRANSFER_PASV_PORT_FIRST;
+    if (!gp_transferPasv->entries[i].used || gp_transferPasv->entries[i].fd != fd)
+        return false;
+
+    // whoever connected without being accepted was meant for the old session
+    int pendingFd;
+    while (0 <= (pendingFd = accept(fd, NULL, NULL)))
+        bftps_socket_destroy(&pendingFd, false);
+
+    gp_transferPasv->entries[i].used = false;
+    gp_transferPasv->ready[(gp_transferPasv->readyFirst + gp_transferPasv->readyCount) %
+            BFTPS_TRANSFER_PASV_PORTS] = i;
+    ++gp_transferPasv->readyCount;
+    return true;
+}
+
+#else
+
+int bftps_transfer_pasv_init() {
+    return 0;
+}
+
+void bftps_transfer_pasv_destroy() {
+}
+
+int bftps_transfer_pasv_acquire(int* p_fd, in_port_t* p_port) {
+    return ENOENT;
+}
+
+bool bftps_transfer_pasv_release(int fd, in_port_t port) {
+    return false;
+}
+
+#endif
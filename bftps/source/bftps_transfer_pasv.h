@@ -0,0 +1,38 @@
+#ifndef BFTPS_TRANSFER_PASV_H
+#define BFTPS_TRANSFER_PASV_H
+
+#include <netinet/in.h>
+
+#include "bool.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_PASV_PORTS /* listening sockets kept ready for PASV, 0 creates one per PASV */
+#ifdef _3DS
+#define BFTPS_TRANSFER_PASV_PORTS 0
+#else
+#define BFTPS_TRANSFER_PASV_PORTS 64
+#endif
+#endif
+#ifndef BFTPS_TRANSFER_PASV_PORT_FIRST /* the pool uses the ports from here on */
+#define BFTPS_TRANSFER_PASV_PORT_FIRST 50000
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // bind and listen on the port range, ports already in use are skipped
+    extern int bftps_transfer_pasv_init();
+    extern void bftps_transfer_pasv_destroy();
+    // a listening socket and its port, ENOENT if all of them are in use
+    extern int bftps_transfer_pasv_acquire(int* p_fd, in_port_t* p_port);
+    // take the socket back if it came from the pool, dropping connections
+    // nobody accepted, false if the caller must close it
+    extern bool bftps_transfer_pasv_release(int fd, in_port_t port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_PASV_H */
+
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bftps_transfer_pool.h"
+#include "bftps_session.h"
+
+// idle buffers are linked through their first bytes
+typedef struct _bftps_transfer_pool_buffer_t {
+    struct _bftps_transfer_pool_buffer_t* next;
+} bftps_transfer_pool_buffer_t;
+
+typedef struct {
+    size_t size; /* bytes of each buffer */
+    bftps_transfer_pool_buffer_t* idle;
+    size_t idleCount;
+    size_t usedCount;
+} bftps_transfer_pool_context_t;
+
+// only the worker thread uses them, so no lock is needed
+static bftps_transfer_pool_context_t g_transferPools[BFTPS_TRANSFER_POOL_COUNT] = {
+    { sizeof (bftps_session_buffers_t), NULL, 0, 0,},
+    { BFTPS_SESSION_FILE_BUFFER_SIZE, NULL, 0, 0,},
+};
+
+void* bftps_transfer_pool_acquire(bftps_transfer_pool_t pool) {
+    bftps_transfer_pool_context_t* context = &g_transferPools[pool];
+
+    void* buffer = context->idle;
+    if (NULL != buffer) {
+        context->idle = context->idle->next;
+        --context->idleCount;
+    } else if (NULL == (buffer = malloc(context->size)))
+        return NULL;
+
+    ++context->usedCount;
+    return buffer;
+}
+
+void bftps_transfer_pool_release(bftps_transfer_pool_t pool, void* buffer) {
+    if (NULL == buffer)
+        return;
+
+    bftps_transfer_pool_context_t* context = &g_transferPools[pool];
+    --context->usedCount;
+    if (context->idleCount < BFTPS_TRANSFER_POOL_IDLE) {
+        bftps_transfer_pool_buffer_t* idle = buffer;
+        idle->next = context->idle;
+        context->idle = idle;
+        ++context->idleCount;
+    } else
+        free(buffer);
+}
+
+void bftps_transfer_pool_stats(bftps_transfer_pool_stats_t* stats) {
+    memset(stats, 0, sizeof (bftps_transfer_pool_stats_t));
+    int pool;
+    for (pool = 0; pool < BFTPS_TRANSFER_POOL_COUNT; ++pool) {
+        stats->used += g_transferPools[pool].usedCount;
+        stats->idle += g_transferPools[pool].idleCount;
+        stats->bytes += (g_transferPools[pool].usedCount + g_transferPools[pool].idleCount) *
+                g_transferPools[pool].size;
+    }
+}
+
+void bftps_transfer_pool_destroy() {
+    int pool;
+    for (pool = 0; pool < BFTPS_TRANSFER_POOL_COUNT; ++pool) {
+        while (NULL != g_transferPools[pool].idle) {
+            bftps_transfer_pool_buffer_t* idle = g_transferPools[pool].idle;
+            g_transferPools[pool].idle = idle->next;
+            free(idle);
+        }
+        g_transferPools[pool].idleCount = 0;
+    }
+}
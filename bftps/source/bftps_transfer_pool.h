@@ -0,0 +1,39 @@
+#ifndef BFTPS_TRANSFER_POOL_H
+#define BFTPS_TRANSFER_POOL_H
+
+#include <stddef.h>
+
+// can be overridden at build time
+#ifndef BFTPS_TRANSFER_POOL_IDLE /* idle buffers kept in each pool */
+#define BFTPS_TRANSFER_POOL_IDLE 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        BFTPS_TRANSFER_POOL_SESSION, /* bftps_session_buffers_t of busy sessions */
+        BFTPS_TRANSFER_POOL_FILE, /* stdio buffers of open files */
+        BFTPS_TRANSFER_POOL_COUNT
+    } bftps_transfer_pool_t;
+
+    typedef struct {
+        size_t used; /* buffers given to sessions */
+        size_t idle; /* buffers kept for the next ones */
+        size_t bytes; /* memory of both */
+    } bftps_transfer_pool_stats_t;
+
+    // NULL if there is no memory for a new one
+    extern void* bftps_transfer_pool_acquire(bftps_transfer_pool_t pool);
+    extern void bftps_transfer_pool_release(bftps_transfer_pool_t pool, void* buffer);
+    extern void bftps_transfer_pool_stats(bftps_transfer_pool_stats_t* stats);
+    // free the idle buffers
+    extern void bftps_transfer_pool_destroy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_POOL_H */
+
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "bftps_transfer_shared.h"
+#include "macros.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+// max windows open at the same time
+#ifdef _3DS
+#define BFTPS_TRANSFER_SHARED_MAX 2
+#else
+#define BFTPS_TRANSFER_SHARED_MAX 16
+#endif
+
+struct _bftps_transfer_shared_t;
+
+struct _bftps_transfer_shared_reader_t {
+    struct _bftps_transfer_shared_reader_t* next; /* next reader of the same window */
+    struct _bftps_transfer_shared_t* shared; /* NULL once it fell behind the window */
+    off_t position; /* last position asked for */
+};
+
+typedef struct _bftps_transfer_shared_t {
+    struct _bftps_transfer_shared_t* next;
+    struct stat st; /* status of the file when the window was created */
+    int fd; /* our own descriptor, so we can seek it */
+    off_t start; /* file offset of the oldest block */
+    unsigned int first; /* index of the oldest block */
+    unsigned int loaded; /* blocks read so far */
+    size_t lastSize; /* bytes in the newest block, less than a block at the end of the file */
+    bftps_transfer_shared_reader_t* readers;
+    char blocks[BFTPS_TRANSFER_SHARED_BLOCKS][BFTPS_TRANSFER_SHARED_BLOCK_SIZE];
+} bftps_transfer_shared_t;
+
+static bftps_transfer_shared_t* gp_transferShared = NULL;
+static unsigned int g_transferSharedCount = 0;
+
+static off_t bftps_transfer_shared_end(const bftps_transfer_shared_t* shared) {
+    if (0 == shared->loaded)
+        return shared->start;
+    return shared->start + (off_t) (shared->loaded - 1) * BFTPS_TRANSFER_SHARED_BLOCK_SIZE +
+            shared->lastSize;
+}
+
+static void bftps_transfer_shared_unlink(bftps_transfer_shared_reader_t* reader) {
+    bftps_transfer_shared_reader_t** p = &reader->shared->readers;
+    while (*p != reader)
+        p = &(*p)->next;
+    *p = reader->next;
+    reader->next = NULL;
+    reader->shared = NULL;
+}
+
+// drop the oldest block, whoever is still reading it can't keep up
+
+static void bftps_transfer_shared_slide(bftps_transfer_shared_t* shared) {
+    shared->start += BFTPS_TRANSFER_SHARED_BLOCK_SIZE;
+    shared->first = (shared->first + 1) % BFTPS_TRANSFER_SHARED_BLOCKS;
+    --shared->loaded;
+
+    bftps_transfer_shared_reader_t* reader = shared->readers;
+    while (reader) {
+        bftps_transfer_shared_reader_t* next = reader->next;
+        if (reader->position < shared->start)
+            bftps_transfer_shared_unlink(reader);
+        reader = next;
+    }
+}
+
+// read the block right after the window
+
+static int bftps_transfer_shared_load(bftps_transfer_shared_t* shared) {
+    if (shared->loaded == BFTPS_TRANSFER_SHARED_BLOCKS)
+        bftps_transfer_shared_slide(shared);
+
+    off_t offset = bftps_transfer_shared_end(shared);
+    char* block = shared->blocks[(shared->first + shared->loaded) % BFTPS_TRANSFER_SHARED_BLOCKS];
+    if (-1 == lseek(shared->fd, offset, SEEK_SET))
+        return errno;
+
+    size_t size = 0;
+    while (size < BFTPS_TRANSFER_SHARED_BLOCK_SIZE) {
+        ssize_t rc = read(shared->fd, block + size, BFTPS_TRANSFER_SHARED_BLOCK_SIZE - size);
+        if (0 > rc) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        } else if (0 == rc) {
+            break;
+        }
+        size += rc;
+    }
+
+    ++shared->loaded;
+    shared->lastSize = size;
+    return 0;
+}
+
+static void bftps_transfer_shared_destroy(bftps_transfer_shared_t* shared) {
+    bftps_transfer_shared_t** p = &gp_transferShared;
+    while (*p != shared)
+        p = &(*p)->next;
+    *p = shared->next;
+    --g_transferSharedCount;
+
+    if (0 != close(shared->fd)) {
+        CONSOLE_LOG("close: %d %s", errno, strerror(errno));
+    }
+    free(shared);
+}
+
+int bftps_transfer_shared_attach(const char *path, const struct stat *st,
+        off_t position, bool create, bftps_transfer_shared_reader_t **reader) {
+    if (!path || !st || !reader)
+        return EINVAL;
+
+    *reader = NULL;
+    bftps_transfer_shared_t* shared = gp_transferShared;
+    while (shared) {
+        if (shared->st.st_dev == st->st_dev && shared->st.st_ino == st->st_ino &&
+                shared->st.st_size == st->st_size && shared->st.st_mtime == st->st_mtime &&
+                position >= shared->start && position <= bftps_transfer_shared_end(shared))
+            break;
+        shared = shared->next;
+    }
+
+    if (NULL == shared) {
+        // nobody is reading this part of the file, so open a new window
+        if (!create || g_transferSharedCount >= BFTPS_TRANSFER_SHARED_MAX)
+            return 0;
+
+        shared = malloc(sizeof (bftps_transfer_shared_t));
+        if (NULL == shared)
+            return ENOMEM;
+
+        int nErrorCode = 0;
+        shared->fd = open(path, O_RDONLY | O_BINARY | O_CLOEXEC);
+        if (0 > shared->fd) {
+            nErrorCode = errno;
+            free(shared);
+            return nErrorCode;
+        }
+        // make sure we are reading the file we were asked for
+        if (0 != fstat(shared->fd, &shared->st)) {
+            nErrorCode = errno;
+        } else if (shared->st.st_dev != st->st_dev || shared->st.st_ino != st->st_ino) {
+            nErrorCode = EAGAIN;
+        }
+        if (FAILED(nErrorCode)) {
+            close(shared->fd);
+            free(shared);
+            return nErrorCode;
+        }
+
+        shared->start = position - position % BFTPS_TRANSFER_SHARED_BLOCK_SIZE;
+        shared->first = 0;
+        shared->loaded = 0;
+        shared->lastSize = 0;
+        shared->readers = NULL;
+        shared->next = gp_transferShared;
+        gp_transferShared = shared;
+        ++g_transferSharedCount;
+    }
+
+    bftps_transfer_shared_reader_t* newReader = malloc(sizeof (bftps_transfer_shared_reader_t));
+    if (NULL == newReader) {
+        if (NULL == shared->readers)
+            bftps_transfer_shared_destroy(shared);
+        return ENOMEM;
+    }
+
+    newReader->shared = shared;
+    newReader->position = position;
+    newReader->next = shared->readers;
+    shared->readers = newReader;
+    *reader = newReader;
+
+    return 0;
+}
+
+int bftps_transfer_shared_read(bftps_transfer_shared_reader_t *reader,
+        off_t position, const char **data, size_t *size) {
+    if (!reader || !data || !size)
+        return EINVAL;
+
+    bftps_transfer_shared_t* shared = reader->shared;
+    if (NULL == shared)
+        return ESTALE;
+
+    reader->position = position;
+    if (position < shared->start) {
+        bftps_transfer_shared_unlink(reader);
+        return ESTALE;
+    }
+
+    // the first reader to get here reads the next block for everyone
+    while (position >= bftps_transfer_shared_end(shared)) {
+        if (position >= shared->st.st_size ||
+                (0 < shared->loaded && shared->lastSize < BFTPS_TRANSFER_SHARED_BLOCK_SIZE)) {
+            // there is nothing else to read
+            *size = 0;
+            return 0;
+        }
+
+        int nErrorCode = 0;
+        if (FAILED(nErrorCode = bftps_transfer_shared_load(shared)))
+            return nErrorCode;
+    }
+
+    off_t offset = position - shared->start;
+    unsigned int block = offset / BFTPS_TRANSFER_SHARED_BLOCK_SIZE;
+    size_t blockSize = block == shared->loaded - 1 ? shared->lastSize :
+            BFTPS_TRANSFER_SHARED_BLOCK_SIZE;
+    offset %= BFTPS_TRANSFER_SHARED_BLOCK_SIZE;
+
+    *data = shared->blocks[(shared->first + block) % BFTPS_TRANSFER_SHARED_BLOCKS] + offset;
+    *size = blockSize - offset;
+    return 0;
+}
+
+void bftps_transfer_shared_detach(bftps_transfer_shared_reader_t *reader) {
+    if (NULL == reader)
+        return;
+
+    bftps_transfer_shared_t* shared = reader->shared;
+    if (NULL != shared) {
+        bftps_transfer_shared_unlink(reader);
+        // the last one reading the file closes the window
+        if (NULL == shared->readers)
+            bftps_transfer_shared_destroy(shared);
+    }
+    free(reader);
+}
@@ -0,0 +1,47 @@
+#ifndef BFTPS_TRANSFER_SHARED_H
+#define BFTPS_TRANSFER_SHARED_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bool.h"
+
+// both can be overridden at build time
+#ifndef BFTPS_TRANSFER_SHARED_BLOCK_SIZE /* bytes read from disk at once */
+#ifdef _3DS
+#define BFTPS_TRANSFER_SHARED_BLOCK_SIZE (64 * 1024)
+#else
+#define BFTPS_TRANSFER_SHARED_BLOCK_SIZE (256 * 1024)
+#endif
+#endif
+#ifndef BFTPS_TRANSFER_SHARED_BLOCKS /* blocks kept in the window of each file */
+#ifdef _3DS
+#define BFTPS_TRANSFER_SHARED_BLOCKS 8
+#else
+#define BFTPS_TRANSFER_SHARED_BLOCKS 16
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _bftps_transfer_shared_reader_t bftps_transfer_shared_reader_t;
+
+    // join the window of the file at path, st must be its current status,
+    // a new window is only opened if create, reader is set to NULL when no
+    // window covers position and none is opened
+    extern int bftps_transfer_shared_attach(const char *path, const struct stat *st,
+            off_t position, bool create, bftps_transfer_shared_reader_t **reader);
+    // get the data at position, size is 0 at the end of the file, ESTALE means
+    // the reader fell behind the window and must read the file on its own
+    extern int bftps_transfer_shared_read(bftps_transfer_shared_reader_t *reader,
+            off_t position, const char **data, size_t *size);
+    extern void bftps_transfer_shared_detach(bftps_transfer_shared_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_SHARED_H */
+
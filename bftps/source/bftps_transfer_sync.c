@@ -0,0 +1,239 @@
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* sync_file_range */
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "bftps_transfer_sync.h"
+#include "thread.h"
+#include "event.h"
+#include "atomic.h"
+#include "time.h"
+#include "macros.h"
+
+#ifdef __linux__
+
+struct _bftps_transfer_sync_t {
+    struct _bftps_transfer_sync_t* next;
+    int fd; /* our own duplicate of the upload descriptor */
+    int result; /* errno of the sync */
+    bool done; /* the batch was synced */
+    bool released; /* nobody is waiting anymore, free it once done */
+};
+
+typedef struct {
+    thread_handle_t thread;
+    event_handle_t event; /* wakes the thread up */
+    int fd; /* eventfd signaled after each batch */
+    spinlock_t lock; /* protects pending and the done/released flags */
+    bftps_transfer_sync_t* pending; /* uploads waiting for the next batch */
+    volatile bool exit;
+} bftps_transfer_sync_context_t;
+
+static bftps_transfer_sync_context_t* gp_transferSync = NULL;
+
+THREAD_CALLBACK_DEFINITION(bftps_transfer_sync_thread, arg) {
+    bftps_transfer_sync_context_t* context = (bftps_transfer_sync_context_t*) arg;
+
+    while (true) {
+        if (!context->exit) {
+            event_wait(context->event, INT_MAX);
+            // give the uploads ending right now the chance to join this batch
+            time_sleep(BFTPS_TRANSFER_SYNC_DELAY);
+        }
+        event_reset(context->event);
+
+        spinlock_acquire(context->lock);
+        bftps_transfer_sync_t* batch = context->pending;
+        context->pending = NULL;
+        spinlock_release(context->lock);
+
+        if (NULL == batch) {
+            // we only leave when everything queued was synced
+            if (context->exit)
+                break;
+            continue;
+        }
+
+        // start writing every file first so the disk gets them all at once,
+        // then the filesystem can commit them with a single journal flush
+        bftps_transfer_sync_t* sync;
+        for (sync = batch; sync; sync = sync->next)
+            sync_file_range(sync->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        for (sync = batch; sync; sync = sync->next) {
+            sync->result = 0 == fdatasync(sync->fd) ? 0 : errno;
+            close(sync->fd);
+        }
+
+        spinlock_acquire(context->lock);
+        while (batch) {
+            sync = batch;
+            batch = batch->next;
+            if (sync->released)
+                free(sync);
+            else
+                sync->done = true;
+        }
+        spinlock_release(context->lock);
+
+        // wake the worker thread so the 226 replies go out
+        uint64_t value = 1;
+        if (0 > write(context->fd, &value, sizeof (value))) {
+            CONSOLE_LOG("write: %d %s", errno, strerror(errno));
+        }
+    }
+
+    THREAD_CALLBACK_RETURN(0);
+}
+
+int bftps_transfer_sync_init() {
+    if (NULL != gp_transferSync)
+        return EALREADY;
+
+    bftps_transfer_sync_context_t* context = malloc(sizeof (bftps_transfer_sync_context_t));
+    if (NULL == context)
+        return ENOMEM;
+    memset(context, 0, sizeof (bftps_transfer_sync_context_t));
+
+    int nErrorCode = 0;
+    context->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (0 > context->fd) {
+        nErrorCode = errno;
+        free(context);
+        return nErrorCode;
+    }
+    if (FAILED(nErrorCode = event_create(&context->event))) {
+        close(context->fd);
+        free(context);
+        return nErrorCode;
+    }
+    if (FAILED(nErrorCode = thread_create(&context->thread, bftps_transfer_sync_thread, context))) {
+        event_destroy(&context->event);
+        close(context->fd);
+        free(context);
+        return nErrorCode;
+    }
+
+    gp_transferSync = context;
+    return 0;
+}
+
+void bftps_transfer_sync_destroy() {
+    if (NULL == gp_transferSync)
+        return;
+
+    // the thread syncs what is still queued before leaving
+    gp_transferSync->exit = true;
+    event_set(gp_transferSync->event);
+    thread_join(&gp_transferSync->thread, NULL);
+    event_destroy(&gp_transferSync->event);
+    close(gp_transferSync->fd);
+    free(gp_transferSync);
+    gp_transferSync = NULL;
+}
+
+int bftps_transfer_sync_fd() {
+    return NULL == gp_transferSync ? -1 : gp_transferSync->fd;
+}
+
+void bftps_transfer_sync_poll() {
+    if (NULL == gp_transferSync)
+        return;
+
+    // the sessions check their own syncs, we only need to clear the signal
+    uint64_t value;
+    if (0 > read(gp_transferSync->fd, &value, sizeof (value)) && errno != EAGAIN) {
+        CONSOLE_LOG("read: %d %s", errno, strerror(errno));
+    }
+}
+
+int bftps_transfer_sync_submit(int fd, bftps_transfer_sync_t **sync) {
+    if (0 > fd || !sync)
+        return EINVAL;
+    if (NULL == gp_transferSync)
+        return ENOSYS;
+
+    bftps_transfer_sync_t* newSync = malloc(sizeof (bftps_transfer_sync_t));
+    if (NULL == newSync)
+        return ENOMEM;
+
+    newSync->fd = dup(fd);
+    if (0 > newSync->fd) {
+        int nErrorCode = errno;
+        free(newSync);
+        return nErrorCode;
+    }
+    newSync->result = 0;
+    newSync->done = false;
+    newSync->released = false;
+
+    spinlock_acquire(gp_transferSync->lock);
+    newSync->next = gp_transferSync->pending;
+    gp_transferSync->pending = newSync;
+    spinlock_release(gp_transferSync->lock);
+    event_set(gp_transferSync->event);
+
+    *sync = newSync;
+    return 0;
+}
+
+bool bftps_transfer_sync_done(bftps_transfer_sync_t *sync, int *result) {
+    spinlock_acquire(gp_transferSync->lock);
+    bool done = sync->done;
+    spinlock_release(gp_transferSync->lock);
+
+    if (done && result)
+        *result = sync->result;
+    return done;
+}
+
+void bftps_transfer_sync_release(bftps_transfer_sync_t *sync) {
+    if (NULL == sync)
+        return;
+
+    spinlock_acquire(gp_transferSync->lock);
+    bool done = sync->done;
+    if (!done)
+        sync->released = true;
+    spinlock_release(gp_transferSync->lock);
+
+    if (done)
+        free(sync);
+}
+
+#else
+
+int bftps_transfer_sync_init() {
+    return ENOSYS;
+}
+
+void bftps_transfer_sync_destroy() {
+}
+
+int bftps_transfer_sync_fd() {
+    return -1;
+}
+
+void bftps_transfer_sync_poll() {
+}
+
+int bftps_transfer_sync_submit(int fd, bftps_transfer_sync_t **sync) {
+    return ENOSYS;
+}
+
+bool bftps_transfer_sync_done(bftps_transfer_sync_t *sync, int *result) {
+    return true;
+}
+
+void bftps_transfer_sync_release(bftps_transfer_sync_t *sync) {
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef BFTPS_TRANSFER_SYNC_H
+#define BFTPS_TRANSFER_SYNC_H
+
+#include "bool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // what STOR does before replying 226
+    typedef enum {
+        BFTPS_TRANSFER_DURABILITY_NONE, /* leave the data to the kernel */
+        BFTPS_TRANSFER_DURABILITY_FDATASYNC, /* sync each upload when it ends */
+        BFTPS_TRANSFER_DURABILITY_GROUP, /* sync ended uploads together in the background */
+    } bftps_transfer_durability_t;
+
+    // both can be overridden at build time
+#ifndef BFTPS_TRANSFER_DURABILITY
+#ifdef __linux__
+#define BFTPS_TRANSFER_DURABILITY BFTPS_TRANSFER_DURABILITY_GROUP
+#else
+#define BFTPS_TRANSFER_DURABILITY BFTPS_TRANSFER_DURABILITY_NONE
+#endif
+#endif
+#ifndef BFTPS_TRANSFER_SYNC_DELAY /* ms waited for other uploads to join a batch */
+#define BFTPS_TRANSFER_SYNC_DELAY 2
+#endif
+
+    typedef struct _bftps_transfer_sync_t bftps_transfer_sync_t;
+
+    extern int bftps_transfer_sync_init();
+    extern void bftps_transfer_sync_destroy();
+    // descriptor to poll, it is readable once a batch is synced, -1 if there is none
+    extern int bftps_transfer_sync_fd();
+    extern void bftps_transfer_sync_poll();
+    // queue fd for the next batch, it is duplicated so the caller can close it
+    extern int bftps_transfer_sync_submit(int fd, bftps_transfer_sync_t **sync);
+    // check if the batch of sync is done, result is its errno
+    extern bool bftps_transfer_sync_done(bftps_transfer_sync_t *sync, int *result);
+    extern void bftps_transfer_sync_release(bftps_transfer_sync_t *sync);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_SYNC_H */
+
@@ -0,0 +1,883 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "bftps_transfer_tar.h"
+#include "bftps_transfer_block.h"
+#include "bftps_transfer_chunk.h"
+#include "bftps_command.h"
+#include "bftps_common.h"
+#include "bftps_cache_meta.h"
+#include "macros.h"
+
+#define BFTPS_TRANSFER_TAR_BLOCK 512
+// ustar header fields that don't fit in the name
+#define BFTPS_TRANSFER_TAR_NAME_SIZE 100
+#define BFTPS_TRANSFER_TAR_LONG_NAME "././@LongLink"
+// max bytes handed to sendfile at once
+#define BFTPS_TRANSFER_TAR_SENDFILE_SIZE (1024 * 1024)
+
+extern void bftps_file_transfer_store(bftps_session_context_t* session);
+
+struct _bftps_transfer_tar_t {
+    DIR* dirs[BFTPS_TRANSFER_TAR_DEPTH]; /* directories being walked, the last is the deepest */
+    size_t lengths[BFTPS_TRANSFER_TAR_DEPTH]; /* of their paths */
+    unsigned int depth; /* directories open */
+    size_t rootLength; /* path bytes left out of the member names */
+    bool rootPending; /* the root itself is the next member */
+    bool ended; /* the end of the archive was queued */
+    int fileFd; /* member whose data is being sent, -1 if none */
+    bool fileShort; /* it shrank, the rest of its size is sent as zeros */
+    bool fileRead; /* sendfile can't send it */
+    char pattern[NAME_MAX + 1]; /* members at the top must match it, empty if all do */
+    char path[MAX_PATH]; /* of the current member */
+    struct stat st; /* of the current member */
+    int rootFd; /* directory SITE MPUT extracts in */
+    int parentFd; /* directory of the last member extracted, kept for the next ones */
+    char parentPath[MAX_PATH]; /* its path from rootFd */
+    char header[BFTPS_TRANSFER_TAR_BLOCK]; /* being received */
+    size_t headerSize; /* bytes of it received */
+    uint64_t remaining; /* data bytes of the current member still to come */
+    size_t padding; /* bytes after them up to the next header */
+    char longType; /* GNU long name or pax header being received, 0 if none */
+    char longName[MAX_PATH]; /* the received long name or pax records */
+    size_t longNameSize; /* bytes of them received */
+    bool longNameReady; /* the next member is named by longName */
+    unsigned long entries; /* members extracted */
+    uint64_t total; /* data bytes extracted */
+};
+
+// write a number field, sizes that don't fit in octal use the base-256 form
+// GNU tar introduced
+
+static void bftps_transfer_tar_number(char *field, size_t size, uint64_t value) {
+    size_t i;
+    if (value < (1ULL << (3 * (size - 1)))) {
+        field[size - 1] = '\0';
+        for (i = size - 1; i > 0; --i) {
+            field[i - 1] = '0' + (value & 07);
+            value >>= 3;
+        }
+        return;
+    }
+    field[0] = (char) 0x80;
+    for (i = size - 1; i > 0; --i) {
+        field[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static void bftps_transfer_tar_checksum(char *header) {
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+    size_t i;
+    for (i = 0; i < BFTPS_TRANSFER_TAR_BLOCK; ++i)
+        sum += (unsigned char) header[i];
+    snprintf(header + 148, 7, "%06o", sum);
+}
+
+static char* bftps_transfer_tar_block(bftps_session_context_t *session,
+        const char *name, size_t nameLength, char type, mode_t mode, uid_t uid,
+        gid_t gid, uint64_t size, time_t mtime) {
+    char *header = session->dataBuffer + session->dataBufferSize;
+    memset(header, 0, BFTPS_TRANSFER_TAR_BLOCK);
+    memcpy(header, name, nameLength < BFTPS_TRANSFER_TAR_NAME_SIZE ?
+            nameLength : BFTPS_TRANSFER_TAR_NAME_SIZE);
+    bftps_transfer_tar_number(header + 100, 8, mode & 07777);
+    bftps_transfer_tar_number(header + 108, 8, uid);
+    bftps_transfer_tar_number(header + 116, 8, gid);
+    bftps_transfer_tar_number(header + 124, 12, size);
+    bftps_transfer_tar_number(header + 136, 12, 0 > mtime ? 0 : mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    bftps_transfer_tar_checksum(header);
+    session->dataBufferSize += BFTPS_TRANSFER_TAR_BLOCK;
+    return header;
+}
+
+// queue the header of the current member, names that don't fit go in a GNU
+// long name record before it
+
+static void bftps_transfer_tar_header(bftps_session_context_t *session, char type) {
+    bftps_transfer_tar_t *tar = session->tar;
+    char name[MAX_PATH + 1];
+    size_t nameLength = snprintf(name, sizeof (name), "%s%s", tar->path + tar->rootLength,
+            type == '5' ? "/" : "");
+
+    if (nameLength > BFTPS_TRANSFER_TAR_NAME_SIZE) {
+        bftps_transfer_tar_block(session, BFTPS_TRANSFER_TAR_LONG_NAME,
+                strlen(BFTPS_TRANSFER_TAR_LONG_NAME), 'L', 0644, 0, 0, nameLength + 1, 0);
+        size_t padded = (nameLength + 1 + BFTPS_TRANSFER_TAR_BLOCK - 1) &
+                ~(BFTPS_TRANSFER_TAR_BLOCK - 1);
+        memset(session->dataBuffer + session->dataBufferSize, 0, padded);
+        memcpy(session->dataBuffer + session->dataBufferSize, name, nameLength);
+        session->dataBufferSize += padded;
+    }
+    bftps_transfer_tar_block(session, name, nameLength, type, tar->st.st_mode,
+            tar->st.st_uid, tar->st.st_gid, type == '0' ? tar->st.st_size : 0,
+            tar->st.st_mtime);
+}
+
+// open the directory at path to walk it next
+
+static void bftps_transfer_tar_enter(bftps_transfer_tar_t *tar) {
+    if (tar->depth >= BFTPS_TRANSFER_TAR_DEPTH) {
+        CONSOLE_LOG("Too deep to archive '%s'", tar->path);
+        return;
+    }
+    DIR* dir = opendir(tar->path);
+    if (NULL == dir) {
+        CONSOLE_LOG("Failed to open dir [%s]: %d %s", tar->path, errno, strerror(errno));
+        return;
+    }
+    tar->dirs[tar->depth] = dir;
+    tar->lengths[tar->depth] = strlen(tar->path);
+    ++tar->depth;
+}
+
+// move to the next directory or regular file, ENOENT once there are no more
+
+static int bftps_transfer_tar_next(bftps_transfer_tar_t *tar) {
+    if (tar->rootPending) {
+        tar->rootPending = false;
+        return 0;
+    }
+
+    while (0 < tar->depth) {
+        DIR* dir = tar->dirs[tar->depth - 1];
+        size_t length = tar->lengths[tar->depth - 1];
+        tar->path[length] = '\0';
+
+        struct dirent* directoryEntry = readdir(dir);
+        if (NULL == directoryEntry) {
+            closedir(dir);
+            --tar->depth;
+            continue;
+        }
+        if (0 == strcmp(directoryEntry->d_name, ".") ||
+                0 == strcmp(directoryEntry->d_name, ".."))
+            continue;
+        if (1 == tar->depth && '\0' != tar->pattern[0] &&
+                0 != fnmatch(tar->pattern, directoryEntry->d_name, FNM_PERIOD))
+            continue;
+
+        size_t result = snprintf(tar->path + length, sizeof (tar->path) - length, "%s%s",
+                tar->path[length - 1] == '/' ? "" : "/", directoryEntry->d_name);
+        if (result >= sizeof (tar->path) - length) {
+            CONSOLE_LOG("Path too long to archive in [%s]", tar->path);
+            continue;
+        }
+
+        // links and special files aren't archived, and the entry may be gone
+        if (0 != lstat(tar->path, &tar->st))
+            continue;
+        if (S_ISDIR(tar->st.st_mode)) {
+            bftps_transfer_tar_enter(tar);
+            return 0;
+        } else if (S_ISREG(tar->st.st_mode))
+            return 0;
+    }
+    return ENOENT;
+}
+
+// queue the next block of the data of the current member, or its padding
+// once it is all sent
+
+static bftps_transfer_loop_status_t bftps_transfer_tar_data(bftps_session_context_t *session) {
+    bftps_transfer_tar_t *tar = session->tar;
+    uint64_t remaining = session->filesize - session->filepos;
+    if (0 == remaining) {
+        close(tar->fileFd);
+        tar->fileFd = -1;
+        memset(session->dataBuffer, 0, BFTPS_TRANSFER_TAR_BLOCK);
+        session->dataBufferSize = (BFTPS_TRANSFER_TAR_BLOCK -
+                session->filesize % BFTPS_TRANSFER_TAR_BLOCK) % BFTPS_TRANSFER_TAR_BLOCK;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+
+    ssize_t rc;
+#ifdef __linux__
+    if (!tar->fileShort && !tar->fileRead && !bftps_transfer_block_encoded(session)) {
+        // let the kernel send straight from the page cache
+        off_t offset = session->filepos;
+        rc = sendfile(session->dataFd, tar->fileFd, &offset,
+                remaining < BFTPS_TRANSFER_TAR_SENDFILE_SIZE ?
+                remaining : BFTPS_TRANSFER_TAR_SENDFILE_SIZE);
+        if (0 < rc) {
+            session->filepos = offset;
+            bftps_file_transfer_store(session);
+            return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+        } else if (0 == rc) {
+            tar->fileShort = true;
+        } else {
+            int nErrorCode = errno;
+            if (nErrorCode == EWOULDBLOCK)
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            if (nErrorCode != EINVAL && nErrorCode != ENOSYS) {
+                CONSOLE_LOG("sendfile: %d %s", nErrorCode, strerror(nErrorCode));
+                bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+                bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+            }
+            // this file can't be sent this way, so read it ourselves
+            tar->fileRead = true;
+        }
+    }
+#endif
+
+    size_t chunk = remaining < BFTPS_SESSION_TRANSFER_BUFFER_SIZE ?
+            remaining : BFTPS_SESSION_TRANSFER_BUFFER_SIZE;
+    rc = 0;
+    if (!tar->fileShort) {
+#ifdef __linux__
+        rc = pread(tar->fileFd, session->dataBuffer, chunk, session->filepos);
+#else
+        rc = read(tar->fileFd, session->dataBuffer, chunk);
+#endif
+        if (0 > rc) {
+            CONSOLE_LOG("read: %d %s", errno, strerror(errno));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            bftps_command_send_response(session, 451, "Failed to read file\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        } else if (0 == rc) {
+            tar->fileShort = true;
+        }
+    }
+    if (tar->fileShort) {
+        // the header already has the size, so keep the archive readable
+        memset(session->dataBuffer, 0, chunk);
+        rc = chunk;
+    }
+
+    session->dataBufferSize = rc;
+    session->filepos += rc;
+    bftps_file_transfer_store(session);
+    return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+}
+
+// it is closed with the file when the session goes back to COMMAND
+
+static bftps_transfer_tar_t* bftps_transfer_tar_create(bftps_session_context_t *session) {
+    bftps_transfer_tar_close(session);
+    bftps_transfer_tar_t *tar = malloc(sizeof (bftps_transfer_tar_t));
+    if (NULL == tar)
+        return NULL;
+    memset(tar, 0, sizeof (bftps_transfer_tar_t));
+    tar->fileFd = -1;
+    tar->rootFd = -1;
+    tar->parentFd = -1;
+    session->tar = tar;
+    return tar;
+}
+
+// start sending or receiving the archive on the data connection
+
+static int bftps_transfer_tar_start(bftps_session_context_t *session,
+        bftps_session_flags_t direction, bftps_transfer_loop_status_t(*transfer)(
+        bftps_session_context_t *session)) {
+    bftps_transfer_tar_t *tar = session->tar;
+
+    // set up the transfer
+    session->flags &= ~(BFTPS_SESSION_FLAG_RECV | BFTPS_SESSION_FLAG_SEND);
+    session->flags |= direction;
+    session->transfer = transfer;
+    session->dataBufferPosition = 0;
+    session->dataBufferSize = 0;
+    session->filepos = 0;
+    session->filesize = 0;
+    session->filenameRefresh = true; // new file name was set
+    strncpy(session->filename, tar->path, MAX_PATH);
+
+    if (bftps_transfer_block_reuse(session)) {
+        // in MODE B the data connection of the last transfer is still open
+        bftps_transfer_chunk_reset(session);
+        bftps_transfer_block_reset(session);
+        return 0;
+    } else if (session->flags & (BFTPS_SESSION_FLAG_PORT | BFTPS_SESSION_FLAG_PASV)) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_CONNECT,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        bftps_transfer_chunk_reset(session);
+        bftps_transfer_block_reset(session);
+
+        if (session->flags & BFTPS_SESSION_FLAG_PORT) {
+            // setup connection
+            if (FAILED(bftps_session_connect(session))) {
+                // error connecting
+                bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                        BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+                return bftps_command_send_response(session, 425,
+                        "can't open data connection\r\n");
+            }
+        }
+
+        return 0;
+    }
+
+    // we must have got SITE MGET or MPUT without a preceding PORT or PASV
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+    return bftps_command_send_response(session, 503, "Bad sequence of commands\r\n");
+}
+
+bftps_transfer_loop_status_t bftps_transfer_tar_send(bftps_session_context_t *session) {
+    bftps_transfer_tar_t *tar = session->tar;
+
+    // send any pending data
+    if (session->dataBufferPosition < session->dataBufferSize) {
+        ssize_t rc = bftps_transfer_block_send(session, session->dataBuffer +
+                session->dataBufferPosition, session->dataBufferSize -
+                session->dataBufferPosition);
+        if (0 >= rc) {
+            int nErrorCode = 0 > rc ? errno : ECONNRESET;
+            if (nErrorCode == EWOULDBLOCK)
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT; //we will retry in next poll
+            CONSOLE_LOG("Failed to send: %d %s", nErrorCode, strerror(nErrorCode));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        }
+        session->dataBufferPosition += rc;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+    session->dataBufferPosition = 0;
+    session->dataBufferSize = 0;
+
+    if (0 <= tar->fileFd)
+        return bftps_transfer_tar_data(session);
+    if (tar->ended)
+        return bftps_transfer_block_complete(session, 226);
+
+    if (ENOENT == bftps_transfer_tar_next(tar)) {
+        // two empty blocks end the archive
+        memset(session->dataBuffer, 0, 2 * BFTPS_TRANSFER_TAR_BLOCK);
+        session->dataBufferSize = 2 * BFTPS_TRANSFER_TAR_BLOCK;
+        tar->ended = true;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+
+    // the root directory has no name
+    if ('\0' == tar->path[tar->rootLength])
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+
+    if (S_ISDIR(tar->st.st_mode)) {
+        bftps_transfer_tar_header(session, '5');
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+
+    // the size in the header is the one of the file we opened
+    tar->fileFd = open(tar->path, O_RDONLY | O_BINARY);
+    if (0 > tar->fileFd) {
+        CONSOLE_LOG("open '%s': %d %s", tar->path, errno, strerror(errno));
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+    if (0 != fstat(tar->fileFd, &tar->st) || !S_ISREG(tar->st.st_mode)) {
+        close(tar->fileFd);
+        tar->fileFd = -1;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+    tar->fileShort = false;
+    tar->fileRead = false;
+    bftps_transfer_tar_header(session, '0');
+
+    session->filepos = 0;
+    session->filesize = tar->st.st_size;
+    session->filenameRefresh = true; // new file name was set
+    strncpy(session->filename, tar->path, MAX_PATH);
+    bftps_file_transfer_store(session);
+    return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+}
+
+int bftps_transfer_tar(bftps_session_context_t *session, const char *args) {
+    if (NULL == args || '\0' == args[0]) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 501, "missing path\r\n");
+    }
+
+    bftps_transfer_tar_t *tar = bftps_transfer_tar_create(session);
+    if (NULL == tar) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 451, "Out of memory\r\n");
+    }
+
+    // a wildcard is matched in the directory of the last component
+    int nErrorCode = 0;
+    const char *last = strrchr(args, '/');
+    last = NULL == last ? args : last + 1;
+    if (NULL != strpbrk(last, "*?[")) {
+        if (strlen(last) >= sizeof (tar->pattern))
+            nErrorCode = ENAMETOOLONG;
+        else {
+            strcpy(tar->pattern, last);
+            snprintf(tar->path, sizeof (tar->path), "%.*s", (int) (last - args), args);
+            if ('\0' == tar->path[0])
+                nErrorCode = bftps_common_build_path(session, session->cwd, session->cwd);
+            else
+                nErrorCode = bftps_common_build_path(session, session->cwd, tar->path);
+        }
+    } else
+        nErrorCode = bftps_common_build_path(session, session->cwd, args);
+    if (SUCCEEDED(nErrorCode) && session->dataBufferSize >= sizeof (tar->path))
+        nErrorCode = ENAMETOOLONG;
+    if (FAILED(nErrorCode)) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 553, "%s\r\n", strerror(nErrorCode));
+    }
+    memcpy(tar->path, session->dataBuffer, session->dataBufferSize);
+    tar->path[session->dataBufferSize] = '\0';
+
+    if (0 != stat(tar->path, &tar->st))
+        nErrorCode = errno;
+    else if (S_ISDIR(tar->st.st_mode)) {
+        // the root is walked right away so an unreadable one fails now
+        bftps_transfer_tar_enter(tar);
+        if (0 == tar->depth)
+            nErrorCode = EACCES;
+    } else if ('\0' != tar->pattern[0] || !S_ISREG(tar->st.st_mode))
+        nErrorCode = ENOTDIR;
+    if (FAILED(nErrorCode)) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 550, "%s\r\n", strerror(nErrorCode));
+    }
+
+    if ('\0' != tar->pattern[0]) {
+        // members are named from inside the directory
+        tar->rootLength = session->dataBufferSize;
+        if ('/' != tar->path[tar->rootLength - 1])
+            ++tar->rootLength;
+    } else {
+        // members are named from the root's own name
+        tar->rootLength = strrchr(tar->path, '/') - tar->path + 1;
+        tar->rootPending = true;
+    }
+
+    return bftps_transfer_tar_start(session, BFTPS_SESSION_FLAG_SEND,
+            bftps_transfer_tar_send);
+}
+
+#ifdef __linux__
+
+// read a number field, in octal or the base-256 form
+
+static uint64_t bftps_transfer_tar_parse(const char *field, size_t size) {
+    uint64_t value = 0;
+    size_t i = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for (i = 1; i < size; ++i)
+            value = value << 8 | (unsigned char) field[i];
+        return value;
+    }
+    while (i < size && ' ' == field[i])
+        ++i;
+    for (; i < size && '0' <= field[i] && field[i] <= '7'; ++i)
+        value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+// open the directory the member name goes in, creating what is missing,
+// and point leaf at its last component - names must stay below the root
+// and symlinks are never followed, so nothing is written outside of it
+
+static int bftps_transfer_tar_parent(bftps_transfer_tar_t *tar, char *name,
+        const char **leaf) {
+    while ('.' == name[0] && '/' == name[1])
+        name += 2;
+    size_t length = strlen(name);
+    while (0 < length && '/' == name[length - 1])
+        name[--length] = '\0';
+    if (0 == length)
+        return ENOENT; // the root itself
+    if ('/' == name[0])
+        return EACCES;
+
+    // make sure no path components are empty, '.' or '..'
+    char *p = name;
+    while (true) {
+        size_t n = strcspn(p, "/");
+        if (0 == n || (1 == n && '.' == p[0]) || (2 == n && 0 == strncmp(p, "..", 2)))
+            return EACCES;
+        if ('\0' == p[n])
+            break;
+        p += n + 1;
+    }
+
+    char *slash = strrchr(name, '/');
+    *leaf = NULL == slash ? name : slash + 1;
+    size_t parentLength = NULL == slash ? 0 : slash - name;
+
+    // members of the same directory usually come one after the other
+    if (0 <= tar->parentFd && parentLength == strlen(tar->parentPath) &&
+            0 == strncmp(name, tar->parentPath, parentLength))
+        return 0;
+
+    if (tar->parentFd != tar->rootFd)
+        close(tar->parentFd);
+    tar->parentFd = -1;
+
+    int fd = tar->rootFd;
+    p = name;
+    while (p < name + parentLength) {
+        size_t n = strcspn(p, "/");
+        p[n] = '\0';
+        int next = -1;
+        if (0 == mkdirat(fd, p, 0755) || errno == EEXIST)
+            next = openat(fd, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        int nErrorCode = errno;
+        p[n] = '/';
+        if (fd != tar->rootFd)
+            close(fd);
+        if (0 > next)
+            return nErrorCode == ELOOP || nErrorCode == ENOTDIR ? EACCES : nErrorCode;
+        fd = next;
+        p += n + 1;
+    }
+
+    tar->parentFd = fd;
+    memcpy(tar->parentPath, name, parentLength);
+    tar->parentPath[parentLength] = '\0';
+    return 0;
+}
+
+// the data of the current member was all received
+
+static int bftps_transfer_tar_member_end(bftps_transfer_tar_t *tar) {
+    int nErrorCode = 0;
+    if (0 <= tar->fileFd) {
+        if (0 != close(tar->fileFd))
+            nErrorCode = errno;
+        tar->fileFd = -1;
+    } else if ('L' == tar->longType) {
+        tar->longName[tar->longNameSize] = '\0';
+        tar->longNameReady = true;
+    } else if ('x' == tar->longType) {
+        // pax records are "<length> <key>=<value>\n", the length counts the
+        // whole record, only the path is used - They aren't NUL terminated
+        const char *record = tar->longName;
+        const char *end = tar->longName + tar->longNameSize;
+        while (record < end) {
+            size_t length = 0;
+            const char *key = record;
+            while (key < end && '0' <= *key && *key <= '9' &&
+                    length <= (size_t) (end - record))
+                length = length * 10 + (*key++ - '0');
+            if (key == record || key >= end || ' ' != *key ||
+                    length > (size_t) (end - record) || key + 1 >= record + length ||
+                    '\n' != record[length - 1])
+                return EILSEQ;
+            ++key;
+            const char *value = memchr(key, '=', record + length - 1 - key);
+            if (NULL == value)
+                return EILSEQ;
+            ++value;
+            if (5 == value - key && 0 == memcmp(key, "path=", 5)) {
+                size_t valueLength = record + length - 1 - value;
+                if (valueLength >= sizeof (tar->longName))
+                    return EILSEQ;
+                memmove(tar->longName, value, valueLength);
+                tar->longName[valueLength] = '\0';
+                tar->longNameReady = true;
+                break;
+            }
+            record += length;
+        }
+    }
+    tar->longType = 0;
+    return nErrorCode;
+}
+
+// a header was received, get ready for the data of its member
+
+static int bftps_transfer_tar_member(bftps_session_context_t *session) {
+    bftps_transfer_tar_t *tar = session->tar;
+    const char *header = tar->header;
+
+    // an empty block ends the archive
+    size_t i;
+    unsigned int sum = 0;
+    for (i = 0; i < BFTPS_TRANSFER_TAR_BLOCK; ++i)
+        sum += (unsigned char) header[i];
+    if (0 == sum) {
+        tar->ended = true;
+        return 0;
+    }
+    for (i = 148; i < 156; ++i)
+        sum += ' ' - (unsigned char) header[i];
+    if (sum != bftps_transfer_tar_parse(header + 148, 8))
+        return EILSEQ;
+
+    uint64_t size = bftps_transfer_tar_parse(header + 124, 12);
+    char type = header[156];
+    tar->remaining = size;
+    tar->padding = (BFTPS_TRANSFER_TAR_BLOCK - size % BFTPS_TRANSFER_TAR_BLOCK) %
+            BFTPS_TRANSFER_TAR_BLOCK;
+    if ('L' == type || 'x' == type) {
+        // the name of the next member
+        if (size >= sizeof (tar->longName))
+            return ENAMETOOLONG;
+        tar->longType = type;
+        tar->longNameSize = 0;
+        return 0 == size ? bftps_transfer_tar_member_end(tar) : 0;
+    }
+
+    // a long name came before the header, otherwise the prefix goes first
+    int length;
+    char *name = tar->path + tar->rootLength;
+    size_t nameSize = sizeof (tar->path) - tar->rootLength;
+    if (tar->longNameReady)
+        length = snprintf(name, nameSize, "%s", tar->longName);
+    else if (0 == memcmp(header + 257, "ustar", 5) && '\0' != header[345])
+        length = snprintf(name, nameSize, "%.155s/%.100s", header + 345, header);
+    else
+        length = snprintf(name, nameSize, "%.100s", header);
+    tar->longNameReady = false;
+    if ((size_t) length >= nameSize)
+        return ENAMETOOLONG;
+
+    if ('0' != type && '\0' != type && '7' != type && '5' != type) {
+        // links, devices and global pax records are skipped
+        CONSOLE_LOG("Skipping '%s' of type %d", name, type);
+        return 0;
+    }
+    if (++tar->entries > BFTPS_TRANSFER_TAR_ENTRIES)
+        return EFBIG;
+    if ('5' != type && (tar->total += size) > BFTPS_TRANSFER_TAR_SIZE)
+        return EFBIG;
+
+    const char *leaf;
+    int nErrorCode = bftps_transfer_tar_parent(tar, name, &leaf);
+    if (ENOENT == nErrorCode)
+        return 0;
+    else if (FAILED(nErrorCode))
+        return nErrorCode;
+
+    if ('5' == type) {
+        if (0 != mkdirat(tar->parentFd, leaf, 0755) && errno != EEXIST)
+            return errno;
+        return 0;
+    }
+
+    tar->fileFd = openat(tar->parentFd, leaf, O_WRONLY | O_CREAT | O_TRUNC |
+            O_NOFOLLOW | O_BINARY, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (0 > tar->fileFd)
+        return errno == ELOOP ? EACCES : errno;
+
+    session->filepos = 0;
+    session->filesize = size;
+    session->filenameRefresh = true; // new file name was set
+    strncpy(session->filename, tar->path, MAX_PATH);
+    bftps_file_transfer_store(session);
+    return 0 == size ? bftps_transfer_tar_member_end(tar) : 0;
+}
+
+// extract what is in the session buffer
+
+static int bftps_transfer_tar_consume(bftps_session_context_t *session) {
+    bftps_transfer_tar_t *tar = session->tar;
+    int nErrorCode = 0;
+
+    while (session->dataBufferPosition < session->dataBufferSize && !tar->ended) {
+        const char *data = session->dataBuffer + session->dataBufferPosition;
+        size_t size = session->dataBufferSize - session->dataBufferPosition;
+
+        if (0 < tar->remaining) {
+            // the data of the member goes straight to its file
+            if (size > tar->remaining)
+                size = tar->remaining;
+            if (0 <= tar->fileFd) {
+                size_t written = 0;
+                while (written < size) {
+                    ssize_t rc = write(tar->fileFd, data + written, size - written);
+                    if (0 > rc && errno != EINTR)
+                        return errno;
+                    else if (0 < rc)
+                        written += rc;
+                }
+                session->filepos += size;
+                bftps_file_transfer_store(session);
+            } else if (0 != tar->longType) {
+                memcpy(tar->longName + tar->longNameSize, data, size);
+                tar->longNameSize += size;
+            }
+            tar->remaining -= size;
+            if (0 == tar->remaining && FAILED(nErrorCode = bftps_transfer_tar_member_end(tar)))
+                return nErrorCode;
+        } else if (0 < tar->padding) {
+            if (size > tar->padding)
+                size = tar->padding;
+            tar->padding -= size;
+        } else {
+            if (size > sizeof (tar->header) - tar->headerSize)
+                size = sizeof (tar->header) - tar->headerSize;
+            memcpy(tar->header + tar->headerSize, data, size);
+            tar->headerSize += size;
+            if (tar->headerSize == sizeof (tar->header)) {
+                tar->headerSize = 0;
+                if (FAILED(nErrorCode = bftps_transfer_tar_member(session))) {
+                    CONSOLE_LOG("extract '%s': %d %s", tar->path, nErrorCode,
+                            strerror(nErrorCode));
+                    return nErrorCode;
+                }
+            }
+        }
+        session->dataBufferPosition += size;
+    }
+
+    // whatever follows the end of the archive is ignored
+    if (tar->ended)
+        session->dataBufferPosition = session->dataBufferSize;
+    return 0;
+}
+
+static bftps_transfer_loop_status_t bftps_transfer_tar_recv(bftps_session_context_t *session) {
+    bftps_transfer_tar_t *tar = session->tar;
+
+    ssize_t rc = 1;
+    if (session->dataBufferPosition == session->dataBufferSize) {
+        // we have extracted all the received data, so try to get some more
+        rc = bftps_transfer_block_recv(session, session->dataBuffer, session->dataChunk);
+        bftps_transfer_chunk_update(session, session->dataChunk, rc);
+        if (0 > rc && errno == EWOULDBLOCK)
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        else if (0 > rc)
+            CONSOLE_LOG("recv: %d %s", errno, strerror(errno));
+        session->dataBufferPosition = 0;
+        session->dataBufferSize = 0 < rc ? rc : 0;
+    }
+
+    int nErrorCode = 0;
+    if (0 < rc && SUCCEEDED(nErrorCode = bftps_transfer_tar_consume(session)))
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+
+    // the archive may stop without its empty blocks, not inside a member
+    bool whole = tar->ended || (0 == tar->headerSize && 0 == tar->remaining &&
+            0 == tar->padding);
+    unsigned long entries = tar->entries;
+    tar->path[1 < tar->rootLength ? tar->rootLength - 1 : tar->rootLength] = '\0';
+    bftps_cache_meta_invalidate(tar->path, true);
+
+    // in MODE B the connection is still good for the next transfer once
+    // all the data came
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, rc == 0 ?
+            bftps_transfer_block_close_flags(session) :
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+    bftps_common_update_free_space(session);
+
+    if (nErrorCode == EFBIG)
+        bftps_command_send_response(session, 552, "Exceeded storage allocation\r\n");
+    else if (nErrorCode == ENOSPC || nErrorCode == EDQUOT)
+        bftps_command_send_response(session, 552, "Insufficient storage space\r\n");
+    else if (nErrorCode == EACCES)
+        bftps_command_send_response(session, 553, "File name not allowed\r\n");
+    else if (FAILED(nErrorCode))
+        bftps_command_send_response(session, 451, "Failed to extract archive\r\n");
+    else if (0 > rc)
+        bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+    else if (!whole)
+        bftps_command_send_response(session, 451, "Archive ended early\r\n");
+    else
+        bftps_command_send_response(session, 226, "%lu entries extracted\r\n", entries);
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+#endif
+
+int bftps_transfer_untar(bftps_session_context_t *session, const char *args) {
+#ifdef __linux__
+    if (NULL == args || '\0' == args[0]) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 501, "missing path\r\n");
+    }
+
+    bftps_transfer_tar_t *tar = bftps_transfer_tar_create(session);
+    if (NULL == tar) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 451, "Out of memory\r\n");
+    }
+
+    // the directory is confined the same way STOR paths are
+    int nErrorCode = bftps_common_build_path(session, session->cwd, args);
+    if (SUCCEEDED(nErrorCode) && session->dataBufferSize + 1 >= sizeof (tar->path))
+        nErrorCode = ENAMETOOLONG;
+    if (FAILED(nErrorCode)) {
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 553, "%s\r\n", strerror(nErrorCode));
+    }
+    tar->rootFd = open(session->dataBuffer, O_RDONLY | O_DIRECTORY);
+    if (0 > tar->rootFd) {
+        nErrorCode = errno;
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 550, "%s\r\n", strerror(nErrorCode));
+    }
+    tar->parentFd = tar->rootFd;
+
+    // member names are written after the directory
+    memcpy(tar->path, session->dataBuffer, session->dataBufferSize);
+    tar->rootLength = session->dataBufferSize;
+    if ('/' != tar->path[tar->rootLength - 1])
+        tar->path[tar->rootLength++] = '/';
+    tar->path[tar->rootLength] = '\0';
+
+    return bftps_transfer_tar_start(session, BFTPS_SESSION_FLAG_RECV,
+            bftps_transfer_tar_recv);
+#else
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+    return bftps_command_send_response(session, 502, "unavailable\r\n");
+#endif
+}
+
+void bftps_transfer_tar_close(bftps_session_context_t *session) {
+    bftps_transfer_tar_t *tar = session->tar;
+    if (NULL == tar)
+        return;
+
+    while (0 < tar->depth)
+        closedir(tar->dirs[--tar->depth]);
+    if (0 <= tar->fileFd)
+        close(tar->fileFd);
+    if (0 <= tar->parentFd && tar->parentFd != tar->rootFd)
+        close(tar->parentFd);
+    if (0 <= tar->rootFd)
+        close(tar->rootFd);
+    free(tar);
+    session->tar = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef BFTPS_TRANSFER_TAR_H
+#define BFTPS_TRANSFER_TAR_H
+
+#include "bftps_transfer.h"
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_TAR_DEPTH /* directories open at once, deeper ones are archived empty */
+#define BFTPS_TRANSFER_TAR_DEPTH 64
+#endif
+#ifndef BFTPS_TRANSFER_TAR_ENTRIES /* files and directories one SITE MPUT can create */
+#define BFTPS_TRANSFER_TAR_ENTRIES 100000
+#endif
+#ifndef BFTPS_TRANSFER_TAR_SIZE /* file bytes one SITE MPUT can write */
+#ifdef _3DS
+#define BFTPS_TRANSFER_TAR_SIZE (1024ULL * 1024 * 1024)
+#else
+#define BFTPS_TRANSFER_TAR_SIZE (16ULL * 1024 * 1024 * 1024)
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // send args as a tar stream, a file, a directory with all below it or
+    // a wildcard in the last component matched in its directory - Requires
+    // a PORT or PASV connection
+    extern int bftps_transfer_tar(bftps_session_context_t *session, const char *args);
+    // extract the tar stream received into the directory args, the limits
+    // above abort it - Requires a PORT or PASV connection
+    extern int bftps_transfer_untar(bftps_session_context_t *session, const char *args);
+    // transfer callback, sends the next member
+    extern bftps_transfer_loop_status_t bftps_transfer_tar_send(
+            bftps_session_context_t *session);
+    // stop walking and close what is open
+    extern void bftps_transfer_tar_close(bftps_session_context_t *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_TAR_H */
+
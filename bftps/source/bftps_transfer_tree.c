@@ -0,0 +1,895 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "bftps_transfer_tree.h"
+#include "bftps_transfer_block.h"
+#include "bftps_transfer_chunk.h"
+#include "bftps_command.h"
+#include "bftps_common.h"
+#include "bftps_cache_meta.h"
+#include "thread.h"
+#include "event.h"
+#include "atomic.h"
+#include "macros.h"
+
+#ifdef __linux__
+
+struct _bftps_transfer_tree_t {
+    bftps_transfer_tree_kind_t kind;
+    char root[MAX_PATH];
+    uint64_t files; /* removed or measured */
+    uint64_t directories; /* removed or measured */
+    uint64_t bytes; /* size of the files */
+    uint64_t blocks; /* bytes used on disk */
+    uint64_t failed; /* entries that couldn't be removed or measured */
+    char errors[BFTPS_TRANSFER_TREE_ERRORS][256]; /* the first failures */
+    unsigned int errorsCount;
+    bool done; /* every directory was walked */
+    bool released; /* nobody is waiting anymore, stop and free it once done */
+    // only used by SITE FIND
+    char pattern[NAME_MAX + 1]; /* names must match it */
+    time_t newer; /* modified after it, 0 if any */
+    uint64_t sizeMin; /* regular files bigger than it, 0 if any */
+    uint64_t sizeMax; /* regular files smaller than it, UINT64_MAX if any */
+    char* output; /* matches not sent yet, one path per line */
+    size_t outputSize; /* bytes of them */
+    struct _bftps_transfer_tree_dir_t* parked; /* waiting for room in the output */
+    // only used by the session
+    unsigned int errorsReported; /* failures already sent */
+    time_t progressTime; /* of the last progress line */
+};
+
+// a directory waiting to be walked or for its subdirectories
+typedef struct _bftps_transfer_tree_dir_t {
+    struct _bftps_transfer_tree_dir_t* next; /* in the queue */
+    struct _bftps_transfer_tree_dir_t* parent; /* is finished after this one */
+    bftps_transfer_tree_t* tree;
+    unsigned long pending; /* its own walk and subdirectories not finished */
+    DIR* d; /* where the walk goes on if it was parked, NULL otherwise */
+    dev_t dev; /* of the directory found in the parent, what is opened */
+    ino_t ino; /* later by path must still be it */
+    char path[];
+} bftps_transfer_tree_dir_t;
+
+typedef struct {
+    thread_handle_t threads[BFTPS_TRANSFER_TREE_THREADS];
+    unsigned int threadsCount;
+    event_handle_t event; /* wakes the threads up */
+    int fd; /* eventfd signaled after each tree */
+    spinlock_t lock; /* protects the queue, the pending counts and the tree flags */
+    bftps_transfer_tree_dir_t* pending; /* directories to walk, the last found first */
+    unsigned int queued; /* of them */
+    unsigned int trees; /* SITE RMTREE and DU being walked */
+    unsigned int finds; /* SITE FIND being walked */
+    volatile bool exit;
+} bftps_transfer_tree_context_t;
+
+static bftps_transfer_tree_context_t* gp_transferTree = NULL;
+
+static void bftps_transfer_tree_error(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_t* tree, const char *path, const char *name, int nErrorCode) {
+    spinlock_acquire(context->lock);
+    ++tree->failed;
+    if (tree->errorsCount < BFTPS_TRANSFER_TREE_ERRORS) {
+        // long paths are cut, the line still tells what failed
+        if (0 <= snprintf(tree->errors[tree->errorsCount], sizeof (tree->errors[0]),
+                "%s%s%s: %s", path, NULL == name ? "" : "/", NULL == name ? "" : name,
+                strerror(nErrorCode)))
+            ++tree->errorsCount;
+    }
+    spinlock_release(context->lock);
+}
+
+static bftps_transfer_tree_dir_t* bftps_transfer_tree_dir(bftps_transfer_tree_t* tree,
+        bftps_transfer_tree_dir_t* parent, const char *path, const char *name,
+        const struct stat *st) {
+    size_t length = strlen(path);
+    bftps_transfer_tree_dir_t* dir = malloc(sizeof (bftps_transfer_tree_dir_t) + length +
+            (NULL == name ? 0 : strlen(name) + 1) + 1);
+    if (NULL == dir)
+        return NULL;
+    dir->next = NULL;
+    dir->parent = parent;
+    dir->tree = tree;
+    dir->pending = 1;
+    dir->d = NULL;
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    if (NULL == name)
+        memcpy(dir->path, path, length + 1);
+    else
+        sprintf(dir->path, "%s%s%s", path, '/' == path[length - 1] ? "" : "/", name);
+    return dir;
+}
+
+// open the directory by its path, O_NOFOLLOW only covers the last component,
+// so a directory above swapped for a symlink meanwhile is told apart by
+// not being the one found in the tree
+
+static int bftps_transfer_tree_open(bftps_transfer_tree_dir_t* dir) {
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (0 > fd)
+        return -1;
+    struct stat st;
+    int nErrorCode = 0;
+    if (0 != fstat(fd, &st))
+        nErrorCode = errno;
+    else if (st.st_dev != dir->dev || st.st_ino != dir->ino)
+        nErrorCode = ESTALE;
+    if (FAILED(nErrorCode)) {
+        close(fd);
+        errno = nErrorCode;
+        return -1;
+    }
+    return fd;
+}
+
+// remove the walked directory through its parent, which must still be the
+// one in the tree, the root was asked for by its path
+
+static int bftps_transfer_tree_rmdir(bftps_transfer_tree_dir_t* dir) {
+    if (NULL == dir->parent)
+        return 0 == rmdir(dir->path) ? 0 : errno;
+
+    int fd = bftps_transfer_tree_open(dir->parent);
+    if (0 > fd)
+        return errno;
+    int nErrorCode = 0;
+    if (0 != unlinkat(fd, strrchr(dir->path, '/') + 1, AT_REMOVEDIR))
+        nErrorCode = errno;
+    close(fd);
+    return nErrorCode;
+}
+
+// a directory and all below it were walked, so it can go, and its parent
+// too if it was the last one it waited for
+
+static void bftps_transfer_tree_finish(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir) {
+    while (NULL != dir) {
+        spinlock_acquire(context->lock);
+        unsigned long pending = --dir->pending;
+        spinlock_release(context->lock);
+        if (0 < pending)
+            return;
+
+        bftps_transfer_tree_t* tree = dir->tree;
+        if (BFTPS_TRANSFER_TREE_REMOVE == tree->kind && !tree->released && !context->exit) {
+            int nErrorCode = bftps_transfer_tree_rmdir(dir);
+            if (FAILED(nErrorCode))
+                bftps_transfer_tree_error(context, tree, dir->path, NULL, nErrorCode);
+            else
+                __sync_fetch_and_add(&tree->directories, 1);
+        }
+
+        bftps_transfer_tree_dir_t* parent = dir->parent;
+        free(dir);
+        dir = parent;
+        if (NULL != dir)
+            continue;
+
+        spinlock_acquire(context->lock);
+        bool released = tree->released;
+        tree->done = true;
+        if (BFTPS_TRANSFER_TREE_FIND == tree->kind)
+            --context->finds;
+        else
+            --context->trees;
+        spinlock_release(context->lock);
+        if (released) {
+            free(tree->output);
+            free(tree);
+        }
+
+        // wake the worker thread so the reply goes out
+        uint64_t value = 1;
+        if (0 > write(context->fd, &value, sizeof (value))) {
+            CONSOLE_LOG("write: %d %s", errno, strerror(errno));
+        }
+    }
+}
+
+static void bftps_transfer_tree_walk(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir);
+
+// queue the subdirectory for any thread to take, or walk it right away if
+// the queue is full so memory doesn't grow with the width of the tree
+
+static void bftps_transfer_tree_enter(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir, const char *name, const struct stat *st) {
+    bftps_transfer_tree_t* tree = dir->tree;
+    bftps_transfer_tree_dir_t* child = bftps_transfer_tree_dir(tree, dir, dir->path, name, st);
+    if (NULL == child) {
+        bftps_transfer_tree_error(context, tree, dir->path, name, ENOMEM);
+        return;
+    }
+
+    spinlock_acquire(context->lock);
+    ++dir->pending;
+    bool queue = context->queued < BFTPS_TRANSFER_TREE_QUEUE;
+    if (queue) {
+        child->next = context->pending;
+        context->pending = child;
+        ++context->queued;
+    }
+    spinlock_release(context->lock);
+
+    if (queue)
+        event_set(context->event);
+    else
+        bftps_transfer_tree_walk(context, child);
+}
+
+// put the parked directories of the tree back in the queue, the lock must
+// be held, returns if there were any
+
+static bool bftps_transfer_tree_resume(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_t* tree) {
+    bool resumed = NULL != tree->parked;
+    while (NULL != tree->parked) {
+        bftps_transfer_tree_dir_t* dir = tree->parked;
+        tree->parked = dir->next;
+        dir->next = context->pending;
+        context->pending = dir;
+        ++context->queued;
+    }
+    return resumed;
+}
+
+// add a match for the worker thread to send, false if the output has no
+// room for it
+
+static bool bftps_transfer_tree_match(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir, const char *name) {
+    bftps_transfer_tree_t* tree = dir->tree;
+    char line[MAX_PATH + 3];
+    size_t length = snprintf(line, sizeof (line), "%s%s%s\r\n", dir->path,
+            '/' == dir->path[strlen(dir->path) - 1] ? "" : "/", name);
+    if (length >= sizeof (line)) {
+        bftps_transfer_tree_error(context, tree, dir->path, name, ENAMETOOLONG);
+        return true;
+    }
+
+    spinlock_acquire(context->lock);
+    bool wake = 0 == tree->outputSize;
+    bool fits = tree->outputSize + length <= BFTPS_TRANSFER_TREE_FIND_BUFFER;
+    if (fits) {
+        memcpy(tree->output + tree->outputSize, line, length);
+        tree->outputSize += length;
+    }
+    spinlock_release(context->lock);
+
+    // the session may be waiting for something to send
+    uint64_t value = 1;
+    if (fits && wake && 0 > write(context->fd, &value, sizeof (value))) {
+        CONSOLE_LOG("write: %d %s", errno, strerror(errno));
+    }
+    return fits;
+}
+
+// the output is full, so the walk of the directory waits outside of the
+// threads until the session takes some of it, the client may take its time
+
+static void bftps_transfer_tree_park(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir, DIR* d) {
+    bftps_transfer_tree_t* tree = dir->tree;
+    dir->d = d;
+
+    spinlock_acquire(context->lock);
+    dir->next = tree->parked;
+    tree->parked = dir;
+    // the session may have taken the output meanwhile, or be gone
+    bool resumed = (tree->released || BFTPS_TRANSFER_TREE_FIND_BUFFER - tree->outputSize >=
+            MAX_PATH + 3) && bftps_transfer_tree_resume(context, tree);
+    spinlock_release(context->lock);
+
+    if (resumed)
+        event_set(context->event);
+}
+
+// check if the entry matches what SITE FIND looks for, only stat it if the
+// directory entry doesn't tell enough, false if there was no room for it
+
+static bool bftps_transfer_tree_find_entry(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir, int fd, struct dirent* entry) {
+    bftps_transfer_tree_t* tree = dir->tree;
+    struct stat st;
+    bool stated = false;
+    bool directory = DT_DIR == entry->d_type;
+    if (DT_UNKNOWN == entry->d_type) {
+        if (0 != fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            if (errno != ENOENT)
+                bftps_transfer_tree_error(context, tree, dir->path, entry->d_name, errno);
+            return true;
+        }
+        stated = true;
+        directory = S_ISDIR(st.st_mode);
+    }
+
+    if (0 == fnmatch(tree->pattern, entry->d_name, 0)) {
+        bool filtered = 0 != tree->newer || 0 != tree->sizeMin || UINT64_MAX != tree->sizeMax;
+        bool matched = true;
+        if (filtered && !stated && 0 != fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+            matched = false;
+        else if (filtered) {
+            if (0 != tree->newer && st.st_mtime <= tree->newer)
+                matched = false;
+            if ((0 != tree->sizeMin || UINT64_MAX != tree->sizeMax) && (!S_ISREG(st.st_mode) ||
+                    (uint64_t) st.st_size <= tree->sizeMin ||
+                    (uint64_t) st.st_size >= tree->sizeMax))
+                matched = false;
+        }
+        if (matched && !bftps_transfer_tree_match(context, dir, entry->d_name))
+            return false;
+    }
+
+    if (!directory)
+        return true;
+    // its identity is checked when it is opened
+    if (!stated && 0 != fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno != ENOENT)
+            bftps_transfer_tree_error(context, tree, dir->path, entry->d_name, errno);
+    } else if (S_ISDIR(st.st_mode))
+        bftps_transfer_tree_enter(context, dir, entry->d_name, &st);
+    return true;
+}
+
+// remove, measure or search what is in the directory, the subdirectories
+// are queued for any thread to take
+
+static void bftps_transfer_tree_walk(bftps_transfer_tree_context_t* context,
+        bftps_transfer_tree_dir_t* dir) {
+    bftps_transfer_tree_t* tree = dir->tree;
+    DIR* d = dir->d;
+    dir->d = NULL;
+    if (NULL == d) {
+        int fd = bftps_transfer_tree_open(dir);
+        d = 0 > fd ? NULL : fdopendir(fd);
+        if (NULL == d) {
+            bftps_transfer_tree_error(context, tree, dir->path, NULL, errno);
+            if (0 <= fd)
+                close(fd);
+            bftps_transfer_tree_finish(context, dir);
+            return;
+        }
+    }
+    int fd = dirfd(d);
+
+    struct dirent* entry;
+    while (!tree->released && !context->exit) {
+        long position = telldir(d);
+        if (NULL == (entry = readdir(d)))
+            break;
+        if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+            continue;
+        if (BFTPS_TRANSFER_TREE_FIND == tree->kind) {
+            if (bftps_transfer_tree_find_entry(context, dir, fd, entry))
+                continue;
+            // the entry is read again once there is room for it
+            seekdir(d, position);
+            bftps_transfer_tree_park(context, dir, d);
+            return;
+        }
+
+        // symlinks are never followed, they are entries like files
+        struct stat st;
+        if (0 != fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            if (errno != ENOENT)
+                bftps_transfer_tree_error(context, tree, dir->path, entry->d_name, errno);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (BFTPS_TRANSFER_TREE_USAGE == tree->kind) {
+                __sync_fetch_and_add(&tree->directories, 1);
+                __sync_fetch_and_add(&tree->blocks, (uint64_t) st.st_blocks * 512);
+            }
+            bftps_transfer_tree_enter(context, dir, entry->d_name, &st);
+        } else if (BFTPS_TRANSFER_TREE_REMOVE == tree->kind) {
+            if (0 != unlinkat(fd, entry->d_name, 0))
+                bftps_transfer_tree_error(context, tree, dir->path, entry->d_name, errno);
+            else
+                __sync_fetch_and_add(&tree->files, 1);
+        } else {
+            __sync_fetch_and_add(&tree->files, 1);
+            __sync_fetch_and_add(&tree->bytes, (uint64_t) st.st_size);
+            __sync_fetch_and_add(&tree->blocks, (uint64_t) st.st_blocks * 512);
+        }
+    }
+
+    closedir(d);
+    bftps_transfer_tree_finish(context, dir);
+}
+
+THREAD_CALLBACK_DEFINITION(bftps_transfer_tree_thread, arg) {
+    bftps_transfer_tree_context_t* context = (bftps_transfer_tree_context_t*) arg;
+
+    while (true) {
+        spinlock_acquire(context->lock);
+        bftps_transfer_tree_dir_t* dir = context->pending;
+        if (NULL != dir) {
+            context->pending = dir->next;
+            --context->queued;
+        }
+        spinlock_release(context->lock);
+
+        if (NULL == dir) {
+            // when leaving, what is still queued is only finished
+            if (context->exit)
+                break;
+            event_wait(context->event, INT_MAX);
+            event_reset(context->event);
+            continue;
+        }
+        bftps_transfer_tree_walk(context, dir);
+    }
+
+    THREAD_CALLBACK_RETURN(0);
+}
+
+int bftps_transfer_tree_init() {
+    if (NULL != gp_transferTree)
+        return EALREADY;
+
+    bftps_transfer_tree_context_t* context = malloc(sizeof (bftps_transfer_tree_context_t));
+    if (NULL == context)
+        return ENOMEM;
+    memset(context, 0, sizeof (bftps_transfer_tree_context_t));
+
+    int nErrorCode = 0;
+    context->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (0 > context->fd) {
+        nErrorCode = errno;
+        free(context);
+        return nErrorCode;
+    }
+    if (FAILED(nErrorCode = event_create(&context->event))) {
+        close(context->fd);
+        free(context);
+        return nErrorCode;
+    }
+    for (; context->threadsCount < BFTPS_TRANSFER_TREE_THREADS; ++context->threadsCount) {
+        if (FAILED(nErrorCode = thread_create(&context->threads[context->threadsCount],
+                bftps_transfer_tree_thread, context)))
+            break;
+    }
+    // fewer threads only walk slower
+    if (0 == context->threadsCount) {
+        event_destroy(&context->event);
+        close(context->fd);
+        free(context);
+        return nErrorCode;
+    }
+
+    gp_transferTree = context;
+    return 0;
+}
+
+void bftps_transfer_tree_destroy() {
+    if (NULL == gp_transferTree)
+        return;
+
+    // the walks running are stopped
+    gp_transferTree->exit = true;
+    event_set(gp_transferTree->event);
+    unsigned int i;
+    for (i = 0; i < gp_transferTree->threadsCount; ++i)
+        thread_join(&gp_transferTree->threads[i], NULL);
+    event_destroy(&gp_transferTree->event);
+    close(gp_transferTree->fd);
+    free(gp_transferTree);
+    gp_transferTree = NULL;
+}
+
+int bftps_transfer_tree_fd() {
+    return NULL == gp_transferTree ? -1 : gp_transferTree->fd;
+}
+
+void bftps_transfer_tree_poll() {
+    if (NULL == gp_transferTree)
+        return;
+
+    // the sessions check their own trees, we only need to clear the signal
+    uint64_t value;
+    if (0 > read(gp_transferTree->fd, &value, sizeof (value)) && errno != EAGAIN) {
+        CONSOLE_LOG("read: %d %s", errno, strerror(errno));
+    }
+}
+
+// hand the tree below path to the tree threads, tree is freed and the
+// reply sent if it can't be walked
+
+static int bftps_transfer_tree_start(bftps_session_context_t *session, const char *path,
+        bftps_transfer_tree_t *tree) {
+    // build the path of the tree
+    int nErrorCode = 0;
+    if (FAILED(nErrorCode = bftps_common_build_path(session, session->cwd, path))) {
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 553, "%s\r\n", strerror(nErrorCode));
+    }
+    struct stat st;
+    if (FAILED(nErrorCode = bftps_cache_meta_lstat(session->dataBuffer, &st))) {
+        CONSOLE_LOG("lstat: %d %s", nErrorCode, strerror(nErrorCode));
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 550, "no such file or directory\r\n");
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 550, "not a directory\r\n");
+    }
+    if (BFTPS_TRANSFER_TREE_REMOVE == tree->kind && 0 == strcmp(session->dataBuffer, "/")) {
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 550, "not allowed\r\n");
+    }
+
+    bftps_transfer_tree_dir_t* dir = bftps_transfer_tree_dir(tree, NULL,
+            session->dataBuffer, NULL, &st);
+    if (NULL == dir) {
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 451, "Out of memory\r\n");
+    }
+    snprintf(tree->root, sizeof (tree->root), "%s", session->dataBuffer);
+    tree->progressTime = time(NULL);
+    if (BFTPS_TRANSFER_TREE_USAGE == tree->kind) {
+        tree->directories = 1;
+        tree->blocks = (uint64_t) st.st_blocks * 512;
+    }
+
+    // big trees would keep the disk busy for everyone else
+    spinlock_acquire(gp_transferTree->lock);
+    bool busy;
+    if (BFTPS_TRANSFER_TREE_FIND == tree->kind)
+        busy = gp_transferTree->finds >= BFTPS_TRANSFER_TREE_FIND_MAX;
+    else
+        busy = gp_transferTree->trees >= BFTPS_TRANSFER_TREE_MAX;
+    if (!busy) {
+        if (BFTPS_TRANSFER_TREE_FIND == tree->kind)
+            ++gp_transferTree->finds;
+        else
+            ++gp_transferTree->trees;
+        tree->done = false;
+        dir->next = gp_transferTree->pending;
+        gp_transferTree->pending = dir;
+        ++gp_transferTree->queued;
+    }
+    spinlock_release(gp_transferTree->lock);
+    if (busy) {
+        bftps_transfer_tree_release(tree);
+        free(dir);
+        return bftps_command_send_response(session, 450,
+                "Too many trees being walked, try again later\r\n");
+    }
+    event_set(gp_transferTree->event);
+    session->tree = tree;
+    return 0;
+}
+
+// a tree is only walked once handed to the tree threads, until then
+// releasing it frees it
+
+static bftps_transfer_tree_t* bftps_transfer_tree_create(bftps_transfer_tree_kind_t kind) {
+    bftps_transfer_tree_t* tree = malloc(sizeof (bftps_transfer_tree_t));
+    if (NULL == tree)
+        return NULL;
+    memset(tree, 0, sizeof (bftps_transfer_tree_t));
+    tree->kind = kind;
+    tree->done = true;
+    tree->sizeMax = UINT64_MAX;
+    return tree;
+}
+
+int bftps_transfer_tree(bftps_session_context_t *session, const char *args,
+        bftps_transfer_tree_kind_t kind) {
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    if (NULL == gp_transferTree)
+        return bftps_command_send_response(session, 502, "unavailable\r\n");
+
+    bftps_transfer_tree_t* tree = bftps_transfer_tree_create(kind);
+    if (NULL == tree)
+        return bftps_command_send_response(session, 451, "Out of memory\r\n");
+    int nErrorCode = bftps_transfer_tree_start(session, args, tree);
+    if (NULL == session->tree)
+        return nErrorCode;
+
+    // we reply once the tree threads are done with it
+    session->transfer = bftps_transfer_tree_wait;
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_SYNC, 0);
+    return 0;
+}
+
+// read a size filter, in bytes or with a k, M or G suffix
+
+static int bftps_transfer_tree_find_size(const char *text, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || 0 != errno)
+        return EINVAL;
+    if ('k' == *end || 'K' == *end)
+        value <<= 10, ++end;
+    else if ('M' == *end)
+        value <<= 20, ++end;
+    else if ('G' == *end)
+        value <<= 30, ++end;
+    if ('\0' != *end)
+        return EINVAL;
+    *size = value;
+    return 0;
+}
+
+// the arguments are <path> <glob> [YYYYMMDDHHMMSS] [+size] [-size], the
+// time is UTC like MDTM and the sizes only match regular files
+
+static int bftps_transfer_tree_find_args(bftps_transfer_tree_t *tree, char *args,
+        char **path) {
+    char *save = NULL;
+    *path = strtok_r(args, " ", &save);
+    char *pattern = strtok_r(NULL, " ", &save);
+    if (NULL == *path || NULL == pattern || strlen(pattern) >= sizeof (tree->pattern))
+        return EINVAL;
+    strcpy(tree->pattern, pattern);
+
+    char *filter;
+    while (NULL != (filter = strtok_r(NULL, " ", &save))) {
+        if ('+' == filter[0]) {
+            if (FAILED(bftps_transfer_tree_find_size(filter + 1, &tree->sizeMin)))
+                return EINVAL;
+        } else if ('-' == filter[0]) {
+            if (FAILED(bftps_transfer_tree_find_size(filter + 1, &tree->sizeMax)))
+                return EINVAL;
+        } else {
+            struct tm tm;
+            memset(&tm, 0, sizeof (tm));
+            if (14 != strspn(filter, "0123456789") || '\0' != filter[14] ||
+                    6 != sscanf(filter, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+                    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec))
+                return EINVAL;
+            tm.tm_year -= 1900;
+            tm.tm_mon -= 1;
+            tree->newer = timegm(&tm);
+        }
+    }
+    return 0;
+}
+
+int bftps_transfer_tree_find(bftps_session_context_t *session, const char *args) {
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    if (NULL == gp_transferTree)
+        return bftps_command_send_response(session, 502, "unavailable\r\n");
+
+    char copy[MAX_PATH];
+    char *path;
+    bftps_transfer_tree_t* tree = bftps_transfer_tree_create(BFTPS_TRANSFER_TREE_FIND);
+    if (NULL == tree || NULL == (tree->output = malloc(BFTPS_TRANSFER_TREE_FIND_BUFFER))) {
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 451, "Out of memory\r\n");
+    }
+    if (strlen(args) >= sizeof (copy) ||
+            FAILED(bftps_transfer_tree_find_args(tree, strcpy(copy, args), &path))) {
+        bftps_transfer_tree_release(tree);
+        return bftps_command_send_response(session, 501, "Syntax error in parameters\r\n");
+    }
+
+    // the matches go out through the data connection
+    if (!bftps_transfer_block_reuse(session) &&
+            !(session->flags & (BFTPS_SESSION_FLAG_PORT | BFTPS_SESSION_FLAG_PASV))) {
+        bftps_transfer_tree_release(tree);
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+        return bftps_command_send_response(session, 503, "Bad sequence of commands\r\n");
+    }
+    int nErrorCode = bftps_transfer_tree_start(session, path, tree);
+    if (NULL == session->tree)
+        return nErrorCode;
+
+    // set up the transfer
+    session->flags &= ~(BFTPS_SESSION_FLAG_RECV | BFTPS_SESSION_FLAG_SEND);
+    session->flags |= BFTPS_SESSION_FLAG_SEND;
+    session->transfer = bftps_transfer_tree_find_send;
+    session->dataBufferPosition = 0;
+    session->dataBufferSize = 0;
+    session->filepos = 0;
+    session->filesize = 0;
+    session->filenameRefresh = true; // new file name was set
+    strncpy(session->filename, tree->root, MAX_PATH);
+
+    if (bftps_transfer_block_reuse(session)) {
+        // in MODE B the data connection of the last transfer is still open
+        bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_TRANSFER, 0);
+        bftps_transfer_chunk_reset(session);
+        bftps_transfer_block_reset(session);
+        return 0;
+    }
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_CONNECT,
+            BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+    bftps_transfer_chunk_reset(session);
+    bftps_transfer_block_reset(session);
+
+    if (session->flags & BFTPS_SESSION_FLAG_PORT) {
+        // setup connection
+        if (FAILED(bftps_session_connect(session))) {
+            // error connecting, the walk stops once it sees it was released
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            return bftps_command_send_response(session, 425,
+                    "can't open data connection\r\n");
+        }
+    }
+    return 0;
+}
+
+bftps_transfer_loop_status_t bftps_transfer_tree_find_send(bftps_session_context_t *session) {
+    bftps_transfer_tree_t* tree = session->tree;
+
+    // send any pending data
+    if (session->dataBufferPosition < session->dataBufferSize) {
+        ssize_t rc = bftps_transfer_block_send(session, session->dataBuffer +
+                session->dataBufferPosition, session->dataBufferSize -
+                session->dataBufferPosition);
+        if (0 >= rc) {
+            int nErrorCode = 0 > rc ? errno : ECONNRESET;
+            if (nErrorCode == EWOULDBLOCK)
+                return BFTPS_TRANSFER_LOOP_STATUS_EXIT; //we will retry in next poll
+            CONSOLE_LOG("Failed to send: %d %s", nErrorCode, strerror(nErrorCode));
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND,
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_PASV |
+                    BFTPS_SESSION_MODE_SET_FLAG_CLOSE_DATA);
+            bftps_command_send_response(session, 426, "Connection broken during transfer\r\n");
+            return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+        }
+        session->dataBufferPosition += rc;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+    session->dataBufferPosition = 0;
+    session->dataBufferSize = 0;
+
+    // take the matches found so far, the threads go on with the room left
+    spinlock_acquire(gp_transferTree->lock);
+    bool done = tree->done;
+    size_t size = tree->outputSize < session->dataChunk ? tree->outputSize : session->dataChunk;
+    memcpy(session->dataBuffer, tree->output, size);
+    memmove(tree->output, tree->output + size, tree->outputSize - size);
+    tree->outputSize -= size;
+    bool resumed = 0 < size && bftps_transfer_tree_resume(gp_transferTree, tree);
+    spinlock_release(gp_transferTree->lock);
+    if (resumed)
+        event_set(gp_transferTree->event);
+
+    if (0 < size || done) {
+        // the threads wake us up through the worker thread meanwhile
+        if (BFTPS_SESSION_MODE_SYNC == session->mode)
+            bftps_session_mode_set(session, BFTPS_SESSION_MODE_DATA_TRANSFER, 0);
+        if (0 == size)
+            return bftps_transfer_block_complete(session, 226);
+        session->dataBufferSize = size;
+        return BFTPS_TRANSFER_LOOP_STATUS_CONTINUE;
+    }
+
+    // nothing to send, wait for the threads without polling the socket
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_SYNC, 0);
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+bftps_transfer_loop_status_t bftps_transfer_tree_wait(bftps_session_context_t *session) {
+    bftps_transfer_tree_t* tree = session->tree;
+    int code = BFTPS_TRANSFER_TREE_REMOVE == tree->kind ? 250 : 213;
+
+    spinlock_acquire(gp_transferTree->lock);
+    bool done = tree->done;
+    unsigned int errorsCount = tree->errorsCount;
+    spinlock_release(gp_transferTree->lock);
+
+    // the failures come first, as they happen
+    while (tree->errorsReported < errorsCount)
+        bftps_command_send_response(session, -code, "%s\r\n",
+            tree->errors[tree->errorsReported++]);
+
+    time_t now = time(NULL);
+    if (!done && now - tree->progressTime < BFTPS_TRANSFER_TREE_PROGRESS)
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+
+    char text[128];
+    if (BFTPS_TRANSFER_TREE_REMOVE == tree->kind)
+        snprintf(text, sizeof (text), "%" PRIu64 " files and %" PRIu64 " directories removed",
+            tree->files, tree->directories);
+    else
+        snprintf(text, sizeof (text), "%" PRIu64 " bytes, %" PRIu64 " on disk, in %"
+            PRIu64 " files and %" PRIu64 " directories", tree->bytes, tree->blocks,
+            tree->files, tree->directories);
+    if (!done) {
+        tree->progressTime = now;
+        bftps_command_send_response(session, -code, "%s so far\r\n", text);
+        return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+    }
+
+    uint64_t failed = tree->failed;
+    if (BFTPS_TRANSFER_TREE_REMOVE == tree->kind) {
+        bftps_cache_meta_invalidate(tree->root, true);
+        bftps_common_update_free_space(session);
+    }
+
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    if (0 < failed)
+        bftps_command_send_response(session, code, "%s, %" PRIu64 " failed\r\n", text, failed);
+    else
+        bftps_command_send_response(session, code, "%s\r\n", text);
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+void bftps_transfer_tree_release(bftps_transfer_tree_t *tree) {
+    if (NULL == tree)
+        return;
+
+    spinlock_acquire(gp_transferTree->lock);
+    bool done = tree->done;
+    // the parked directories are stopped by the threads as any other
+    bool resumed = false;
+    if (!done) {
+        tree->released = true;
+        resumed = bftps_transfer_tree_resume(gp_transferTree, tree);
+    }
+    spinlock_release(gp_transferTree->lock);
+    if (resumed)
+        event_set(gp_transferTree->event);
+
+    if (done) {
+        free(tree->output);
+        free(tree);
+    }
+}
+
+#else
+
+int bftps_transfer_tree_init() {
+    return ENOSYS;
+}
+
+void bftps_transfer_tree_destroy() {
+}
+
+int bftps_transfer_tree_fd() {
+    return -1;
+}
+
+void bftps_transfer_tree_poll() {
+}
+
+int bftps_transfer_tree(bftps_session_context_t *session, const char *args,
+        bftps_transfer_tree_kind_t kind) {
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    return bftps_command_send_response(session, 502, "unavailable\r\n");
+}
+
+int bftps_transfer_tree_find(bftps_session_context_t *session, const char *args) {
+    bftps_session_mode_set(session, BFTPS_SESSION_MODE_COMMAND, 0);
+    return bftps_command_send_response(session, 502, "unavailable\r\n");
+}
+
+bftps_transfer_loop_status_t bftps_transfer_tree_find_send(bftps_session_context_t *session) {
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+bftps_transfer_loop_status_t bftps_transfer_tree_wait(bftps_session_context_t *session) {
+    return BFTPS_TRANSFER_LOOP_STATUS_EXIT;
+}
+
+void bftps_transfer_tree_release(bftps_transfer_tree_t *tree) {
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BFTPS_TRANSFER_TREE_H
+#define BFTPS_TRANSFER_TREE_H
+
+#include "bftps_transfer.h"
+#include "bftps_session.h"
+
+// all can be overridden at build time
+#ifndef BFTPS_TRANSFER_TREE_THREADS /* threads walking directories in parallel */
+#define BFTPS_TRANSFER_TREE_THREADS 4
+#endif
+#ifndef BFTPS_TRANSFER_TREE_MAX /* SITE RMTREE and DU running at once in the server */
+#define BFTPS_TRANSFER_TREE_MAX 2
+#endif
+#ifndef BFTPS_TRANSFER_TREE_FIND_MAX /* SITE FIND running at once in the server */
+#define BFTPS_TRANSFER_TREE_FIND_MAX 2
+#endif
+#ifndef BFTPS_TRANSFER_TREE_ERRORS /* failures listed in the reply, the rest are only counted */
+#define BFTPS_TRANSFER_TREE_ERRORS 16
+#endif
+#ifndef BFTPS_TRANSFER_TREE_PROGRESS /* seconds between progress lines */
+#define BFTPS_TRANSFER_TREE_PROGRESS 1
+#endif
+#ifndef BFTPS_TRANSFER_TREE_QUEUE /* directories queued, past it the threads walk them right away */
+#define BFTPS_TRANSFER_TREE_QUEUE 4096
+#endif
+#ifndef BFTPS_TRANSFER_TREE_FIND_BUFFER /* SITE FIND matches waiting for the data connection */
+#define BFTPS_TRANSFER_TREE_FIND_BUFFER (64 * 1024)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        BFTPS_TRANSFER_TREE_REMOVE, /* SITE RMTREE, delete everything */
+        BFTPS_TRANSFER_TREE_USAGE, /* SITE DU, add up the sizes */
+        BFTPS_TRANSFER_TREE_FIND, /* SITE FIND, send the paths that match */
+    } bftps_transfer_tree_kind_t;
+
+    extern int bftps_transfer_tree_init();
+    extern void bftps_transfer_tree_destroy();
+    // descriptor to poll, it is readable once a tree is done, -1 if there is none
+    extern int bftps_transfer_tree_fd();
+    extern void bftps_transfer_tree_poll();
+    // walk the directory args on the tree threads, the session replies once
+    // it is done
+    extern int bftps_transfer_tree(bftps_session_context_t *session, const char *args,
+            bftps_transfer_tree_kind_t kind);
+    // send the paths below a directory matching a name pattern and filters
+    // as the tree threads find them - Requires a PORT or PASV connection
+    extern int bftps_transfer_tree_find(bftps_session_context_t *session, const char *args);
+    // transfer callback, sends the matches SITE FIND has found so far
+    extern bftps_transfer_loop_status_t bftps_transfer_tree_find_send(
+            bftps_session_context_t *session);
+    // transfer callback, sends the progress and failures and replies once
+    // the walk is done
+    extern bftps_transfer_loop_status_t bftps_transfer_tree_wait(
+            bftps_session_context_t *session);
+    // the session doesn't wait anymore, a walk still running is stopped
+    extern void bftps_transfer_tree_release(bftps_transfer_tree_t *tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BFTPS_TRANSFER_TREE_H */
+